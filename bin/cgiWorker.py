@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+# Pooled CGI worker for Python scripts (see `cgiWorkers` in the README).
+#
+# The server starts this worker ahead of the requests, with the server end of a control socket as descriptor 3.
+# Each request arrives on it as `<length>\n` followed by the working directory, the script and the environment
+# entries (each one terminated by a null byte), with the standard input and output of the script attached to it
+# (its standard error stays the one of the server). The script is run in this interpreter, its exit status is
+# written back as `<status>\n`, and its streams are let go of, which ends its output. The worker exits once the
+# control socket is closed.
+
+import array
+import os
+import runpy
+import socket
+import sys
+import traceback
+
+CONTROL_FD = 3
+RECEIVE_SIZE = 65536
+
+
+def receive(control):
+    buffer = b''
+    fds = []
+    length = None
+    while length is None or len(buffer) < length:
+        data, ancdata, _, _ = control.recvmsg(RECEIVE_SIZE, socket.CMSG_SPACE(2 * array.array('i').itemsize))
+        if not data:
+            return None
+        for level, kind, cmsg in ancdata:
+            if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+                received = array.array('i')
+                received.frombytes(cmsg[:len(cmsg) - len(cmsg) % received.itemsize])
+                fds.extend(received)
+        buffer += data
+        if length is None and b'\n' in buffer:
+            header, buffer = buffer.split(b'\n', 1)
+            length = int(header)
+    fields = buffer[:length].split(b'\0')[:-1]
+    return fields[0], fields[1], fields[2:], fds
+
+
+def run(directory, script, environment):
+    os.chdir(directory)
+    os.environ.clear()
+    for entry in environment:
+        name, _, value = entry.partition(b'=')
+        os.environ[os.fsdecode(name)] = os.fsdecode(value)
+    sys.argv = [os.fsdecode(script)]
+    sys.path[0] = os.fsdecode(directory)
+    try:
+        runpy.run_path(os.fsdecode(script), run_name='__main__')
+    except SystemExit as exit:
+        if exit.code is None:
+            return 0
+        if isinstance(exit.code, int):
+            return exit.code
+        print(exit.code, file=sys.stderr)
+        return 1
+    except BaseException:
+        traceback.print_exc()
+        return 1
+    return 0
+
+
+def main():
+    control = socket.socket(fileno=CONTROL_FD)
+    devnull = os.open(os.devnull, os.O_RDWR)
+    while True:
+        request = receive(control)
+        if request is None:
+            return
+        directory, script, environment, fds = request
+        if len(fds) != 2:
+            return
+
+        os.dup2(fds[0], 0)
+        os.dup2(fds[1], 1)
+        os.close(fds[0])
+        os.close(fds[1])
+        sys.stdin = os.fdopen(0, 'r', closefd=False)
+        sys.stdout = os.fdopen(1, 'w', closefd=False)
+
+        status = run(directory, script, environment)
+        try:
+            sys.stdout.flush()
+            sys.stderr.flush()
+        except OSError:
+            pass
+
+        # The status has to be there before the server sees the end of the output.
+        control.sendall(b'%d\n' % (status & 0xff))
+        os.dup2(devnull, 0)
+        os.dup2(devnull, 1)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+# Plain FastCGI responder for Python scripts (see `fastcgiBinds` in the README).
+#
+# Usage: fastCGIResponder.py unix:<path> | <host>:<port>
+#
+# Every connection is served by a process of its own, one request at a time (the responder does not multiplex).
+# A request runs the script in `SCRIPT_FILENAME` in this interpreter, with the parameters of the request as its
+# environment and the body of the request as its standard input. Whatever the script writes to its standard output
+# is sent as it is flushed, and the script is interrupted by the next write once the request is aborted. Its
+# standard error stays the one of the responder.
+
+import io
+import os
+import runpy
+import select
+import signal
+import socket
+import struct
+import sys
+import traceback
+
+FCGI_VERSION = 1
+FCGI_BEGIN_REQUEST = 1
+FCGI_ABORT_REQUEST = 2
+FCGI_END_REQUEST = 3
+FCGI_PARAMS = 4
+FCGI_STDIN = 5
+FCGI_STDOUT = 6
+FCGI_GET_VALUES = 9
+FCGI_GET_VALUES_RESULT = 10
+FCGI_UNKNOWN_TYPE = 11
+
+FCGI_RESPONDER = 1
+FCGI_KEEP_CONN = 1
+FCGI_REQUEST_COMPLETE = 0
+FCGI_UNKNOWN_ROLE = 3
+
+RECEIVE_SIZE = 65536
+RECORD_SIZE = 65535
+OUTPUT_BUFFER_SIZE = 8192
+
+
+class Aborted(Exception):
+    pass
+
+
+class Connection:
+    def __init__(self, sock):
+        self.sock = sock
+        self.buffer = b''
+
+    # Returns the next record as `(type, request id, content)`, or None if `block` is off and it is yet to arrive.
+    def record(self, block=True):
+        while True:
+            if len(self.buffer) >= 8:
+                _, kind, request_id, length, padding, _ = struct.unpack('>BBHHBB', self.buffer[:8])
+                end = 8 + length + padding
+                if len(self.buffer) >= end:
+                    content = self.buffer[8:8 + length]
+                    self.buffer = self.buffer[end:]
+                    return kind, request_id, content
+            if not block and not select.select([self.sock], [], [], 0)[0]:
+                return None
+            data = self.sock.recv(RECEIVE_SIZE)
+            if not data:
+                raise EOFError
+            self.buffer += data
+
+    def send(self, kind, request_id, content=b''):
+        offset = 0
+        while True:
+            part = content[offset:offset + RECORD_SIZE]
+            self.sock.sendall(struct.pack('>BBHHBB', FCGI_VERSION, kind, request_id, len(part), 0, 0) + part)
+            offset += len(part)
+            if offset >= len(content):
+                return
+
+    def end_request(self, request_id, app_status, protocol_status=FCGI_REQUEST_COMPLETE):
+        self.send(FCGI_END_REQUEST, request_id, struct.pack('>IB3x', app_status & 0xffffffff, protocol_status))
+
+
+def encode_pair(name, value):
+    def length(n):
+        return struct.pack('>B', n) if n < 128 else struct.pack('>I', n | 0x80000000)
+    return length(len(name)) + length(len(value)) + name + value
+
+
+def decode_pairs(data):
+    pairs = {}
+    offset = 0
+    while offset < len(data):
+        lengths = []
+        for _ in range(2):
+            if data[offset] < 128:
+                lengths.append(data[offset])
+                offset += 1
+            else:
+                lengths.append(struct.unpack('>I', data[offset:offset + 4])[0] & 0x7fffffff)
+                offset += 4
+        name = data[offset:offset + lengths[0]]
+        offset += lengths[0]
+        pairs[name] = data[offset:offset + lengths[1]]
+        offset += lengths[1]
+    return pairs
+
+
+# The standard output of a script, sent as `FCGI_STDOUT` records. Every write checks whether the request was
+# aborted in the meantime.
+class Output(io.RawIOBase):
+    def __init__(self, connection, request_id):
+        self.connection = connection
+        self.request_id = request_id
+
+    def writable(self):
+        return True
+
+    def write(self, data):
+        while True:
+            record = self.connection.record(block=False)
+            if record is None:
+                break
+            if record[0] == FCGI_ABORT_REQUEST and record[1] == self.request_id:
+                raise Aborted()
+        self.connection.send(FCGI_STDOUT, self.request_id, bytes(data))
+        return len(data)
+
+
+def run(connection, request_id, params, body):
+    script = params.get(b'SCRIPT_FILENAME', b'')
+    os.environ.clear()
+    for name, value in params.items():
+        os.environ[os.fsdecode(name)] = os.fsdecode(value)
+    os.chdir(os.path.dirname(script) or b'.')
+    sys.argv = [os.fsdecode(script)]
+    sys.path[0] = os.fsdecode(os.path.dirname(script))
+    sys.stdin = io.TextIOWrapper(io.BytesIO(body))
+    sys.stdout = io.TextIOWrapper(io.BufferedWriter(Output(connection, request_id), OUTPUT_BUFFER_SIZE))
+    status = 0
+    try:
+        runpy.run_path(os.fsdecode(script), run_name='__main__')
+    except SystemExit as exit:
+        if isinstance(exit.code, int):
+            status = exit.code
+        elif exit.code is not None:
+            print(exit.code, file=sys.stderr)
+            status = 1
+    except Aborted:
+        return 1
+    except BaseException:
+        traceback.print_exc()
+        status = 1
+    try:
+        sys.stdout.flush()
+    except Aborted:
+        return 1
+    return status
+
+
+def serve(connection):
+    while True:
+        kind, request_id, content = connection.record()
+        if kind == FCGI_GET_VALUES:
+            values = {b'FCGI_MPXS_CONNS': b'0', b'FCGI_MAX_REQS': b'1', b'FCGI_MAX_CONNS': b'64'}
+            names = decode_pairs(content)
+            result = b''.join(encode_pair(name, values[name]) for name in names if name in values)
+            connection.send(FCGI_GET_VALUES_RESULT, 0, result)
+            continue
+        if request_id == 0:
+            connection.send(FCGI_UNKNOWN_TYPE, 0, struct.pack('>B7x', kind))
+            continue
+        if kind != FCGI_BEGIN_REQUEST:
+            continue
+
+        role, flags = struct.unpack('>HB5x', content)
+        if role != FCGI_RESPONDER:
+            connection.end_request(request_id, 0, FCGI_UNKNOWN_ROLE)
+            continue
+
+        params = b''
+        body = b''
+        params_done = False
+        stdin_done = False
+        aborted = False
+        while not (params_done and stdin_done) and not aborted:
+            kind, record_id, content = connection.record()
+            if record_id != request_id:
+                continue
+            if kind == FCGI_PARAMS:
+                params += content
+                params_done = not content
+            elif kind == FCGI_STDIN:
+                body += content
+                stdin_done = not content
+            elif kind == FCGI_ABORT_REQUEST:
+                aborted = True
+
+        status = 1 if aborted else run(connection, request_id, decode_pairs(params), body)
+        connection.send(FCGI_STDOUT, request_id)
+        connection.end_request(request_id, status)
+        if not flags & FCGI_KEEP_CONN:
+            return
+
+
+def listen(address):
+    if address.startswith('unix:'):
+        path = address[len('unix:'):]
+        if os.path.exists(path):
+            os.unlink(path)
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.bind(path)
+    else:
+        host, _, port = address.rpartition(':')
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.bind((host or '127.0.0.1', int(port)))
+    sock.listen(64)
+    return sock
+
+
+def main():
+    if len(sys.argv) != 2:
+        print('Usage: %s unix:<path> | <host>:<port>' % sys.argv[0], file=sys.stderr)
+        sys.exit(2)
+    listener = listen(sys.argv[1])
+    signal.signal(signal.SIGCHLD, signal.SIG_IGN)
+    while True:
+        sock, _ = listener.accept()
+        if os.fork() == 0:
+            listener.close()
+            try:
+                serve(Connection(sock))
+            except (EOFError, OSError):
+                pass
+            os._exit(0)
+        sock.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,193 @@
+#ifndef BODY_HPP
+#define BODY_HPP
+
+#include "ystl.hpp"
+#include <cstddef>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+#ifndef STREAM_CHUNK_SIZE
+#define STREAM_CHUNK_SIZE 65536
+#endif
+
+// Maximum amount of file data that is handed to a single `sendfile` call.
+#ifndef SENDFILE_CHUNK_SIZE
+#define SENDFILE_CHUNK_SIZE (1024 * 1024)
+#endif
+
+
+namespace Webserv {
+	struct Error;
+
+	// `IResponseBody` represents a body of an HTTP response that is not stored within the response itself, and is
+	// instead transmitted to the client piece by piece by the `ResponseHandler`, once the response header is sent.
+	class IResponseBody {
+	public:
+		virtual ~IResponseBody();
+
+		// Returns the length of the body, if it is known ahead of time. Bodies with unknown length are sent to
+		// the client using chunked transfer encoding.
+		virtual Option<size_t> getLength() const = 0;
+
+		// Sends the next part of the body into the socket. Returns true while there is more of the body left
+		// to send.
+		virtual Result<bool, Error> transmit(int socketFd) = 0;
+	};
+
+	// `IBodyProducer` is an interface for the sources of generated content, that produce the body gradually.
+	class IBodyProducer {
+	public:
+		virtual ~IBodyProducer();
+
+		// Appends the next piece of the body to `out`. Returns false once the whole body has been produced.
+		virtual Result<bool, Error> produce(std::string& out) = 0;
+	};
+
+	// `StringBody` is a response body that is already fully present in memory. It may carry an identity, which
+	// uniquely names its content (for example, a cached page together with its version), so that the
+	// representations derived from it (such as compressed ones) can be cached as well.
+	class StringBody: public IResponseBody {
+	public:
+		StringBody(const std::string&, const Option<std::string>& identity = NONE);
+
+		Option<size_t> getLength() const;
+		Result<bool, Error> transmit(int socketFd);
+		const std::string& getData() const;
+		const Option<std::string>& getIdentity() const;
+	private:
+		std::string data;
+		Option<std::string> identity;
+		size_t offset;
+	};
+
+	// `StreamBody` is a response body which is generated by an `IBodyProducer`. The producer is asked for one
+	// piece of the body per dispatcher turn. Unless the length of the body is known ahead of time, each piece is
+	// sent as a separate chunk of the chunked transfer encoding.
+	class StreamBody: public IResponseBody {
+	public:
+		StreamBody(const SharedPtr<IBodyProducer>&, const Option<size_t>& length = NONE);
+
+		Option<size_t> getLength() const;
+		Result<bool, Error> transmit(int socketFd);
+		SharedPtr<IBodyProducer> getProducer() const;
+	private:
+		SharedPtr<IBodyProducer> producer;
+		Option<size_t> length;
+		size_t produced;
+		std::string pending;
+		size_t pendingOffset;
+		bool finished;
+	};
+
+	// `FileHandle` owns an open file descriptor, and closes it once the handle is destroyed. It is meant to be
+	// shared through `SharedPtr`, so that a single descriptor may back several response bodies.
+	class FileHandle {
+	public:
+		FileHandle(int fd);
+		~FileHandle();
+
+		int getDescriptor() const;
+	private:
+		FileHandle(const FileHandle&); // No implementation
+		FileHandle& operator=(const FileHandle&); // No implementation
+
+		int fd;
+	};
+
+	// `FileBody` is a response body that is sent straight from a file with `sendfile`, so the file contents
+	// never have to be copied through user space. The body is a sequence of parts, each of which is either a
+	// region of the file, or a literal string (such as the delimiters between the parts of multipart/byteranges).
+	class FileBody: public IResponseBody {
+	public:
+		FileBody(const SharedPtr<FileHandle>&);
+
+		// Appends a region of the file to the body.
+		void addRegion(off_t offset, size_t length);
+
+		// Appends a literal string to the body.
+		void addString(const std::string&);
+
+		// Makes the body drop the pages of the file from the page cache once they are sent, so that sending a
+		// large file does not evict the pages of other files.
+		void setDropBehind(bool);
+
+		// Makes the body read this many bytes of the file ahead before sending the first of them.
+		void setReadahead(size_t length);
+
+		Option<size_t> getLength() const;
+		Result<bool, Error> transmit(int socketFd);
+	private:
+		struct Part {
+			bool fromFile;
+			off_t offset;
+			size_t length;
+			std::string str;
+		};
+
+		void dropSentPages(int socketFd, const Part&);
+
+		SharedPtr<FileHandle> file;
+		std::vector<Part> parts;
+		size_t partIdx;
+		size_t partOffset;
+		bool dropBehind;
+		// Offset within the current part, up to which its pages were asked to be dropped.
+		size_t droppedOffset;
+		size_t readaheadLength;
+	};
+
+	// `SealedBlob` is an immutable in-memory file that holds generated content, so that the content can be sent
+	// with `sendfile` just like static files are, and shared by any number of responses without being copied.
+	// On Linux, it is a memfd that is sealed against any further modification.
+	class SealedBlob {
+	public:
+		// Creates a blob with the data. Returns `NONE` if the system could not provide one.
+		static Option<SharedPtr<SealedBlob> > make(const std::string& data);
+
+		const SharedPtr<FileHandle>& getFile() const;
+		size_t getSize() const;
+
+		// Reads the contents of the blob back into memory.
+		Option<std::string> read() const;
+	private:
+		SealedBlob(const SharedPtr<FileHandle>&, size_t size);
+
+		SharedPtr<FileHandle> file;
+		size_t size;
+	};
+
+	// `BlobBody` is a response body that is sent out of a sealed blob. Like `StringBody`, it may carry an identity
+	// of its content.
+	class BlobBody: public FileBody {
+	public:
+		BlobBody(const SharedPtr<SealedBlob>&, const Option<std::string>& identity = NONE);
+
+		const SharedPtr<SealedBlob>& getBlob() const;
+		const Option<std::string>& getIdentity() const;
+	private:
+		SharedPtr<SealedBlob> blob;
+		Option<std::string> identity;
+	};
+
+	// `FileProducer` produces a region of a file piece by piece, so that the file contents can be transformed
+	// (such as compressed) on their way to the client without reading the whole file into memory.
+	class FileProducer: public IBodyProducer {
+	public:
+		FileProducer(const SharedPtr<FileHandle>&, off_t offset, size_t length);
+
+		Result<bool, Error> produce(std::string& out);
+	private:
+		SharedPtr<FileHandle> file;
+		off_t offset;
+		size_t remaining;
+	};
+
+	// Frames `data` as a single chunk of chunked transfer encoding and appends it to `out`.
+	void appendChunk(std::string& out, const std::string& data);
+
+	// Appends the terminating (empty) chunk of chunked transfer encoding to `out`.
+	void appendLastChunk(std::string& out);
+}
+
+#endif
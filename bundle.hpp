@@ -0,0 +1,123 @@
+#ifndef BUNDLE_HPP
+#define BUNDLE_HPP
+
+#include "body.hpp"
+#include "ystl.hpp"
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+#define BUNDLE_MAGIC "WSBUNDLE"
+#define BUNDLE_VERSION 1
+
+namespace Webserv {
+	struct Error;
+
+	// A bundle is a single file that packs a whole tree of static files, so that they can be served out of one
+	// memory mapping instead of being looked up and opened one by one.
+	//
+	// A bundle starts with a `BundleHeader`, which is followed by the index: an array of `BundleEntry` records,
+	// sorted by the hashes of their paths (and by the paths themselves within the same hash). The index is
+	// followed by the contents of the files, and then by the string table that stores the paths and entity tags.
+	// All the offsets are relative to the start of the bundle, and the numbers are stored in the byte order of
+	// the machine that built the bundle.
+
+	// Representations of a file that a bundle can hold.
+	enum BundleVariant {
+		BUNDLE_IDENTITY,
+		BUNDLE_GZIP,
+		BUNDLE_BROTLI,
+		BUNDLE_VARIANT_COUNT,
+	};
+
+	struct BundleHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t entryCount;
+		uint64_t indexOffset;
+		uint64_t dataOffset;
+		uint64_t stringsOffset;
+		uint64_t size;
+	};
+
+	// A region of the bundle, which holds either some file contents, or a string.
+	struct BundleRegion {
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	struct BundleEntry {
+		uint64_t pathHash;
+		BundleRegion path;
+		int64_t mtime;
+		// Bit N is set if the entry has the representation N of `BundleVariant`. The identity is always present.
+		uint32_t variants;
+		uint32_t reserved;
+		BundleRegion contents[BUNDLE_VARIANT_COUNT];
+		BundleRegion etags[BUNDLE_VARIANT_COUNT];
+	};
+
+	// Returns the hash of a path, as used by the index of a bundle.
+	uint64_t bundlePathHash(const std::string& path);
+
+	// `Bundle` is a bundle file that is mapped into memory in its entirety. Looking files up in it and sending
+	// them to the clients involves no file system calls at all.
+	class Bundle {
+	public:
+		// Maps the bundle at `path` into memory and validates its layout.
+		static Result<SharedPtr<Bundle>, Error> open(const std::string& path);
+		~Bundle();
+
+		// Finds the file by its path within the bundle (with no leading slash, e.g. `css/site.css`).
+		const BundleEntry* find(const std::string& path) const;
+
+		// Returns a pointer to the start of the region within the mapping.
+		const char* getData(const BundleRegion&) const;
+
+		// Returns the contents of the region as a string.
+		std::string getString(const BundleRegion&) const;
+
+		// Brings the pages of the region into memory ahead of the first request for them.
+		void prefetch(const BundleRegion&) const;
+
+		uint32_t getEntryCount() const;
+	private:
+		Bundle(void* mapping, size_t size);
+		Bundle(const Bundle&); // No implementation
+		Bundle& operator=(const Bundle&); // No implementation
+
+		bool containsRegion(const BundleRegion&) const;
+		Option<std::string> validate() const;
+
+		void* mapping;
+		size_t size;
+		const BundleHeader* header;
+		const BundleEntry* entries;
+	};
+
+	// `BundleBody` is a response body that is written to the client straight out of the mapping of a bundle. It
+	// keeps the bundle alive until the body is sent.
+	class BundleBody: public IResponseBody {
+	public:
+		BundleBody(const SharedPtr<Bundle>&, const char* data, size_t length);
+
+		Option<size_t> getLength() const;
+		Result<bool, Error> transmit(int socketFd);
+	private:
+		SharedPtr<Bundle> bundle;
+		const char* data;
+		size_t length;
+		size_t offset;
+	};
+
+	// Returns the bundle at `path`, mapping it on the first use. Bundles stay mapped for the lifetime of the server.
+	Result<SharedPtr<Bundle>, Error> loadBundle(const std::string& path);
+
+	// Packs all the files found under `sourceDir` into a bundle at `outputPath`. The `.gz` and `.br` siblings of
+	// files are packed as their precompressed variants. If `compress` is set, gzip variants are also made for the
+	// files that have none, as long as compression makes them smaller. The bundle is written to a temporary file
+	// first and then renamed, so that the server may keep serving the previous version while it is being built.
+	Option<Error> buildBundle(const std::string& sourceDir, const std::string& outputPath, bool compress);
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include "ystl.hpp"
+#include <cstddef>
+#include <list>
+#include <map>
+
+namespace Webserv {
+
+	// `LRUCache<K, V>` is a key-value cache that is bounded by the total weight of the values it stores (usually
+	// their size in bytes). When an insertion exceeds the capacity, the least recently used entries get evicted first.
+	template <typename K, typename V>
+	class LRUCache {
+	public:
+		// Constructs an empty cache that can hold up to `capacity` units of weight.
+		LRUCache(size_t capacity): capacity(capacity), usage(0) {}
+
+		// Returns a pointer to the cached value, or NULL if the key is missing. A successful lookup marks the
+		// entry as the most recently used one.
+		V* find(const K& key) {
+			typename std::map<K, Entry>::iterator it = entries.find(key);
+			if (it == entries.end()) return NULL;
+			order.splice(order.begin(), order, it->second.orderIt);
+			return &it->second.value;
+		}
+
+		// Inserts (or replaces) a value with the specified weight. Values heavier than the whole cache are not stored.
+		void insert(const K& key, const V& value, size_t weight) {
+			erase(key);
+			if (weight > capacity) return;
+			while (usage + weight > capacity && !order.empty()) {
+				K victim = order.back();
+				erase(victim);
+			}
+			order.push_front(key);
+			Entry entry = { value, weight, order.begin() };
+			entries.insert(std::make_pair(key, entry));
+			usage += weight;
+		}
+
+		// Removes the value from the cache, if it is present.
+		void erase(const K& key) {
+			typename std::map<K, Entry>::iterator it = entries.find(key);
+			if (it == entries.end()) return;
+			usage -= it->second.weight;
+			order.erase(it->second.orderIt);
+			entries.erase(it);
+		}
+
+		// Returns the total weight of the stored values.
+		size_t getUsage() const {
+			return usage;
+		}
+
+		// Returns the maximum total weight of the stored values.
+		size_t getCapacity() const {
+			return capacity;
+		}
+	private:
+		struct Entry {
+			V value;
+			size_t weight;
+			typename std::list<K>::iterator orderIt;
+		};
+
+		size_t capacity;
+		size_t usage;
+		std::map<K, Entry> entries;
+		std::list<K> order;
+	};
+}
+
+#endif
@@ -1,11 +1,152 @@
 #ifndef CGI_HPP
 #define CGI_HPP
 
+#include "config.hpp"
+#include "http.hpp"
+#include "webserv.hpp"
+#include "ystl.hpp"
+#include <map>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// `posix_spawn` can only change the working directory of the child with glibc 2.29 and later (elsewhere, the
+// child is started with `vfork`), and only close the inherited descriptors with glibc 2.34 and later.
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define CGI_SPAWN_CHDIR
+#endif
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define CGI_SPAWN_CLOSEFROM
+#endif
+
+// Descriptor that pooled CGI workers receive their requests on.
+#ifndef CGI_WORKER_CONTROL_FD
+#define CGI_WORKER_CONTROL_FD 3
+#endif
+
+// Largest header block that the output of a CGI script may start with.
+#ifndef CGI_HEADER_MAX_SIZE
+#define CGI_HEADER_MAX_SIZE 65536
+#endif
+
+// Amount of the output of a CGI script that may wait to be sent to the client before the script is paused.
+#ifndef CGI_OUTPUT_BUFFER_SIZE
+#define CGI_OUTPUT_BUFFER_SIZE 262144
+#endif
+
 namespace Webserv {
+	class FDTaskDispatcher;
+
+	// Takes the header block (header lines, with the status in a `Status` header, and the empty line that ends them)
+	// off the start of the output of a CGI script, and sets up `response` with it. Returns false if the header block
+	// is yet to arrive as a whole, and an error if it is malformed.
+	Result<bool, Error> parseCGIHeaders(std::string& output, HTTPResponse& response);
+
 	class CGIRuntime {
 	public:
 	private:
 	};
-};
 
-#endif
\ No newline at end of file
+	// `CGIEnvironment` is the environment that the CGI scripts of a location are run with. The part of it that is the
+	// same for every request (the environment of the server itself, and the meta-variables of the server) is built
+	// once per location, and a request only adds its own variables on top of it.
+	class CGIEnvironment {
+	public:
+		// Returns the environment of the location, which is built on its first use.
+		static const CGIEnvironment& forLocation(const Config::Server::Location&, const ServerData&);
+
+		// Returns the environment of a request, as a null-terminated array for `execve`. It points into the
+		// environment and into `requestVariables` (of `NAME=value` strings), so it may not outlive either of them.
+		std::vector<char*> withRequest(const std::vector<std::string>& requestVariables) const;
+
+		// Returns the working directory of the server, as seen by its own environment.
+		const Option<std::string>& getPwd() const;
+	private:
+		CGIEnvironment(const ServerData&);
+
+		// Variables inherited from the server, which point into its own environment.
+		std::vector<char*> inherited;
+		std::vector<std::string> variables;
+		Option<std::string> pwd;
+	};
+
+	// A pooled CGI worker process, and the server end of its control socket.
+	struct CGIWorker {
+		pid_t pid;
+		int controlFd;
+		uint requestsServed;
+	};
+
+	// `CGIWorkerPool` keeps interpreters of an extension started ahead of the requests. Each of them runs a worker
+	// script, which waits on a control socket (descriptor 3) for requests. A request is handed to an idle worker
+	// as a message that carries the working directory, the script and the environment, along with the standard
+	// streams of the script (passed with `SCM_RIGHTS`), and the worker runs the script in the interpreter that has
+	// already started up. Once the script is done, the worker writes its exit status to the control socket, closes
+	// the streams and waits for the next request.
+	//
+	// The pool keeps at least the minimum of idle workers, as fast as the spawn rate allows, and never more than
+	// the maximum of workers in total. A worker is replaced once it has served the largest number of requests, or
+	// once it misbehaves. Requests that find no idle worker start an interpreter of their own, as usual.
+	class CGIWorkerPool {
+	public:
+		// Creates the pools of the extensions that have a worker script, and starts their first workers.
+		static void startPools(const Config&, char** envp, FDTaskDispatcher&);
+
+		// Returns the pool of the extension, if it has one.
+		static CGIWorkerPool* forExtension(const std::string& extension);
+
+		// Hands the request over to an idle worker, which takes over the two descriptors (the ones of the server
+		// stay open). Returns nothing if there is no idle worker.
+		Option<CGIWorker> dispatch(
+			const std::string& workingDirectory,
+			const std::string& script,
+			char** envp,
+			int stdinFd,
+			int stdoutFd
+		);
+
+		// Takes the worker back once its script is done, and reads the exit status of the script. The worker goes
+		// back to the idle ones, or is replaced. Returns nothing if the worker failed to report the status.
+		Option<int> checkIn(CGIWorker, FDTaskDispatcher&);
+
+		// Sends the worker away while its script may still be running, such as when its output is abandoned.
+		void discard(const CGIWorker&);
+
+		// Starts idle workers up to the minimum, as far as the spawn rate allows. If it does not, the rest are
+		// started later.
+		void refill(FDTaskDispatcher*);
+	private:
+		CGIWorkerPool(const std::string& interpreter, const std::string& workerScript, const Config&, char** envp);
+		CGIWorkerPool(const CGIWorkerPool&); // No implementation
+		CGIWorkerPool& operator=(const CGIWorkerPool&); // No implementation
+
+		bool spawn();
+		bool takeSpawnToken();
+		void retire(const CGIWorker&);
+		void reapRetired();
+
+		std::string interpreter;
+		std::string workerScript;
+		char** envp;
+		uint minIdle;
+		uint maxWorkers;
+		uint maxRequests;
+		uint spawnRate;
+
+		std::vector<CGIWorker> idle;
+		uint busy;
+		// Workers that were sent away, and are yet to exit.
+		std::vector<pid_t> retired;
+
+		// The spawn rate is enforced with a token bucket, which holds at most a second worth of spawns.
+		double spawnTokens;
+		double lastRefillTime;
+		bool refillScheduled;
+
+		static std::map<std::string, CGIWorkerPool*> pools;
+
+		friend class CGIPoolRefiller;
+	};
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include "body.hpp"
+#include "config.hpp"
+#include "http.hpp"
+#include "ystl.hpp"
+#include <cstddef>
+#include <string>
+#include <zlib.h>
+
+// Total size of the compressed representations that are kept in memory.
+#ifndef COMPRESSION_CACHE_SIZE
+#define COMPRESSION_CACHE_SIZE (8 * 1024 * 1024)
+#endif
+
+// Compressed representations larger than this are sent without being kept in the cache.
+#ifndef COMPRESSION_CACHEABLE_SIZE
+#define COMPRESSION_CACHEABLE_SIZE (1024 * 1024)
+#endif
+
+// Decoded request bodies up to this size are not held to the ratio limit, as small bodies may compress very well.
+#ifndef DECODE_RATIO_THRESHOLD
+#define DECODE_RATIO_THRESHOLD (1024 * 1024)
+#endif
+
+namespace Webserv {
+	struct Error;
+
+	// Content codings that responses can be compressed with on the fly.
+	enum ContentCoding {
+		CODING_GZIP,
+		CODING_DEFLATE,
+	};
+
+	// Returns the name of the content coding, as used by `Content-Encoding`.
+	const char* contentCodingName(ContentCoding);
+
+	// `Compressor` is a zlib compression stream, which compresses the data fed into it incrementally.
+	class Compressor {
+	public:
+		Compressor(ContentCoding, int level);
+		~Compressor();
+
+		// Compresses `in` and appends whatever output is ready to `out`. Once `finish` is set, all of the remaining
+		// output is flushed and the stream is terminated.
+		Option<Error> compress(const std::string& in, std::string& out, bool finish);
+	private:
+		Compressor(const Compressor&); // No implementation
+		Compressor& operator=(const Compressor&); // No implementation
+
+		z_stream stream;
+		bool initialized;
+	};
+
+	// `Decompressor` is a zlib decompression stream, which decodes a compressed request body incrementally. As a
+	// small body may decode into a huge one, the decoded size is limited both in total and in proportion to the
+	// encoded size, and decoding stops as soon as either limit is crossed.
+	class Decompressor {
+	public:
+		Decompressor(ContentCoding, size_t maxSize, uint maxRatio);
+		~Decompressor();
+
+		// Decodes the next piece of the body, appending the decoded data to `out`.
+		Option<Error> decompress(const char* data, size_t length, std::string& out);
+
+		// Checks that the body has ended with the end of the compressed stream.
+		Option<Error> finish();
+	private:
+		Decompressor(const Decompressor&); // No implementation
+		Decompressor& operator=(const Decompressor&); // No implementation
+
+		z_stream stream;
+		bool initialized;
+		bool ended;
+		size_t maxSize;
+		uint maxRatio;
+	};
+
+	// Returns the coding of a request body from its `Content-Encoding`, or `NONE` if the body is not encoded.
+	// Fails with `415 Unsupported Media Type` on codings that can not be decoded.
+	Result<Option<ContentCoding>, Error> requestBodyCoding(const Option<std::string>& contentEncoding);
+
+	// Decodes the whole in-memory request body.
+	Result<std::string, Error> decompressString(
+		const std::string& data,
+		ContentCoding,
+		size_t maxSize,
+		uint maxRatio
+	);
+
+	// `CompressingProducer` compresses the output of another producer piece by piece, as it is being produced.
+	// If an identity of the content is provided, the complete compressed output is stored in the compression
+	// cache, as long as it is small enough.
+	class CompressingProducer: public IBodyProducer {
+	public:
+		CompressingProducer(
+			const SharedPtr<IBodyProducer>& source,
+			ContentCoding,
+			int level,
+			const Option<std::string>& identity = NONE
+		);
+
+		Result<bool, Error> produce(std::string& out);
+	private:
+		SharedPtr<IBodyProducer> source;
+		Compressor compressor;
+		Option<std::string> cacheKey;
+		std::string cacheBuffer;
+		bool finished;
+	};
+
+	// Checks whether the location compresses responses of the media type on the fly. Such responses vary
+	// based on `Accept-Encoding`, whether or not a particular one ends up compressed.
+	bool isCompressible(const Config::Server::Location&, const std::string& contentType);
+
+	// Picks the coding that a response of the media type and length should be compressed with, or returns `NONE`
+	// if it should be sent as is.
+	Option<ContentCoding> negotiateCompression(
+		const Option<std::string>& acceptEncoding,
+		const Config::Server::Location&,
+		const std::string& contentType,
+		const Option<size_t>& length
+	);
+
+	// Looks up the compressed representation of the content with the identity in the compression cache.
+	Option<SharedPtr<SealedBlob> > findCompressed(ContentCoding, int level, const std::string& identity);
+
+	// Stores the compressed representation of the content with the identity in the compression cache, if it
+	// fits there. Returns the blob that the representation is now kept in.
+	Option<SharedPtr<SealedBlob> > storeCompressed(
+		ContentCoding,
+		int level,
+		const std::string& identity,
+		const std::string& compressed
+	);
+
+	// Compresses the whole in-memory content.
+	Result<std::string, Error> compressString(const std::string& data, ContentCoding, int level);
+
+	// Compresses a successful response on the fly, if the location and the client allow it. Both in-memory
+	// and streamed bodies are supported; the latter ones are compressed incrementally.
+	void compressResponse(
+		HTTPResponse&,
+		const Option<std::string>& acceptEncoding,
+		const Config::Server::Location&
+	);
+}
+
+#endif
@@ -10,7 +10,56 @@
 #define HTTP_POST_FLAG (1<<1)
 #define HTTP_PUT_FLAG (1<<2)
 #define HTTP_DELETE_FLAG (1<<3)
-#define HTTP_ALL_FLAGS (HTTP_GET_FLAG | HTTP_POST_FLAG | HTTP_PUT_FLAG | HTTP_DELETE_FLAG)
+#define HTTP_COPY_FLAG (1<<4)
+#define HTTP_MOVE_FLAG (1<<5)
+#define HTTP_ALL_FLAGS (HTTP_GET_FLAG | HTTP_POST_FLAG | HTTP_PUT_FLAG | HTTP_DELETE_FLAG | HTTP_COPY_FLAG | HTTP_MOVE_FLAG)
+// Methods of locations that do not list theirs. COPY and MOVE rearrange the files of the root, so they have to be
+// allowed explicitly.
+#define HTTP_DEFAULT_FLAGS (HTTP_GET_FLAG | HTTP_POST_FLAG | HTTP_PUT_FLAG | HTTP_DELETE_FLAG)
+
+#ifndef GZIP_DEFAULT_LEVEL
+#define GZIP_DEFAULT_LEVEL 6
+#endif
+
+#ifndef GZIP_DEFAULT_MIN_LENGTH
+#define GZIP_DEFAULT_MIN_LENGTH 256
+#endif
+
+#ifndef FADVISE_DEFAULT_MIN_SIZE
+#define FADVISE_DEFAULT_MIN_SIZE (1024 * 1024)
+#endif
+
+#ifndef WARMUP_DEFAULT_BUDGET
+#define WARMUP_DEFAULT_BUDGET (256 * 1024 * 1024)
+#endif
+
+#ifndef WARMUP_DEFAULT_TOP
+#define WARMUP_DEFAULT_TOP 1000
+#endif
+
+#ifndef GROUP_COMMIT_DEFAULT_DELAY
+#define GROUP_COMMIT_DEFAULT_DELAY 10
+#endif
+
+#ifndef DECODE_DEFAULT_MAX_RATIO
+#define DECODE_DEFAULT_MAX_RATIO 100
+#endif
+
+#ifndef CGI_POOL_DEFAULT_MIN_IDLE
+#define CGI_POOL_DEFAULT_MIN_IDLE 2
+#endif
+
+#ifndef CGI_POOL_DEFAULT_MAX_WORKERS
+#define CGI_POOL_DEFAULT_MAX_WORKERS 8
+#endif
+
+#ifndef CGI_POOL_DEFAULT_MAX_REQUESTS
+#define CGI_POOL_DEFAULT_MAX_REQUESTS 1000
+#endif
+
+#ifndef CGI_POOL_DEFAULT_SPAWN_RATE
+#define CGI_POOL_DEFAULT_SPAWN_RATE 5
+#endif
 
 namespace Webserv {
 	// `Config` stores parsed configuration for the web server
@@ -47,8 +96,106 @@ namespace Webserv {
 				Option<std::string> fileUploadFieldId;
         
 				bool allowCGI;
+
+				// Optional address of a FastCGI application (`unix:<path>` or `<host>:<port>`) that runs all of the
+				// scripts of the location, instead of an interpreter being started for each request.
+				Option<std::string> fastcgiPass;
+
+				// Specifies whether the scripts of the location are run by the pooled workers of their extension
+				// (configured with `cgiWorkers`), instead of an interpreter being started for each request.
+				bool cgiPool;
 				
 				Option<std::string> redirection;
+
+				// Specifies how the entity tags of static files are generated, if at all.
+				enum ETagMode {
+					ETAG_STRONG,
+					ETAG_WEAK,
+					ETAG_OFF,
+				};
+				ETagMode etagMode;
+
+				// Optional value of the `Cache-Control` header that is sent along with static files.
+				Option<std::string> cacheControl;
+
+				// Optional number of seconds for which clients may cache static files. It is sent as the `Expires`
+				// header, and as `max-age` of `Cache-Control` unless that one is configured explicitly.
+				Option<uint> expires;
+
+				// Specifies whether precompressed `.gz` siblings of static files should be served to clients
+				// that accept gzip encoding.
+				bool gzipStatic;
+
+				// Specifies whether precompressed `.br` siblings of static files should be served to clients
+				// that accept brotli encoding.
+				bool brotliStatic;
+
+				// Specifies whether eligible responses should be compressed on the fly for clients that accept
+				// gzip or deflate encoding.
+				bool gzip;
+
+				// zlib compression level (from 1 to 9) of the on-the-fly compression.
+				int gzipLevel;
+
+				// Responses shorter than this many bytes are not worth compressing. Responses of unknown length
+				// (streamed ones) are always compressed.
+				uint gzipMinLength;
+
+				// Media types that are compressed on the fly. If empty, a built-in set of textual types is used.
+				std::set<std::string> gzipTypes;
+
+				// Optional path to a bundle of static files. If set, the location serves the files out of the bundle
+				// instead of the root directory.
+				Option<std::string> bundle;
+
+				// Specifies whether static files are opened with the sequential access advice, which makes the
+				// kernel read further ahead of the reads.
+				bool fadviseSequential;
+
+				// Specifies whether the kernel is asked to start reading the beginning of static files as soon as
+				// they are opened.
+				bool fadviseWillNeed;
+
+				// Size (in bytes) starting from which the static files get the access advice of `fadvise`, so that the
+				// small files served often are left to the default readahead.
+				uint fadviseMinSize;
+
+				// Optional size (in bytes) starting from which the static files have the pages that were already sent
+				// dropped from the page cache, so that large downloads do not evict the files that are served often.
+				Option<uint> dropBehindSize;
+
+				// Number of bytes of a static file that are read ahead before its first byte is sent. Zero disables
+				// it.
+				uint readaheadSize;
+
+				// Ordered candidates for the file to serve, with `$uri` standing for the requested path within the
+				// location. The last candidate is the fallback: either a path, or `=<status code>`. Empty if the
+				// requested file is served as is.
+				std::vector<std::string> tryFiles;
+
+				// Specifies what has to reach the disk before an upload is acknowledged: nothing, each file on its
+				// own, or the uploads completed within a short window all together.
+				enum Durability {
+					DURABILITY_NONE,
+					DURABILITY_FILE,
+					DURABILITY_GROUP,
+				};
+				Durability durability;
+
+				// Number of milliseconds for which acknowledgements of uploads are held back with group durability,
+				// so that the uploads completed meanwhile are synced along with them.
+				uint groupCommitDelay;
+
+				// Specifies whether request bodies compressed with gzip or deflate are decoded before they are
+				// stored or passed on to CGI scripts. Otherwise, they are passed on as they are.
+				bool decodeRequestBodies;
+
+				// Optional largest size (in bytes) of a decoded request body. Defaults to the largest size of the
+				// request body.
+				Option<uint> maxDecodedSize;
+
+				// Largest ratio of the decoded size of a request body to its encoded size.
+				uint maxDecodeRatio;
 			};
 
 			// A map of locations and their paths.
@@ -69,6 +216,20 @@ namespace Webserv {
 			std::map<ushort, std::string> errPages;
 
 			bool optional;
+
+			// Optional size (in bytes) starting from which the in-memory response data is sent to the clients with
+			// `MSG_ZEROCOPY`. Zero-copy sends are disabled if unset.
+			Option<uint> zeroCopyThreshold;
+
+			// Optional path to a list of the hot paths of the server, whose files are loaded into the caches at
+			// startup. The list is either a manifest with a path per line, or an access log of a previous run.
+			Option<std::string> warmupList;
+
+			// Total size (in bytes) of the contents that the warmup may load.
+			uint warmupBudget;
+
+			// Number of the most requested paths of an access log that are warmed up.
+			uint warmupTop;
 		};
 
 		// List of servers.
@@ -82,6 +243,23 @@ namespace Webserv {
 
 		std::map<std::string, std::string> cgiBinds;
 
+		// Addresses of the FastCGI applications that run the scripts with these extensions. They take precedence
+		// over `cgiBinds`.
+		std::map<std::string, std::string> fastcgiBinds;
+
+		// Worker scripts that the interpreters of the pooled CGI workers run, by the extension of the scripts.
+		std::map<std::string, std::string> cgiWorkers;
+
+		// Number of idle workers that each pool keeps started, and the largest number of workers it may have.
+		uint cgiPoolMinIdle;
+		uint cgiPoolMaxWorkers;
+
+		// Number of requests after which a worker is replaced with a fresh one.
+		uint cgiPoolMaxRequests;
+
+		// Largest number of workers that each pool starts per second.
+		uint cgiPoolSpawnRate;
+
 		uint messageBufferSize;
 	};
 
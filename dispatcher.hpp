@@ -93,6 +93,18 @@ namespace Webserv {
 
 		void removeByFd(int fd);
 
+		// Keeps the descriptor open while no task is registered for it, until it is released. It lets a response
+		// be registered some time after the task that has received the request is done.
+		void retainDescriptor(int fd);
+		void releaseDescriptor(int fd);
+
+		// Stops waiting for the descriptor of an active task to become readable or writable. The task is still run
+		// when an error condition is reported on the descriptor (such as notifications on a socket error queue).
+		void suspendIO(int fd);
+
+		// Waits for the descriptor of an active task to become readable or writable again, once it was suspended.
+		void resumeIO(int fd);
+
 	private:
 		// Constructs the `FDTaskDispatcher` instance.
 		FDTaskDispatcher();
@@ -34,9 +34,9 @@ local part2 = [[
 ]]
 
 io.write([[
-]]..tostring(part1:len()).."\n"..[[
+]]..string.format("%x", part1:len()).."\n"..[[
 ]]..part1.."\n"..[[
-]]..tostring(part2:len()).."\n"..[[
+]]..string.format("%x", part2:len()).."\n"..[[
 ]]..part2.."\n"..[[
 0
 ]])
\ No newline at end of file
@@ -0,0 +1,105 @@
+#ifndef FASTCGI_HPP
+#define FASTCGI_HPP
+
+#include "ystl.hpp"
+#include <cstddef>
+#include <map>
+#include <string>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+// Largest content of a single record that is sent. It is the largest content length that a record may have,
+// rounded down to a multiple of 8, so that the records sent need no padding.
+#ifndef FASTCGI_RECORD_SIZE
+#define FASTCGI_RECORD_SIZE 65528
+#endif
+
+// Largest number of connections that are opened to a single FastCGI application.
+#ifndef FASTCGI_MAX_CONNECTIONS
+#define FASTCGI_MAX_CONNECTIONS 64
+#endif
+
+// Largest amount of the responses of a FastCGI application that is read from its connection at once.
+#ifndef FASTCGI_RECEIVE_SIZE
+#define FASTCGI_RECEIVE_SIZE 65536
+#endif
+
+namespace Webserv {
+	struct Error;
+
+	// Types of the records of the FastCGI protocol.
+	enum FastCGIRecordType {
+		FCGI_BEGIN_REQUEST = 1,
+		FCGI_ABORT_REQUEST = 2,
+		FCGI_END_REQUEST = 3,
+		FCGI_PARAMS = 4,
+		FCGI_STDIN = 5,
+		FCGI_STDOUT = 6,
+		FCGI_STDERR = 7,
+		FCGI_DATA = 8,
+		FCGI_GET_VALUES = 9,
+		FCGI_GET_VALUES_RESULT = 10,
+		FCGI_UNKNOWN_TYPE = 11,
+	};
+
+	// Statuses that an application reports a request to have ended with.
+	enum FastCGIProtocolStatus {
+		FCGI_REQUEST_COMPLETE = 0,
+		FCGI_CANT_MPX_CONN = 1,
+		FCGI_OVERLOADED = 2,
+		FCGI_UNKNOWN_ROLE = 3,
+	};
+
+	// A record received from a FastCGI application.
+	struct FastCGIRecord {
+		FastCGIRecordType type;
+		ushort requestId;
+		std::string content;
+	};
+
+	// Appends a single record to `out`. The content must fit into a record.
+	void appendFastCGIRecord(std::string& out, FastCGIRecordType, ushort requestId, const std::string& content);
+
+	// Appends a stream (such as `FCGI_PARAMS` or `FCGI_STDIN`) to `out`, split into as many records as it takes,
+	// followed by the empty record that ends the stream.
+	void appendFastCGIStream(std::string& out, FastCGIRecordType, ushort requestId, const std::string& data);
+
+	// Appends the `FCGI_BEGIN_REQUEST` record of a request in the responder role. With `keepConnection` set, the
+	// application leaves the connection open once the request has ended.
+	void appendFastCGIBeginRequest(std::string& out, ushort requestId, bool keepConnection);
+
+	// Appends a name-value pair, as carried by `FCGI_PARAMS` and `FCGI_GET_VALUES` records.
+	void appendFastCGIPair(std::string& out, const std::string& name, const std::string& value);
+
+	// Reads the name-value pairs out of the content of a record, or returns nothing if they are malformed.
+	Option<std::map<std::string, std::string> > parseFastCGIPairs(const std::string& content);
+
+	// `FastCGIRecordParser` cuts the stream received from a FastCGI application into records, as it arrives.
+	class FastCGIRecordParser {
+	public:
+		FastCGIRecordParser();
+
+		void append(const char* data, size_t length);
+
+		// Takes the next complete record out of the stream. Returns false if it is yet to arrive as a whole, and an
+		// error if the stream is malformed.
+		Result<bool, Error> next(FastCGIRecord& record);
+	private:
+		std::string buffer;
+		size_t offset;
+	};
+
+	// The address of a FastCGI application: either `unix:<path>` of a Unix socket, or `<host>:<port>` of a TCP one.
+	// The host is a numeric IPv4 address, or `localhost`.
+	struct FastCGIAddress {
+		sockaddr_storage address;
+		socklen_t length;
+	};
+
+	Option<FastCGIAddress> parseFastCGIAddress(const std::string&);
+
+	// Opens a non-blocking connection to the application. The connection may still be in progress when it returns.
+	Result<int, Error> connectFastCGI(const FastCGIAddress&);
+}
+
+#endif
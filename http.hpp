@@ -1,11 +1,13 @@
 #ifndef HTTP_HPP
 #define HTTP_HPP
 
+#include "body.hpp"
 #include "url.hpp"
 #include "ystl.hpp"
 #include <map>
 #include <ostream>
 #include <string>
+#include <vector>
 
 namespace Webserv {
 
@@ -16,6 +18,8 @@ namespace Webserv {
 		PUT,
 		DELETE,
 		HEAD,
+		COPY,
+		MOVE,
 	};
 
 	// Returns a name of the HTTP method as a c-string.
@@ -61,6 +65,10 @@ namespace Webserv {
 			Option<std::string> getHeader(const std::string&) const;
 			bool isChunked() const;
 			bool chunkedReadFinished() const;
+
+			// Stops collecting the body of the request, and returns the part of it that was read along with
+			// the header. The rest of the body is only counted, as it is consumed elsewhere.
+			std::string detachData();
 		private:
 			Result<State, Error> readChunk(const std::string&);
 
@@ -72,6 +80,7 @@ namespace Webserv {
 			std::string chunkReadLeftover;
 			uint chunkSizeLeftover;
 			bool chunkedReadComplete;
+			bool dataDetached;
 		};
 
 		// Attempts to construct a `HTTPRequest` instance from provided text.
@@ -90,6 +99,9 @@ namespace Webserv {
 
 		Option<std::string> getHeader(const std::string&) const;
 
+		// Returns all of the headers of the request, by their names.
+		const std::map<std::string, std::string>& getHeaders() const;
+
 		bool isForm() const;
 
 		std::string toString() const;
@@ -97,6 +109,9 @@ namespace Webserv {
 		HTTPRequest withData(const std::string&) const;
 
 		Option<HTTPRequest> unchunked() const;
+
+		// Returns the request with its compressed body replaced by the decoded one.
+		HTTPRequest withDecodedData(const std::string&) const;
 	private:
 		// It's here so you can't construct an empty HTTPRequest.
 		void setData(const std::string&);
@@ -207,10 +222,29 @@ namespace Webserv {
 		// Sets a single key in the response header to the provided value.
 		void setHeader(const std::string& key, const std::string& value);
 
+		// Retrieves a header of the response. Header names are matched case-insensitively, since responses
+		// produced by CGI scripts may spell them in any case.
+		Option<std::string> getHeader(const std::string& key) const;
+
+		// Removes a header from the response, regardless of the case of its name.
+		void removeHeader(const std::string& key);
+
 		// Sets the HTTP return code of a response.
 		void setCode(HTTPReturnCode);
 
-		// Builds response into a string.
+		// Returns the HTTP return code of a response.
+		HTTPReturnCode getCode() const;
+
+		// Retrieves the data segment of the response.
+		const std::string& getData() const;
+
+		// Sets the body that is transmitted after the response header, instead of the data segment.
+		void setBody(const SharedPtr<IResponseBody>&);
+
+		// Returns the body that should be transmitted after the response header, if there is one.
+		Option<SharedPtr<IResponseBody> > getBody() const;
+
+		// Builds response into a string. If the response has a body set, only the header is built.
 		std::string build() const;
 
 	private:
@@ -218,6 +252,7 @@ namespace Webserv {
 		HTTPReturnCode retCode;
 		std::string data;
 		std::map<std::string, std::string> headers;
+		Option<SharedPtr<IResponseBody> > body;
 	};
 
 	enum HTTPContentType {
@@ -230,6 +265,21 @@ namespace Webserv {
 		JPEG,
 	};
 
+	// A single byte range of a resource, from `first` to `last` byte inclusive.
+	struct ByteRange {
+		size_t first;
+		size_t last;
+	};
+
+	// Parses the value of a `Range` header, resolved against a resource of `size` bytes. Overlapping and adjacent
+	// ranges are merged together. Returns `NONE` if the header is invalid and should be ignored, or an empty vector
+	// if none of the ranges can be satisfied.
+	Option<std::vector<ByteRange> > parseByteRanges(const std::string& header, size_t size);
+
+	// Returns the quality value (from 0 to 1) that the `Accept-Encoding` header assigns to the content coding.
+	// Zero means that the coding is not acceptable.
+	float encodingQuality(const std::string& acceptEncoding, const std::string& coding);
+
 	// Returns a string that represents an HTTP content type in the header.
 	std::string contentTypeString(HTTPContentType);
 
@@ -0,0 +1,103 @@
+#ifndef MULTIPART_HPP
+#define MULTIPART_HPP
+
+#include "rootDirectory.hpp"
+#include "upload.hpp"
+#include "ystl.hpp"
+#include <cstddef>
+#include <string>
+
+// Largest block of part headers that is accepted. Headers are the only part of the body that has to be buffered
+// as a whole.
+#ifndef MULTIPART_HEADER_LIMIT
+#define MULTIPART_HEADER_LIMIT 8192
+#endif
+
+// Largest amount of the body that is taken into the buffer of the parser at once.
+#ifndef MULTIPART_SLICE_SIZE
+#define MULTIPART_SLICE_SIZE 65536
+#endif
+
+namespace Webserv {
+	struct Error;
+
+	// Returns the boundary of a `multipart/form-data` body from its content type, or nothing if the content type
+	// is different or has no boundary.
+	Option<std::string> multipartBoundary(const std::string& contentType);
+
+	// `BoundaryMatcher` finds a delimiter in a buffer with the Boyer-Moore-Horspool algorithm: the delimiter is
+	// compared from its end, and a mismatch skips ahead by as much as the last byte under the delimiter allows.
+	// With the long, random-looking boundaries that clients generate, most of the body is skipped over by the
+	// whole length of the delimiter, without looking at the bytes in between.
+	class BoundaryMatcher {
+	public:
+		BoundaryMatcher(const std::string& delimiter);
+
+		// Returns the position of the first occurrence of the delimiter within the buffer, or `npos`.
+		size_t find(const char* data, size_t length) const;
+
+		const std::string& getDelimiter() const;
+	private:
+		std::string delimiter;
+		size_t skip[256];
+	};
+
+	// `MultipartUpload` parses a `multipart/form-data` body incrementally, as it arrives, and writes the contents
+	// of every part that carries a file name straight into a file of that name in the upload directory (each file is
+	// published in one step once its part is complete, just like the files uploaded with PUT). The other
+	// parts are skipped. Only the headers of the current part and a tail as long as the delimiter are kept in
+	// memory, so the memory used by an upload does not depend on the size of the files.
+	class MultipartUpload: public IUploadSink {
+	public:
+		MultipartUpload(
+			const RootDirectory& uploadDir,
+			const std::string& boundary,
+			Durability durability = Config::Server::Location::DURABILITY_NONE
+		);
+		~MultipartUpload();
+
+		// Parses the next piece of the body, writing out whatever file contents it completes.
+		Option<Error> feed(const char* data, size_t length);
+
+		// Checks that the body has ended properly, once all of it was fed. A file that was being written when the
+		// body ended (or when parsing failed) is discarded.
+		Option<Error> finish();
+
+		Option<int> takeSyncDescriptor();
+
+		// Returns the number of files stored so far.
+		size_t getFileCount() const;
+	private:
+		enum State {
+			PREAMBLE,
+			DELIMITER_END,
+			PART_HEADERS,
+			PART_DATA,
+			EPILOGUE,
+			FAILED,
+		};
+
+		MultipartUpload(const MultipartUpload&); // No implementation
+		MultipartUpload& operator=(const MultipartUpload&); // No implementation
+
+		Option<Error> parse();
+		Option<Error> startPart(const std::string& headers);
+		Option<Error> writeData(size_t length);
+		Option<Error> closeFile();
+		void abandonFile();
+		Error fail(const Error&);
+
+		RootDirectory uploadDir;
+		BoundaryMatcher matcher;
+		State state;
+		std::string buffer;
+		// The file of the current part, if it has one.
+		FileUpload* file;
+		size_t fileCount;
+		Durability durability;
+		// Descriptor on the file system of the stored files, while it is yet to be synced.
+		Option<int> syncFd;
+	};
+}
+
+#endif
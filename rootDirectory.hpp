@@ -0,0 +1,58 @@
+#ifndef ROOT_DIRECTORY_HPP
+#define ROOT_DIRECTORY_HPP
+
+#include "ystl.hpp"
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Number of milliseconds for which the results of `statCached` are trusted.
+#ifndef STAT_CACHE_TTL_MS
+#define STAT_CACHE_TTL_MS 1000
+#endif
+
+// Total size of the file metadata that is kept in the cache.
+#ifndef STAT_CACHE_SIZE
+#define STAT_CACHE_SIZE (1024 * 1024)
+#endif
+
+namespace Webserv {
+	struct Error;
+
+	// `RootDirectory` is a root directory of a location, which is opened once and then used as the base for
+	// resolving the paths of requested files. Resolving relative to the directory descriptor makes the kernel walk
+	// only the part of the path below the root, and (where `openat2` is available) guarantees that the resolved
+	// file lies beneath the root: `..`, absolute symlinks and magic links can not lead outside of it.
+	struct RootDirectory {
+		// Path of the directory, as configured.
+		std::string path;
+
+		// Descriptor of the directory, which stays open for the lifetime of the server.
+		int fd;
+
+		// Returns the path of the file on disk, for messages and cache keys.
+		std::string diskPath(const std::string& relativePath) const;
+	};
+
+	// Returns the root directory at `path`, opening it on the first use.
+	Result<RootDirectory, Error> openRootDirectory(const std::string& path);
+
+	// Opens the file at `relativePath` beneath the root directory. An empty path refers to the root itself.
+	// Returns the descriptor, or -1 with `errno` set, just like `open` does.
+	int openBeneath(const RootDirectory&, const std::string& relativePath, int flags, mode_t mode = 0);
+
+	// Retrieves the metadata of the file beneath the root directory. Returns -1 with `errno` set on failure.
+	int statBeneath(const RootDirectory&, const std::string& relativePath, struct stat& st);
+
+	// Retrieves the metadata of the file beneath the root directory, just like `statBeneath`, but answers from the
+	// cache of recent results (the failed ones included) for as long as they are fresh, with no system calls.
+	int statCached(const RootDirectory&, const std::string& relativePath, struct stat& st);
+
+	// Drops the cached metadata of the file, once the server itself has changed the file.
+	void forgetCachedStat(const RootDirectory&, const std::string& relativePath);
+
+	// Removes the file beneath the root directory. Returns -1 with `errno` set on failure.
+	int unlinkBeneath(const RootDirectory&, const std::string& relativePath);
+}
+
+#endif
@@ -0,0 +1,328 @@
+#include "body.hpp"
+#include "error.hpp"
+#include "ystl.hpp"
+#include "zeroCopy.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#ifdef LINUX
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#endif
+
+namespace Webserv {
+	IResponseBody::~IResponseBody() {}
+
+	IBodyProducer::~IBodyProducer() {}
+
+	// Writes out the `str`, starting from `offset`. Returns true while some part of the string is left unsent. Only
+	// the strings that stay intact for as long as the response exists may be sent with zero-copy.
+	static Result<bool, Error> writeFrom(int fd, const std::string& str, size_t& offset, bool zeroCopy = false) {
+		if (offset >= str.size()) return false;
+		long writeResult = zeroCopy
+			? sendBuffer(fd, str.data() + offset, str.size() - offset)
+			: write(fd, str.data() + offset, str.size() - offset);
+		if (writeResult <= 0) {
+			return Error(Error::GENERIC_ERROR, "Failed to write the response body");
+		}
+		offset += writeResult;
+		return offset < str.size();
+	}
+
+	StringBody::StringBody(const std::string& str, const Option<std::string>& identity):
+		data(str),
+		identity(identity),
+		offset(0) {}
+
+	Option<size_t> StringBody::getLength() const {
+		return data.size();
+	}
+
+	Result<bool, Error> StringBody::transmit(int socketFd) {
+		return writeFrom(socketFd, data, offset, true);
+	}
+
+	const std::string& StringBody::getData() const {
+		return data;
+	}
+
+	const Option<std::string>& StringBody::getIdentity() const {
+		return identity;
+	}
+
+	StreamBody::StreamBody(const SharedPtr<IBodyProducer>& prod, const Option<size_t>& len):
+		producer(prod),
+		length(len),
+		produced(0),
+		pending(),
+		pendingOffset(0),
+		finished(false) {}
+
+	Option<size_t> StreamBody::getLength() const {
+		return length;
+	}
+
+	Result<bool, Error> StreamBody::transmit(int socketFd) {
+		// Only ask for the next piece once the previous one is fully sent, so the amount of buffered data
+		// stays bounded by the size of a single piece.
+		if (pendingOffset >= pending.size()) {
+			if (finished) return false;
+			pending.clear();
+			pendingOffset = 0;
+
+			std::string piece;
+			Result<bool, Error> result = producer->produce(piece);
+			if (result.isError()) return result.getError();
+			produced += piece.size();
+			if (length.isNone()) {
+				appendChunk(pending, piece);
+			}
+			else {
+				pending.swap(piece);
+			}
+			if (!result.getValue()) {
+				finished = true;
+				if (length.isNone()) {
+					appendLastChunk(pending);
+				}
+				else if (produced != length.get()) {
+					// The client is told the length in advance, so a body of another length breaks the connection.
+					return Error(Error::GENERIC_ERROR, "The body does not match its announced length");
+				}
+			}
+			if (pending.empty()) return !finished;
+		}
+
+		Result<bool, Error> written = writeFrom(socketFd, pending, pendingOffset);
+		if (written.isError()) return written.getError();
+		return written.getValue() || !finished;
+	}
+
+	SharedPtr<IBodyProducer> StreamBody::getProducer() const {
+		return producer;
+	}
+
+	FileHandle::FileHandle(int fd): fd(fd) {}
+
+	FileHandle::~FileHandle() {
+		if (fd >= 0) close(fd);
+	}
+
+	int FileHandle::getDescriptor() const {
+		return fd;
+	}
+
+	FileBody::FileBody(const SharedPtr<FileHandle>& f):
+		file(f),
+		parts(),
+		partIdx(0),
+		partOffset(0),
+		dropBehind(false),
+		droppedOffset(0),
+		readaheadLength(0) {}
+
+	void FileBody::addRegion(off_t offset, size_t length) {
+		if (length == 0) return;
+		Part part;
+		part.fromFile = true;
+		part.offset = offset;
+		part.length = length;
+		parts.push_back(part);
+	}
+
+	void FileBody::addString(const std::string& str) {
+		if (str.empty()) return;
+		Part part;
+		part.fromFile = false;
+		part.offset = 0;
+		part.length = str.size();
+		part.str = str;
+		parts.push_back(part);
+	}
+
+	void FileBody::setDropBehind(bool drop) {
+		dropBehind = drop;
+	}
+
+	void FileBody::setReadahead(size_t length) {
+		readaheadLength = length;
+	}
+
+	Option<size_t> FileBody::getLength() const {
+		size_t length = 0;
+		for (std::vector<Part>::const_iterator it = parts.begin(); it != parts.end(); it++) {
+			length += it->length;
+		}
+		return length;
+	}
+
+	// Sends up to `count` bytes of the file, starting from `offset`.
+	static long sendFileRegion(int socketFd, int fileFd, off_t offset, size_t count) {
+#ifdef LINUX
+		return sendfile(socketFd, fileFd, &offset, count);
+#else
+		char buffer[STREAM_CHUNK_SIZE];
+		if (count > sizeof(buffer)) count = sizeof(buffer);
+		long readResult = pread(fileFd, buffer, count, offset);
+		if (readResult <= 0) return readResult;
+		return write(socketFd, buffer, readResult);
+#endif
+	}
+
+	void FileBody::dropSentPages(int socketFd, const Part& part) {
+#ifdef LINUX
+		// The pages that the socket buffer still refers to (until the client acknowledges them) would not be
+		// dropped anyway.
+		int queued = 0;
+		if (ioctl(socketFd, SIOCOUTQ, &queued) < 0 || queued < 0) queued = 0;
+		if (partOffset <= static_cast<size_t>(queued)) return;
+		size_t until = partOffset - queued;
+		if (until <= droppedOffset) return;
+		// The kernel only drops the pages that lie within the range entirely, and a large folio may span more than
+		// one of the steps, so the range always starts at the beginning of the region.
+		posix_fadvise(file->getDescriptor(), part.offset, until, POSIX_FADV_DONTNEED);
+		droppedOffset = until;
+#else
+		(void)part;
+#endif
+	}
+
+	Result<bool, Error> FileBody::transmit(int socketFd) {
+		if (partIdx >= parts.size()) return false;
+
+		Part& part = parts[partIdx];
+		if (part.fromFile) {
+#ifdef LINUX
+			// The first read of a cold file is waited for anyway, so it may as well fetch more than `sendfile` would.
+			if (readaheadLength > 0) {
+				size_t readaheadCount = part.length - partOffset;
+				if (readaheadCount > readaheadLength) readaheadCount = readaheadLength;
+				readahead(file->getDescriptor(), part.offset + partOffset, readaheadCount);
+				readaheadLength = 0;
+			}
+#endif
+			size_t count = part.length - partOffset;
+			if (count > SENDFILE_CHUNK_SIZE) count = SENDFILE_CHUNK_SIZE;
+			long sent = sendFileRegion(socketFd, file->getDescriptor(), part.offset + partOffset, count);
+			if (sent <= 0) {
+				// Zero means that the file got shorter than it was when the response was made.
+				return Error(Error::GENERIC_ERROR, "Failed to send a file region");
+			}
+			partOffset += sent;
+			if (dropBehind) dropSentPages(socketFd, part);
+		}
+		else {
+			Result<bool, Error> written = writeFrom(socketFd, part.str, partOffset);
+			if (written.isError()) return written.getError();
+		}
+
+		if (partOffset >= part.length) {
+			partIdx++;
+			partOffset = 0;
+			droppedOffset = 0;
+		}
+		return partIdx < parts.size();
+	}
+
+	// Writes all of the data into a freshly created file.
+	static bool fillFile(int fd, const std::string& data) {
+		size_t offset = 0;
+		while (offset < data.size()) {
+			long writeResult = write(fd, data.data() + offset, data.size() - offset);
+			if (writeResult <= 0) return false;
+			offset += writeResult;
+		}
+		return true;
+	}
+
+	SealedBlob::SealedBlob(const SharedPtr<FileHandle>& f, size_t size): file(f), size(size) {}
+
+	Option<SharedPtr<SealedBlob> > SealedBlob::make(const std::string& data) {
+#ifdef LINUX
+		int fd = memfd_create("webserv-blob", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+		char name[] = "/tmp/webserv-blob-XXXXXX";
+		int fd = mkstemp(name);
+		if (fd >= 0) unlink(name);
+#endif
+		if (fd < 0) return NONE;
+		SharedPtr<FileHandle> file(new FileHandle(fd));
+		if (!fillFile(fd, data)) return NONE;
+#ifdef LINUX
+		if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) return NONE;
+#endif
+		return SharedPtr<SealedBlob>(new SealedBlob(file, data.size()));
+	}
+
+	const SharedPtr<FileHandle>& SealedBlob::getFile() const {
+		return file;
+	}
+
+	size_t SealedBlob::getSize() const {
+		return size;
+	}
+
+	Option<std::string> SealedBlob::read() const {
+		std::string data(size, '\0');
+		size_t offset = 0;
+		while (offset < size) {
+			long readResult = pread(file->getDescriptor(), &data[offset], size - offset, offset);
+			if (readResult <= 0) return NONE;
+			offset += readResult;
+		}
+		return data;
+	}
+
+	BlobBody::BlobBody(const SharedPtr<SealedBlob>& blob, const Option<std::string>& identity):
+		FileBody(blob->getFile()),
+		blob(blob),
+		identity(identity)
+	{
+		addRegion(0, blob->getSize());
+	}
+
+	const SharedPtr<SealedBlob>& BlobBody::getBlob() const {
+		return blob;
+	}
+
+	const Option<std::string>& BlobBody::getIdentity() const {
+		return identity;
+	}
+
+	FileProducer::FileProducer(const SharedPtr<FileHandle>& f, off_t offset, size_t length):
+		file(f),
+		offset(offset),
+		remaining(length) {}
+
+	Result<bool, Error> FileProducer::produce(std::string& out) {
+		if (remaining == 0) return false;
+		char buffer[STREAM_CHUNK_SIZE];
+		size_t count = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+		long readResult = pread(file->getDescriptor(), buffer, count, offset);
+		if (readResult <= 0) {
+			// Zero means that the file got shorter than it was when the response was made.
+			return Error(Error::GENERIC_ERROR, "Failed to read a file region");
+		}
+		out.append(buffer, readResult);
+		offset += readResult;
+		remaining -= readResult;
+		return remaining > 0;
+	}
+
+	void appendChunk(std::string& out, const std::string& data) {
+		if (data.empty()) return;
+		char sizeLine[32];
+		int len = std::snprintf(sizeLine, sizeof(sizeLine), "%lx\r\n", static_cast<unsigned long>(data.size()));
+		out.append(sizeLine, len);
+		out.append(data);
+		out.append("\r\n");
+	}
+
+	void appendLastChunk(std::string& out) {
+		out.append("0\r\n\r\n");
+	}
+}
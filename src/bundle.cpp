@@ -0,0 +1,396 @@
+#include "bundle.hpp"
+#include "body.hpp"
+#include "compression.hpp"
+#include "error.hpp"
+#include "ystl.hpp"
+#include "zeroCopy.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace Webserv {
+	uint64_t bundlePathHash(const std::string& path) {
+		// 64-bit FNV-1a
+		uint64_t hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < path.size(); i++) {
+			hash ^= static_cast<unsigned char>(path[i]);
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	static bool entryHashLess(const BundleEntry& entry, uint64_t hash) {
+		return entry.pathHash < hash;
+	}
+
+	Bundle::Bundle(void* mapping, size_t size):
+		mapping(mapping),
+		size(size),
+		header(static_cast<const BundleHeader*>(mapping)),
+		entries(NULL) {}
+
+	Bundle::~Bundle() {
+		munmap(mapping, size);
+	}
+
+	Result<SharedPtr<Bundle>, Error> Bundle::open(const std::string& path) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return Error(Error::FILE_NOT_FOUND, "Could not open bundle: " + path);
+		}
+		struct stat st;
+		if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(BundleHeader)) {
+			close(fd);
+			return Error(Error::GENERIC_ERROR, "Invalid bundle: " + path);
+		}
+		void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (mapping == MAP_FAILED) {
+			return Error(Error::GENERIC_ERROR, "Could not map bundle: " + path);
+		}
+
+		SharedPtr<Bundle> bundle(new Bundle(mapping, st.st_size));
+		Option<std::string> problem = bundle->validate();
+		if (problem.isSome()) {
+			return Error(Error::GENERIC_ERROR, "Invalid bundle " + path + ": " + problem.get());
+		}
+		bundle->entries = reinterpret_cast<const BundleEntry*>(
+			static_cast<const char*>(mapping) + bundle->header->indexOffset
+		);
+
+		// Every lookup walks the index, so it is worth having it in memory before the first request arrives.
+		size_t indexEnd = bundle->header->indexOffset + bundle->header->entryCount * sizeof(BundleEntry);
+		madvise(mapping, indexEnd, MADV_WILLNEED);
+		return bundle;
+	}
+
+	bool Bundle::containsRegion(const BundleRegion& region) const {
+		return region.offset <= size && region.length <= size - region.offset;
+	}
+
+	// Checks that every part of the bundle lies within the mapping, so that lookups may trust the offsets.
+	Option<std::string> Bundle::validate() const {
+		if (std::memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0) {
+			return std::string("not a bundle");
+		}
+		if (header->version != BUNDLE_VERSION) return std::string("unsupported version");
+		if (header->size != size) return std::string("truncated");
+		if (header->indexOffset % sizeof(uint64_t) != 0
+		|| header->indexOffset > size
+		|| header->entryCount > (size - header->indexOffset) / sizeof(BundleEntry)) {
+			return std::string("index is out of bounds");
+		}
+
+		const BundleEntry* index = reinterpret_cast<const BundleEntry*>(
+			static_cast<const char*>(mapping) + header->indexOffset
+		);
+		for (uint32_t i = 0; i < header->entryCount; i++) {
+			const BundleEntry& entry = index[i];
+			if (i > 0 && entry.pathHash < index[i - 1].pathHash) return std::string("index is not sorted");
+			if (!containsRegion(entry.path)) return std::string("path is out of bounds");
+			if (!(entry.variants & (1 << BUNDLE_IDENTITY))) return std::string("file contents are missing");
+			for (uint v = 0; v < BUNDLE_VARIANT_COUNT; v++) {
+				if (!containsRegion(entry.contents[v]) || !containsRegion(entry.etags[v])) {
+					return std::string("file is out of bounds");
+				}
+			}
+		}
+		return NONE;
+	}
+
+	const BundleEntry* Bundle::find(const std::string& path) const {
+		uint64_t hash = bundlePathHash(path);
+		const BundleEntry* end = entries + header->entryCount;
+		const BundleEntry* it = std::lower_bound(entries, end, hash, entryHashLess);
+		for (; it != end && it->pathHash == hash; it++) {
+			if (it->path.length == path.size() && std::memcmp(getData(it->path), path.data(), path.size()) == 0) {
+				return it;
+			}
+		}
+		return NULL;
+	}
+
+	const char* Bundle::getData(const BundleRegion& region) const {
+		return static_cast<const char*>(mapping) + region.offset;
+	}
+
+	std::string Bundle::getString(const BundleRegion& region) const {
+		return std::string(getData(region), region.length);
+	}
+
+	void Bundle::prefetch(const BundleRegion& region) const {
+		if (region.length == 0) return;
+		size_t pageSize = sysconf(_SC_PAGESIZE);
+		size_t start = region.offset - region.offset % pageSize;
+		madvise(static_cast<char*>(mapping) + start, region.offset + region.length - start, MADV_WILLNEED);
+		// Touching every page waits for it to be read, and maps it into the process right away.
+		volatile char sink = 0;
+		for (size_t offset = start; offset < region.offset + region.length; offset += pageSize) {
+			sink ^= static_cast<const char*>(mapping)[offset];
+		}
+		(void)sink;
+	}
+
+	uint32_t Bundle::getEntryCount() const {
+		return header->entryCount;
+	}
+
+	BundleBody::BundleBody(const SharedPtr<Bundle>& bundle, const char* data, size_t length):
+		bundle(bundle),
+		data(data),
+		length(length),
+		offset(0) {}
+
+	Option<size_t> BundleBody::getLength() const {
+		return length;
+	}
+
+	Result<bool, Error> BundleBody::transmit(int socketFd) {
+		if (offset >= length) return false;
+		size_t count = length - offset;
+		if (count > SENDFILE_CHUNK_SIZE) count = SENDFILE_CHUNK_SIZE;
+		// The mapping never changes, so it can always be sent with zero-copy.
+		long writeResult = sendBuffer(socketFd, data + offset, count);
+		if (writeResult <= 0) {
+			return Error(Error::GENERIC_ERROR, "Failed to write the response body");
+		}
+		offset += writeResult;
+		return offset < length;
+	}
+
+	static std::map<std::string, SharedPtr<Bundle> > loadedBundles;
+
+	Result<SharedPtr<Bundle>, Error> loadBundle(const std::string& path) {
+		std::map<std::string, SharedPtr<Bundle> >::iterator it = loadedBundles.find(path);
+		if (it != loadedBundles.end()) return it->second;
+
+		Result<SharedPtr<Bundle>, Error> bundle = Bundle::open(path);
+		if (bundle.isError()) return bundle.getError();
+		loadedBundles[path] = bundle.getValue();
+		return bundle.getValue();
+	}
+
+	// A file that is going to be packed into a bundle.
+	struct BundleSource {
+		std::string path;
+		std::string diskPath;
+		uint64_t hash;
+
+		bool operator<(const BundleSource& other) const {
+			if (hash != other.hash) return hash < other.hash;
+			return path < other.path;
+		}
+	};
+
+	static Option<Error> collectBundleSources(
+		const std::string& diskDir,
+		const std::string& relativeDir,
+		std::vector<BundleSource>& sources
+	) {
+		DIR* dir = opendir(diskDir.c_str());
+		if (!dir) {
+			return Error(Error::FILE_NOT_FOUND, "Could not open directory: " + diskDir);
+		}
+		struct dirent* dirEntry;
+		while ((dirEntry = readdir(dir)) != NULL) {
+			std::string name = dirEntry->d_name;
+			if (name == "." || name == "..") continue;
+
+			BundleSource source;
+			source.path = relativeDir.empty() ? name : relativeDir + "/" + name;
+			source.diskPath = diskDir + "/" + name;
+			struct stat st;
+			if (stat(source.diskPath.c_str(), &st) < 0) continue;
+			if (S_ISDIR(st.st_mode)) {
+				Option<Error> error = collectBundleSources(source.diskPath, source.path, sources);
+				if (error.isSome()) {
+					closedir(dir);
+					return error;
+				}
+			}
+			else if (S_ISREG(st.st_mode)) {
+				source.hash = bundlePathHash(source.path);
+				sources.push_back(source);
+			}
+		}
+		closedir(dir);
+		return NONE;
+	}
+
+	static Option<std::string> readWholeFile(const std::string& path) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return NONE;
+		std::string contents;
+		char buffer[STREAM_CHUNK_SIZE];
+		long readResult;
+		while ((readResult = read(fd, buffer, sizeof(buffer))) > 0) {
+			contents.append(buffer, readResult);
+		}
+		close(fd);
+		if (readResult < 0) return NONE;
+		return contents;
+	}
+
+	static bool writeAt(int fd, const std::string& data, uint64_t offset) {
+		size_t written = 0;
+		while (written < data.size()) {
+			long writeResult = pwrite(fd, data.data() + written, data.size() - written, offset + written);
+			if (writeResult < 0 && errno == EINTR) continue;
+			if (writeResult <= 0) return false;
+			written += writeResult;
+		}
+		return true;
+	}
+
+	// Builds an entity tag from the contents of the file, so that it stays the same across rebuilds of the bundle
+	// for as long as the file itself does not change.
+	static std::string contentETag(const std::string& contents) {
+		std::ostringstream etag;
+		etag << "\"" << std::hex << bundlePathHash(contents) << "-" << contents.size() << "\"";
+		return etag.str();
+	}
+
+	// Checks whether the file is a compressed sibling of another file, and is packed as its variant instead.
+	static bool isVariantSibling(const std::string& path, const std::set<std::string>& paths) {
+		if (path.size() <= 3) return false;
+		std::string extension = path.substr(path.size() - 3);
+		return (extension == ".gz" || extension == ".br") && paths.count(path.substr(0, path.size() - 3));
+	}
+
+	// Packs the files into an already opened bundle file. The files must already be in the order of the index.
+	static Option<Error> writeBundle(int fd, const std::vector<BundleSource>& files, const std::set<std::string>& paths, bool compress) {
+		const char* variantSuffixes[BUNDLE_VARIANT_COUNT] = { "", ".gz", ".br" };
+		const char* variantTags[BUNDLE_VARIANT_COUNT] = { "", "-gzip", "-br" };
+
+		std::vector<BundleEntry> index(files.size());
+		uint64_t indexOffset = sizeof(BundleHeader);
+		uint64_t dataOffset = indexOffset + files.size() * sizeof(BundleEntry);
+		uint64_t cursor = dataOffset;
+
+		// String regions are relative to the string table until the table gets its place after the file contents.
+		std::string strings;
+		for (size_t i = 0; i < files.size(); i++) {
+			const BundleSource& file = files[i];
+			BundleEntry& entry = index[i];
+			std::memset(&entry, 0, sizeof(entry));
+			entry.pathHash = file.hash;
+
+			struct stat st;
+			if (stat(file.diskPath.c_str(), &st) < 0) {
+				return Error(Error::FILE_NOT_FOUND, file.diskPath);
+			}
+			entry.mtime = st.st_mtime;
+			entry.path.offset = strings.size();
+			entry.path.length = file.path.size();
+			strings.append(file.path);
+
+			std::string identity;
+			std::string identityTag;
+			for (uint v = 0; v < BUNDLE_VARIANT_COUNT; v++) {
+				Option<std::string> contents = NONE;
+				if (v == BUNDLE_IDENTITY || paths.count(file.path + variantSuffixes[v])) {
+					contents = readWholeFile(file.diskPath + variantSuffixes[v]);
+					if (contents.isNone()) {
+						return Error(Error::FILE_NOT_FOUND, file.diskPath + variantSuffixes[v]);
+					}
+				}
+				else if (v == BUNDLE_GZIP && compress) {
+					Result<std::string, Error> compressed = compressString(identity, CODING_GZIP, 9);
+					if (compressed.isOk() && compressed.getValue().size() < identity.size()) {
+						contents = compressed.getValue();
+					}
+				}
+				if (contents.isNone()) continue;
+
+				if (!writeAt(fd, contents.get(), cursor)) {
+					return Error(Error::GENERIC_ERROR, "Failed to write the bundle");
+				}
+				entry.variants |= 1 << v;
+				entry.contents[v].offset = cursor;
+				entry.contents[v].length = contents.get().size();
+				cursor += contents.get().size();
+
+				if (v == BUNDLE_IDENTITY) {
+					identity = contents.get();
+					identityTag = contentETag(identity);
+				}
+				std::string etag = identityTag.substr(0, identityTag.size() - 1) + variantTags[v] + "\"";
+				entry.etags[v].offset = strings.size();
+				entry.etags[v].length = etag.size();
+				strings.append(etag);
+			}
+		}
+
+		uint64_t stringsOffset = cursor;
+		for (std::vector<BundleEntry>::iterator it = index.begin(); it != index.end(); it++) {
+			it->path.offset += stringsOffset;
+			for (uint v = 0; v < BUNDLE_VARIANT_COUNT; v++) {
+				if (it->variants & (1 << v)) it->etags[v].offset += stringsOffset;
+			}
+		}
+
+		BundleHeader header;
+		std::memset(&header, 0, sizeof(header));
+		std::memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+		header.version = BUNDLE_VERSION;
+		header.entryCount = index.size();
+		header.indexOffset = indexOffset;
+		header.dataOffset = dataOffset;
+		header.stringsOffset = stringsOffset;
+		header.size = stringsOffset + strings.size();
+
+		std::string indexData;
+		if (!index.empty()) {
+			indexData.assign(reinterpret_cast<const char*>(&index[0]), index.size() * sizeof(BundleEntry));
+		}
+		if (!writeAt(fd, strings, stringsOffset)
+		|| !writeAt(fd, indexData, indexOffset)
+		|| !writeAt(fd, std::string(reinterpret_cast<const char*>(&header), sizeof(header)), 0)) {
+			return Error(Error::GENERIC_ERROR, "Failed to write the bundle");
+		}
+		return NONE;
+	}
+
+	Option<Error> buildBundle(const std::string& sourceDir, const std::string& outputPath, bool compress) {
+		std::vector<BundleSource> sources;
+		Option<Error> error = collectBundleSources(sourceDir, "", sources);
+		if (error.isSome()) return error;
+		std::sort(sources.begin(), sources.end());
+
+		std::set<std::string> paths;
+		for (std::vector<BundleSource>::const_iterator it = sources.begin(); it != sources.end(); it++) {
+			paths.insert(it->path);
+		}
+		std::vector<BundleSource> files;
+		for (std::vector<BundleSource>::const_iterator it = sources.begin(); it != sources.end(); it++) {
+			if (!isVariantSibling(it->path, paths)) files.push_back(*it);
+		}
+
+		std::string tempPath = outputPath + ".tmp";
+		int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			return Error(Error::GENERIC_ERROR, "Could not create bundle: " + tempPath);
+		}
+		error = writeBundle(fd, files, paths, compress);
+		if (error.isNone() && fsync(fd) < 0) {
+			error = Error(Error::GENERIC_ERROR, "Failed to write the bundle");
+		}
+		close(fd);
+		if (error.isNone() && std::rename(tempPath.c_str(), outputPath.c_str()) < 0) {
+			error = Error(Error::GENERIC_ERROR, "Could not create bundle: " + outputPath);
+		}
+		if (error.isSome()) unlink(tempPath.c_str());
+		return error;
+	}
+}
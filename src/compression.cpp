@@ -0,0 +1,365 @@
+#include "compression.hpp"
+#include "body.hpp"
+#include "cache.hpp"
+#include "config.hpp"
+#include "error.hpp"
+#include "http.hpp"
+#include "ystl.hpp"
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <zlib.h>
+
+typedef Webserv::Config::Server::Location Location;
+
+namespace Webserv {
+
+	// Compressed representations of the contents with known identities, keyed by the coding, the level and the
+	// identity of the content. They are kept in sealed blobs, so that they are sent with `sendfile`.
+	static LRUCache<std::string, SharedPtr<SealedBlob> > compressionCache(COMPRESSION_CACHE_SIZE);
+
+	// Media types that are compressed when the location does not list its own ones.
+	static const char* defaultCompressibleTypes[] = {
+		"text/html",
+		"text/plain",
+		"text/css",
+		"text/javascript",
+		"text/xml",
+		"application/javascript",
+		"application/json",
+		"application/xml",
+		"image/svg+xml",
+		NULL,
+	};
+
+	const char* contentCodingName(ContentCoding coding) {
+		switch (coding) {
+			case CODING_GZIP:
+				return "gzip";
+			case CODING_DEFLATE:
+				return "deflate";
+		}
+		return "identity";
+	}
+
+	static std::string compressionCacheKey(ContentCoding coding, int level, const std::string& identity) {
+		std::ostringstream key;
+		key << contentCodingName(coding) << ':' << level << ':' << identity;
+		return key.str();
+	}
+
+	Compressor::Compressor(ContentCoding coding, int level): initialized(false) {
+		std::memset(&stream, 0, sizeof(stream));
+		// Window bits above 15 make zlib wrap the stream into a gzip container instead of a zlib one.
+		int windowBits = coding == CODING_GZIP ? 15 + 16 : 15;
+		initialized = deflateInit2(&stream, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+	}
+
+	Compressor::~Compressor() {
+		if (initialized) deflateEnd(&stream);
+	}
+
+	Option<Error> Compressor::compress(const std::string& in, std::string& out, bool finish) {
+		if (!initialized) {
+			return Error(Error::GENERIC_ERROR, "Failed to initialize a compression stream");
+		}
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+		stream.avail_in = in.size();
+
+		char buffer[STREAM_CHUNK_SIZE];
+		int status;
+		do {
+			stream.next_out = reinterpret_cast<Bytef*>(buffer);
+			stream.avail_out = sizeof(buffer);
+			status = deflate(&stream, finish ? Z_FINISH : Z_NO_FLUSH);
+			if (status == Z_STREAM_ERROR) {
+				return Error(Error::GENERIC_ERROR, "Failed to compress the response body");
+			}
+			out.append(buffer, sizeof(buffer) - stream.avail_out);
+		} while (stream.avail_out == 0 || (finish && status != Z_STREAM_END));
+		return NONE;
+	}
+
+	Decompressor::Decompressor(ContentCoding coding, size_t maxSize, uint maxRatio):
+		initialized(false),
+		ended(false),
+		maxSize(maxSize),
+		maxRatio(maxRatio)
+	{
+		std::memset(&stream, 0, sizeof(stream));
+		int windowBits = coding == CODING_GZIP ? 15 + 16 : 15;
+		initialized = inflateInit2(&stream, windowBits) == Z_OK;
+	}
+
+	Decompressor::~Decompressor() {
+		if (initialized) inflateEnd(&stream);
+	}
+
+	Option<Error> Decompressor::decompress(const char* data, size_t length, std::string& out) {
+		if (!initialized) {
+			return Error(Error::GENERIC_ERROR, "Failed to initialize a decompression stream");
+		}
+		if (length == 0) return NONE;
+		if (ended) {
+			return Error(HTTP_BAD_REQUEST, "Request body continues past the end of its compressed stream");
+		}
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+		stream.avail_in = length;
+
+		char buffer[STREAM_CHUNK_SIZE];
+		while (stream.avail_in > 0 && !ended) {
+			stream.next_out = reinterpret_cast<Bytef*>(buffer);
+			stream.avail_out = sizeof(buffer);
+			int status = inflate(&stream, Z_NO_FLUSH);
+			if (status == Z_STREAM_END) {
+				ended = true;
+			}
+			else if (status != Z_OK && status != Z_BUF_ERROR) {
+				return Error(HTTP_BAD_REQUEST, "Malformed compressed request body");
+			}
+			size_t decoded = sizeof(buffer) - stream.avail_out;
+			if (stream.total_out > maxSize) {
+				return Error(HTTP_PAYLOAD_TOO_LARGE, "Decoded request body is too large");
+			}
+			if (stream.total_out > DECODE_RATIO_THRESHOLD && stream.total_out / maxRatio > stream.total_in) {
+				return Error(HTTP_PAYLOAD_TOO_LARGE, "Request body is compressed too well to be decoded");
+			}
+			out.append(buffer, decoded);
+		}
+		if (stream.avail_in > 0) {
+			return Error(HTTP_BAD_REQUEST, "Request body continues past the end of its compressed stream");
+		}
+		return NONE;
+	}
+
+	Option<Error> Decompressor::finish() {
+		if (!ended) return Error(HTTP_BAD_REQUEST, "Compressed request body ended unexpectedly");
+		return NONE;
+	}
+
+	Result<Option<ContentCoding>, Error> requestBodyCoding(const Option<std::string>& contentEncoding) {
+		Option<ContentCoding> none = NONE;
+		if (contentEncoding.isNone()) return none;
+		std::string coding = strToLower(trimString(contentEncoding.get(), ' '));
+		if (coding.empty() || coding == "identity") return none;
+		if (coding == "gzip" || coding == "x-gzip") return Option<ContentCoding>(CODING_GZIP);
+		if (coding == "deflate") return Option<ContentCoding>(CODING_DEFLATE);
+		return Error(HTTP_UNSUPPORTED_MEDIA_TYPE, "Unsupported request body encoding");
+	}
+
+	Result<std::string, Error> decompressString(
+		const std::string& data,
+		ContentCoding coding,
+		size_t maxSize,
+		uint maxRatio
+	) {
+		Decompressor decompressor(coding, maxSize, maxRatio);
+		std::string decoded;
+		Option<Error> error = decompressor.decompress(data.data(), data.size(), decoded);
+		if (error.isNone()) error = decompressor.finish();
+		if (error.isSome()) return error.get();
+		return decoded;
+	}
+
+	CompressingProducer::CompressingProducer(
+		const SharedPtr<IBodyProducer>& source,
+		ContentCoding coding,
+		int level,
+		const Option<std::string>& identity
+	):
+		source(source),
+		compressor(coding, level),
+		cacheKey(NONE),
+		cacheBuffer(),
+		finished(false)
+	{
+		if (identity.isSome()) {
+			cacheKey = compressionCacheKey(coding, level, identity.get());
+		}
+	}
+
+	Result<bool, Error> CompressingProducer::produce(std::string& out) {
+		if (finished) return false;
+
+		std::string piece;
+		Result<bool, Error> produced = source->produce(piece);
+		if (produced.isError()) return produced.getError();
+		finished = !produced.getValue();
+
+		std::string compressed;
+		Option<Error> error = compressor.compress(piece, compressed, finished);
+		if (error.isSome()) return error.get();
+		out.append(compressed);
+
+		// Only the outputs that fit into the cache are collected, so the memory use stays bounded.
+		if (cacheKey.isSome()) {
+			if (cacheBuffer.size() + compressed.size() > COMPRESSION_CACHEABLE_SIZE) {
+				cacheKey = NONE;
+				cacheBuffer.clear();
+			}
+			else {
+				cacheBuffer.append(compressed);
+				if (finished) {
+					Option<SharedPtr<SealedBlob> > blob = SealedBlob::make(cacheBuffer);
+					if (blob.isSome()) {
+						compressionCache.insert(cacheKey.get(), blob.get(), cacheBuffer.size() + cacheKey.get().size());
+					}
+				}
+			}
+		}
+		return !finished;
+	}
+
+	bool isCompressible(const Location& location, const std::string& contentType) {
+		if (!location.gzip) return false;
+		std::string mediaType = strToLower(trimString(contentType.substr(0, contentType.find(';')), ' '));
+		if (!location.gzipTypes.empty()) {
+			return location.gzipTypes.find(mediaType) != location.gzipTypes.end();
+		}
+		for (const char** type = defaultCompressibleTypes; *type != NULL; type++) {
+			if (mediaType == *type) return true;
+		}
+		return false;
+	}
+
+	Option<ContentCoding> negotiateCompression(
+		const Option<std::string>& acceptEncoding,
+		const Location& location,
+		const std::string& contentType,
+		const Option<size_t>& length
+	) {
+		if (acceptEncoding.isNone() || !isCompressible(location, contentType)) return NONE;
+		if (length.isSome() && length.get() < location.gzipMinLength) return NONE;
+
+		float gzipQuality = encodingQuality(acceptEncoding.get(), "gzip");
+		float deflateQuality = encodingQuality(acceptEncoding.get(), "deflate");
+		if (gzipQuality <= 0 && deflateQuality <= 0) return NONE;
+		return gzipQuality >= deflateQuality ? CODING_GZIP : CODING_DEFLATE;
+	}
+
+	Option<SharedPtr<SealedBlob> > findCompressed(ContentCoding coding, int level, const std::string& identity) {
+		SharedPtr<SealedBlob>* cached = compressionCache.find(compressionCacheKey(coding, level, identity));
+		if (!cached) return NONE;
+		return *cached;
+	}
+
+	Option<SharedPtr<SealedBlob> > storeCompressed(
+		ContentCoding coding,
+		int level,
+		const std::string& identity,
+		const std::string& compressed
+	) {
+		if (compressed.size() > COMPRESSION_CACHEABLE_SIZE) return NONE;
+		Option<SharedPtr<SealedBlob> > blob = SealedBlob::make(compressed);
+		if (blob.isNone()) return NONE;
+		std::string key = compressionCacheKey(coding, level, identity);
+		compressionCache.insert(key, blob.get(), compressed.size() + key.size());
+		return blob;
+	}
+
+	Result<std::string, Error> compressString(const std::string& data, ContentCoding coding, int level) {
+		Compressor compressor(coding, level);
+		std::string compressed;
+		Option<Error> error = compressor.compress(data, compressed, true);
+		if (error.isSome()) return error.get();
+		return compressed;
+	}
+
+	// Makes the compressed body for the content with the identity, out of the compression cache. Returns `NONE`
+	// if the identity is unknown or its compressed representation is not cached.
+	static Option<SharedPtr<IResponseBody> > cachedCompressedBody(
+		const Option<std::string>& identity,
+		ContentCoding coding,
+		int level
+	) {
+		if (identity.isNone()) return NONE;
+		Option<SharedPtr<SealedBlob> > cached = findCompressed(coding, level, identity.get());
+		if (cached.isNone()) return NONE;
+		return SharedPtr<IResponseBody>(new BlobBody(cached.get()));
+	}
+
+	// Compresses the whole in-memory content into a body. If the content has an identity, its compressed
+	// representation is stored in the compression cache as well.
+	static Option<SharedPtr<IResponseBody> > compressedBody(
+		const std::string& data,
+		const Option<std::string>& identity,
+		ContentCoding coding,
+		int level
+	) {
+		Result<std::string, Error> compressed = compressString(data, coding, level);
+		if (compressed.isError()) return NONE;
+		if (identity.isSome()) {
+			Option<SharedPtr<SealedBlob> > blob = storeCompressed(coding, level, identity.get(), compressed.getValue());
+			if (blob.isSome()) return SharedPtr<IResponseBody>(new BlobBody(blob.get()));
+		}
+		return SharedPtr<IResponseBody>(new StringBody(compressed.getValue()));
+	}
+
+	static void addVaryAcceptEncoding(HTTPResponse& resp) {
+		Option<std::string> vary = resp.getHeader("Vary");
+		if (vary.isNone()) {
+			resp.setHeader("Vary", "Accept-Encoding");
+		}
+		else if (strToLower(vary.get()).find("accept-encoding") == std::string::npos) {
+			resp.removeHeader("Vary");
+			resp.setHeader("Vary", vary.get() + ", Accept-Encoding");
+		}
+	}
+
+	void compressResponse(HTTPResponse& resp, const Option<std::string>& acceptEncoding, const Location& location) {
+		if (resp.getCode() != HTTP_OK || resp.getHeader("Content-Encoding").isSome()) return;
+		std::string contentType = resp.getHeader("Content-Type").getOr("");
+		if (!isCompressible(location, contentType)) return;
+		addVaryAcceptEncoding(resp);
+
+		Option<SharedPtr<IResponseBody> > body = resp.getBody();
+		Option<size_t> length = body.isSome() ? body.get()->getLength() : Option<size_t>(resp.getData().size());
+		Option<ContentCoding> coding = negotiateCompression(acceptEncoding, location, contentType, length);
+		if (coding.isNone()) return;
+
+		if (body.isNone()) {
+			Result<std::string, Error> compressed = compressString(resp.getData(), coding.get(), location.gzipLevel);
+			if (compressed.isError()) return;
+			resp.setData(compressed.getValue());
+		}
+		else {
+			SharedPtr<IResponseBody> bodyPtr = body.get();
+			Option<SharedPtr<StringBody> > stringBody = bodyPtr.tryAs<StringBody>();
+			Option<SharedPtr<StreamBody> > streamBody = bodyPtr.tryAs<StreamBody>();
+			Option<SharedPtr<BlobBody> > blobBody = bodyPtr.tryAs<BlobBody>();
+			if (stringBody.isSome()) {
+				const Option<std::string>& identity = stringBody.get()->getIdentity();
+				Option<SharedPtr<IResponseBody> > compressed = cachedCompressedBody(identity, coding.get(), location.gzipLevel);
+				if (compressed.isNone()) {
+					compressed = compressedBody(stringBody.get()->getData(), identity, coding.get(), location.gzipLevel);
+				}
+				if (compressed.isNone()) return;
+				resp.setBody(compressed.get());
+			}
+			else if (blobBody.isSome()) {
+				// The blob is only read back into memory when its compressed form is not cached yet.
+				const Option<std::string>& identity = blobBody.get()->getIdentity();
+				Option<SharedPtr<IResponseBody> > compressed = cachedCompressedBody(identity, coding.get(), location.gzipLevel);
+				if (compressed.isNone()) {
+					Option<std::string> data = blobBody.get()->getBlob()->read();
+					if (data.isNone()) return;
+					compressed = compressedBody(data.get(), identity, coding.get(), location.gzipLevel);
+				}
+				if (compressed.isNone()) return;
+				resp.setBody(compressed.get());
+			}
+			else if (streamBody.isSome()) {
+				SharedPtr<IBodyProducer> producer(
+					new CompressingProducer(streamBody.get()->getProducer(), coding.get(), location.gzipLevel)
+				);
+				resp.setBody(SharedPtr<IResponseBody>(new StreamBody(producer)));
+			}
+			else {
+				// Other bodies (such as files) know nothing about their contents, so they are left as they are.
+				return;
+			}
+		}
+		resp.removeHeader("Content-Length");
+		resp.setHeader("Content-Encoding", contentCodingName(coding.get()));
+	}
+}
@@ -1,5 +1,7 @@
 #include "config.hpp"
+#include "fastCGI.hpp"
 #include <cctype>
+#include <climits>
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -104,6 +106,64 @@ namespace Webserv {
 		uint depth;
 	};
 	
+	// Parses a plain decimal number, which has to fit in a `uint` (unlike `>>`, this rejects signs and trailing
+	// characters).
+	static Option<uint> parseNumber(const std::string& str) {
+		if (str.empty()) return NONE;
+		for (std::string::const_iterator it = str.begin(); it != str.end(); it++) {
+			if (!std::isdigit(*it)) return NONE;
+		}
+		std::stringstream s(str);
+		uint value;
+		if (!(s >> value) || !s.eof()) return NONE;
+		return value;
+	}
+
+	// Parses a duration in seconds, which may be suffixed with `s`, `m`, `h` or `d`.
+	static Option<uint> parseDuration(const std::string& str) {
+		if (str.empty()) return NONE;
+		uint multiplier = 1;
+		std::string number = str;
+		char unit = str[str.size() - 1];
+		if (!std::isdigit(unit)) {
+			number = str.substr(0, str.size() - 1);
+			if (unit == 's') multiplier = 1;
+			else if (unit == 'm') multiplier = 60;
+			else if (unit == 'h') multiplier = 60 * 60;
+			else if (unit == 'd') multiplier = 60 * 60 * 24;
+			else return NONE;
+		}
+		Option<uint> value = parseNumber(number);
+		if (value.isNone()) return NONE;
+		return value.get() * multiplier;
+	}
+
+	// Parses a size in bytes, which may be suffixed with `k`, `m` or `g`.
+	static Option<uint> parseSize(const std::string& str) {
+		if (str.empty()) return NONE;
+		uint multiplier = 1;
+		std::string number = str;
+		char unit = std::tolower(str[str.size() - 1]);
+		if (!std::isdigit(unit)) {
+			number = str.substr(0, str.size() - 1);
+			if (unit == 'k') multiplier = 1024;
+			else if (unit == 'm') multiplier = 1024 * 1024;
+			else if (unit == 'g') multiplier = 1024 * 1024 * 1024;
+			else return NONE;
+		}
+		Option<uint> value = parseNumber(number);
+		if (value.isNone() || value.get() > UINT_MAX / multiplier) return NONE;
+		return value.get() * multiplier;
+	}
+
+	// Applies a single access advice of the `fadvise` directive to the location.
+	static bool applyFadvise(Config::Server::Location& location, const std::string& advice) {
+		if (advice == "sequential") location.fadviseSequential = true;
+		else if (advice == "willneed") location.fadviseWillNeed = true;
+		else return false;
+		return true;
+	}
+
 	LocationResult parseLocationDirective(ParserContext &ctx) {
 		if (ctx.it == ctx.end) return UNEXPECTED_EOF;
 		
@@ -111,7 +171,23 @@ namespace Webserv {
 		location.allowCGI = false;
 		location.dirListing = false;
 		std::string sym;
-		location.allowedMethods = HTTP_ALL_FLAGS;
+		location.allowedMethods = HTTP_DEFAULT_FLAGS;
+		bool methodsListed = false;
+		location.etagMode = Config::Server::Location::ETAG_STRONG;
+		location.gzipStatic = false;
+		location.brotliStatic = false;
+		location.gzip = false;
+		location.gzipLevel = GZIP_DEFAULT_LEVEL;
+		location.gzipMinLength = GZIP_DEFAULT_MIN_LENGTH;
+		location.fadviseSequential = false;
+		location.fadviseWillNeed = false;
+		location.fadviseMinSize = FADVISE_DEFAULT_MIN_SIZE;
+		location.readaheadSize = 0;
+		location.durability = Config::Server::Location::DURABILITY_NONE;
+		location.groupCommitDelay = GROUP_COMMIT_DEFAULT_DELAY;
+		location.decodeRequestBodies = false;
+		location.maxDecodeRatio = DECODE_DEFAULT_MAX_RATIO;
+		location.cgiPool = false;
 		while (ctx.it != ctx.end) {
 			switch (ctx.it->getTag()) {
 				case Token::SYMBOL:
@@ -152,8 +228,9 @@ namespace Webserv {
 					else if (sym == "allowMethod") { // Allow single method
 						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
 						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
-						if (location.allowedMethods == HTTP_ALL_FLAGS) {
+						if (!methodsListed) {
 							location.allowedMethods = 0;
+							methodsListed = true;
 						}
 						std::string metStr = ctx.it->getSym();
 						Option<unsigned char> methodFlag = strToHttpMethod(metStr);
@@ -176,11 +253,168 @@ namespace Webserv {
 					else if (sym == "allowCGI") {
 						location.allowCGI = true;
 					}
+					else if (sym == "cgiPool") {
+						location.cgiPool = true;
+					}
+					else if (sym == "fastcgiPass") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						if (parseFastCGIAddress(ctx.it->getSym()).isNone()) return CONFIG_PARSING_ERROR;
+						location.fastcgiPass = ctx.it->getSym();
+					}
 					else if (sym == "redirect") {
 						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
 						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
 						location.redirection = ctx.it->getSym();
 					}
+					else if (sym == "etag") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						std::string mode = strToLower(ctx.it->getSym());
+						if (mode == "strong") location.etagMode = Config::Server::Location::ETAG_STRONG;
+						else if (mode == "weak") location.etagMode = Config::Server::Location::ETAG_WEAK;
+						else if (mode == "off") location.etagMode = Config::Server::Location::ETAG_OFF;
+						else return UNEXPECTED_SYMBOL;
+					}
+					else if (sym == "durability") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						std::string mode = strToLower(ctx.it->getSym());
+						if (mode == "none") location.durability = Config::Server::Location::DURABILITY_NONE;
+						else if (mode == "file") location.durability = Config::Server::Location::DURABILITY_FILE;
+						else if (mode == "group") location.durability = Config::Server::Location::DURABILITY_GROUP;
+						else return UNEXPECTED_SYMBOL;
+					}
+					else if (sym == "groupCommitDelay") { // In milliseconds
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						std::stringstream s(std::string(ctx.it->getSym()));
+						uint delay;
+						if (!(s >> delay) || !s.eof() || delay == 0) return NOT_A_NUMBER;
+						location.groupCommitDelay = delay;
+					}
+					else if (sym == "decodeRequestBodies") {
+						location.decodeRequestBodies = true;
+					}
+					else if (sym == "maxDecodedSize") { // In bytes
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						std::stringstream s(std::string(ctx.it->getSym()));
+						uint maxSize;
+						if (!(s >> maxSize) || !s.eof()) return NOT_A_NUMBER;
+						location.maxDecodedSize = maxSize;
+					}
+					else if (sym == "maxDecodeRatio") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						std::stringstream s(std::string(ctx.it->getSym()));
+						uint ratio;
+						if (!(s >> ratio) || !s.eof() || ratio == 0) return NOT_A_NUMBER;
+						location.maxDecodeRatio = ratio;
+					}
+					else if (sym == "gzipStatic") {
+						location.gzipStatic = true;
+					}
+					else if (sym == "brotliStatic") {
+						location.brotliStatic = true;
+					}
+					else if (sym == "gzip") {
+						location.gzip = true;
+					}
+					else if (sym == "gzipLevel") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						Option<uint> level = parseNumber(ctx.it->getSym());
+						if (level.isNone()) return NOT_A_NUMBER;
+						if (level.get() < 1 || level.get() > 9) return UNEXPECTED_SYMBOL;
+						location.gzipLevel = level.get();
+					}
+					else if (sym == "gzipMinLength") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						Option<uint> minLength = parseSize(ctx.it->getSym());
+						if (minLength.isNone()) return NOT_A_NUMBER;
+						location.gzipMinLength = minLength.get();
+					}
+					else if (sym == "gzipType") { // Add a single compressible media type
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						location.gzipTypes.insert(strToLower(ctx.it->getSym()));
+					}
+					else if (sym == "bundle") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						location.bundle = ctx.it->getSym();
+					}
+					else if (sym == "fadvise") { // Either a single advice, or a group of them
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() == Token::SYMBOL) {
+							if (!applyFadvise(location, strToLower(ctx.it->getSym()))) return UNEXPECTED_SYMBOL;
+						}
+						else if (ctx.it->getTag() == Token::OPAREN) {
+							while (ctx.it->getTag() != Token::CPAREN) {
+								if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+								if (ctx.it->getTag() == Token::CPAREN) break;
+								if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+								if (!applyFadvise(location, strToLower(ctx.it->getSym()))) return UNEXPECTED_SYMBOL;
+							}
+						}
+						else {
+							return UNEXPECTED_TOKEN;
+						}
+					}
+					else if (sym == "tryFiles") { // Either a single fallback, or a group of candidates
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						location.tryFiles.clear();
+						if (ctx.it->getTag() == Token::SYMBOL) {
+							location.tryFiles.push_back(ctx.it->getSym());
+						}
+						else if (ctx.it->getTag() == Token::OPAREN) {
+							while (ctx.it->getTag() != Token::CPAREN) {
+								if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+								if (ctx.it->getTag() == Token::CPAREN) break;
+								if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+								location.tryFiles.push_back(ctx.it->getSym());
+							}
+							if (location.tryFiles.empty()) return UNEXPECTED_CPAREN;
+						}
+						else {
+							return UNEXPECTED_TOKEN;
+						}
+					}
+					else if (sym == "fadviseMinSize") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						Option<uint> size = parseSize(ctx.it->getSym());
+						if (size.isNone()) return NOT_A_NUMBER;
+						location.fadviseMinSize = size.get();
+					}
+					else if (sym == "dropBehind") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						Option<uint> size = parseSize(ctx.it->getSym());
+						if (size.isNone()) return NOT_A_NUMBER;
+						location.dropBehindSize = size;
+					}
+					else if (sym == "readahead") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						Option<uint> size = parseSize(ctx.it->getSym());
+						if (size.isNone()) return NOT_A_NUMBER;
+						location.readaheadSize = size.get();
+					}
+					else if (sym == "cacheControl") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						location.cacheControl = ctx.it->getSym();
+					}
+					else if (sym == "expires") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						Option<uint> duration = parseDuration(ctx.it->getSym());
+						if (duration.isNone()) return NOT_A_NUMBER;
+						location.expires = duration.get();
+					}
 					else return UNEXPECTED_SYMBOL;
 					break;
 				case Token::OPAREN:
@@ -201,6 +435,8 @@ namespace Webserv {
 		std::string sym;
 		Config::Server server;
 		server.optional = false;
+		server.warmupBudget = WARMUP_DEFAULT_BUDGET;
+		server.warmupTop = WARMUP_DEFAULT_TOP;
 		while (ctx.it != ctx.end) {
 			switch (ctx.it->getTag()) {
 				case Token::SYMBOL:
@@ -268,6 +504,32 @@ namespace Webserv {
 						if (!(s >> maxSize)) return NOT_A_NUMBER;
 						server.maxRequestSize = maxSize;
 					}
+					else if (sym == "zeroCopy") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						Option<uint> threshold = parseNumber(ctx.it->getSym());
+						if (threshold.isNone()) return NOT_A_NUMBER;
+						server.zeroCopyThreshold = threshold.get();
+					}
+					else if (sym == "warmup") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						server.warmupList = ctx.it->getSym();
+					}
+					else if (sym == "warmupBudget") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						Option<uint> budget = parseSize(ctx.it->getSym());
+						if (budget.isNone()) return NOT_A_NUMBER;
+						server.warmupBudget = budget.get();
+					}
+					else if (sym == "warmupTop") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						Option<uint> top = parseNumber(ctx.it->getSym());
+						if (top.isNone()) return NOT_A_NUMBER;
+						server.warmupTop = top.get();
+					}
 					else if (sym == "errorPage") {
 						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
 						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
@@ -355,6 +617,68 @@ namespace Webserv {
 							return UNEXPECTED_TOKEN;
 						}
 					}
+					else if (sym == "cgiWorkers") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::OPAREN) return UNEXPECTED_TOKEN;
+						while (true) {
+							if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+							if (ctx.it->getTag() == Token::CPAREN)
+								break;
+
+							if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+							std::string fileExt = ctx.it->getSym();
+							if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+							if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+							ctx.config.cgiWorkers[fileExt] = ctx.it->getSym();
+						}
+					}
+					else if (sym == "cgiPoolSize") { // Minimum of idle workers, and maximum of all workers
+						uint sizes[2];
+						for (uint i = 0; i < 2; i++) {
+							if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+							if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+							Option<uint> size = parseNumber(ctx.it->getSym());
+							if (size.isNone()) return NOT_A_NUMBER;
+							sizes[i] = size.get();
+						}
+						if (sizes[1] == 0 || sizes[0] > sizes[1]) return CONFIG_PARSING_ERROR;
+						ctx.config.cgiPoolMinIdle = sizes[0];
+						ctx.config.cgiPoolMaxWorkers = sizes[1];
+					}
+					else if (sym == "cgiPoolMaxRequests") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						std::stringstream s(std::string(ctx.it->getSym()));
+						uint maxRequests;
+						if (!(s >> maxRequests)) return NOT_A_NUMBER;
+						if (maxRequests == 0) return CONFIG_PARSING_ERROR;
+						ctx.config.cgiPoolMaxRequests = maxRequests;
+					}
+					else if (sym == "cgiPoolSpawnRate") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+						std::stringstream s(std::string(ctx.it->getSym()));
+						uint rate;
+						if (!(s >> rate)) return NOT_A_NUMBER;
+						if (rate == 0) return CONFIG_PARSING_ERROR;
+						ctx.config.cgiPoolSpawnRate = rate;
+					}
+					else if (sym == "fastcgiBinds") {
+						if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+						if (ctx.it->getTag() != Token::OPAREN) return UNEXPECTED_TOKEN;
+						while (true) {
+							if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+							if (ctx.it->getTag() == Token::CPAREN)
+								break;
+
+							if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+							std::string fileExt = ctx.it->getSym();
+							if (++ctx.it == ctx.end) return UNEXPECTED_EOF;
+							if (ctx.it->getTag() != Token::SYMBOL) return UNEXPECTED_TOKEN;
+							if (parseFastCGIAddress(ctx.it->getSym()).isNone()) return CONFIG_PARSING_ERROR;
+							ctx.config.fastcgiBinds[fileExt] = ctx.it->getSym();
+						}
+					}
 					else return UNEXPECTED_SYMBOL;
 					break;
 				case Token::OPAREN:
@@ -401,6 +725,10 @@ namespace Webserv {
 		config.messageBufferSize = MSG_BUF_SIZE;
 		config.cgiBinds["py"] = "/usr/bin/python3";
 		config.cgiBinds["lua"] = "/usr/bin/luajit";
+		config.cgiPoolMinIdle = CGI_POOL_DEFAULT_MIN_IDLE;
+		config.cgiPoolMaxWorkers = CGI_POOL_DEFAULT_MAX_WORKERS;
+		config.cgiPoolMaxRequests = CGI_POOL_DEFAULT_MAX_REQUESTS;
+		config.cgiPoolSpawnRate = CGI_POOL_DEFAULT_SPAWN_RATE;
 		std::vector<Token>::iterator tokenIt = tokens.begin();
 		std::vector<Token>::iterator tokenEnd = tokens.end();
 		ParserContext context = (ParserContext) {
@@ -430,6 +758,12 @@ namespace Webserv {
 		else if (lcstr == "delete") {
 			return HTTP_DELETE_FLAG;
 		}
+		else if (lcstr == "copy") {
+			return HTTP_COPY_FLAG;
+		}
+		else if (lcstr == "move") {
+			return HTTP_MOVE_FLAG;
+		}
 		return NONE;
 	}
 
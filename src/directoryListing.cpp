@@ -1,40 +1,148 @@
 #include "webserv.hpp"
+#include "body.hpp"
+#include "cache.hpp"
+#include "error.hpp"
+#include "rootDirectory.hpp"
+#include <algorithm>
 #include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include <ctime>
 #include <sstream>
 #include <string>
+#include <vector>
 
-std::string Webserv::makeDirectoryListing(const std::string &diskPath, const std::string &urlPath, bool topLevel, bool fileUploading) {
-    (void)topLevel;
-    // fileUploading = true; // (DEBUG) TEMPORARY HACK TO ENABLE FILE UPLOADING
-    DIR *dir = opendir(diskPath.c_str());
-    if (!dir) {
-        return "<html><body>Could not open directory: " + diskPath + "</body></html>";
-    }
+#ifndef DIR_LISTING_CACHE_SIZE
+#define DIR_LISTING_CACHE_SIZE (16 * 1024 * 1024)
+#endif
 
-	std::ostringstream html;
-	html << "<html><head><title>Index of " << urlPath << "</title></head><body>";
-	html << "<h1>Index of " << urlPath << "</h1><hr><pre>";
+// Listings larger than this are streamed without being kept in the cache.
+#ifndef DIR_LISTING_CACHEABLE_SIZE
+#define DIR_LISTING_CACHEABLE_SIZE (1024 * 1024)
+#endif
 
-	struct dirent *entry;
-	while ((entry = readdir(dir)) != NULL) {
-		std::string name = entry->d_name;
-		if (name == "." || name == "..") continue;
+// Number of directory entries that are processed per single dispatcher turn.
+#ifndef DIR_LISTING_BATCH_SIZE
+#define DIR_LISTING_BATCH_SIZE 256
+#endif
 
-		std::string fullpath = diskPath;
-		if (fullpath[fullpath.size() - 1] != '/')
-			fullpath += "/";
-		fullpath += name;
+// Page size that is used when `page` is requested without an explicit `limit`.
+#ifndef DIR_LISTING_PAGE_SIZE
+#define DIR_LISTING_PAGE_SIZE 1000
+#endif
 
+namespace Webserv {
+
+	// A rendered directory listing, together with the directory metadata it was rendered from.
+	// The listing stays valid for as long as the directory's mtime and ctime stay the same. It is kept in
+	// a sealed blob, so that all the responses that serve it share the one copy and send it with `sendfile`.
+	struct DirListingCacheEntry {
+		dev_t device;
+		ino_t inode;
+		struct timespec mtime;
+		struct timespec ctime;
+		SharedPtr<SealedBlob> html;
+	};
+
+	static LRUCache<std::string, DirListingCacheEntry> dirListingCache(DIR_LISTING_CACHE_SIZE);
+
+	static struct timespec statMTime(const struct stat& st) {
+#ifdef OSX
+		return st.st_mtimespec;
+#else
+		return st.st_mtim;
+#endif
+	}
+
+	static struct timespec statCTime(const struct stat& st) {
+#ifdef OSX
+		return st.st_ctimespec;
+#else
+		return st.st_ctim;
+#endif
+	}
+
+	static bool sameTime(const struct timespec& a, const struct timespec& b) {
+		return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+	}
+
+	static bool isListingFresh(const DirListingCacheEntry& entry, const struct stat& st) {
+		return entry.device == st.st_dev
+			&& entry.inode == st.st_ino
+			&& sameTime(entry.mtime, statMTime(st))
+			&& sameTime(entry.ctime, statCTime(st));
+	}
+
+	DirListingOptions::DirListingOptions(): sortKey(SORT_NONE), descending(false), page(1), limit(NONE) {}
+
+	DirListingOptions DirListingOptions::fromUrl(const Url& url) {
+		DirListingOptions options;
+
+		std::string sort = strToLower(url.getQuery("sort").getOr(""));
+		if (sort == "name") options.sortKey = SORT_NAME;
+		else if (sort == "mtime" || sort == "date") options.sortKey = SORT_MTIME;
+		else if (sort == "size") options.sortKey = SORT_SIZE;
+
+		options.descending = strToLower(url.getQuery("order").getOr("")) == "desc";
+
+		Option<std::string> limitStr = url.getQuery("limit");
+		Option<std::string> pageStr = url.getQuery("page");
+		if (limitStr.isSome()) {
+			Option<int> limit = strToInt(limitStr.get());
+			if (limit.isSome() && limit.get() > 0) options.limit = limit.get();
+		}
+		if (pageStr.isSome()) {
+			Option<int> page = strToInt(pageStr.get());
+			if (page.isSome() && page.get() > 0) options.page = page.get();
+			if (options.limit.isNone()) options.limit = DIR_LISTING_PAGE_SIZE;
+		}
+		return options;
+	}
+
+	static const char* sortKeyName(DirListingOptions::SortKey key) {
+		switch (key) {
+			case DirListingOptions::SORT_NONE: return "";
+			case DirListingOptions::SORT_NAME: return "name";
+			case DirListingOptions::SORT_MTIME: return "mtime";
+			case DirListingOptions::SORT_SIZE: return "size";
+		}
+		return "";
+	}
+
+	std::string DirListingOptions::toString() const {
+		std::ostringstream str;
+		str << sortKeyName(sortKey) << (descending ? "-" : "+") << page << "/";
+		if (limit.isSome()) str << limit.get();
+		return str.str();
+	}
+
+	// A single directory entry, remembered when the listing has to be sorted.
+	struct DirEntry {
+		std::string name;
 		struct stat st;
-		if (stat(fullpath.c_str(), &st) == -1)
-			continue; // skip if cannot stat
+	};
 
+	static bool compareByName(const DirEntry& a, const DirEntry& b) {
+		return a.name < b.name;
+	}
+
+	static bool compareByMTime(const DirEntry& a, const DirEntry& b) {
+		if (a.st.st_mtime != b.st.st_mtime) return a.st.st_mtime < b.st.st_mtime;
+		return a.name < b.name;
+	}
+
+	static bool compareBySize(const DirEntry& a, const DirEntry& b) {
+		if (a.st.st_size != b.st.st_size) return a.st.st_size < b.st.st_size;
+		return a.name < b.name;
+	}
+
+	static void renderEntry(std::ostringstream& html, const std::string& urlPath, const std::string& name, const struct stat& st) {
 		// Format last modified time
 		char timebuf[20];
-		std::tm *tm_info = std::localtime(&st.st_mtime);
-		std::strftime(timebuf, sizeof(timebuf), "%d-%b-%Y %H:%M", tm_info);
+		std::tm tm_info;
+		localtime_r(&st.st_mtime, &tm_info);
+		std::strftime(timebuf, sizeof(timebuf), "%d-%b-%Y %H:%M", &tm_info);
 
 		std::string displayName = name;
 		if (S_ISDIR(st.st_mode))
@@ -55,20 +163,297 @@ std::string Webserv::makeDirectoryListing(const std::string &diskPath, const std
 			 << timebuf << "  " << st.st_size << "\n";
 	}
 
-	html << "</pre><hr>";
-	if (fileUploading) {
-		html << "File uploading is enabled.<br>"
-			"<form method=\"post\" enctype=\"multipart/form-data\">"
-			"<label for=\"file\">Pick a file!</label>"
-			"<br>"
-			"<input id=\"file\" name=\"file\" type=\"file\"/>"
-			"<br>"
-			// "<label for=\"fileName\">Type a file name!</label>"
-			// "<input id=\"fileName\" name=\"fileName\" type=\"text\"/>"
-			"<button>Upload</button>"
-			"</form>";
+	static std::string pageLink(const std::string& urlPath, const DirListingOptions& options, uint page) {
+		std::ostringstream href;
+		href << urlPath << "?page=" << page << "&limit=" << options.limit.get();
+		if (options.sortKey != DirListingOptions::SORT_NONE) {
+			href << "&sort=" << sortKeyName(options.sortKey) << "&order=" << (options.descending ? "desc" : "asc");
+		}
+		return href.str();
+	}
+
+	// `DirListingProducer` generates the directory listing in batches of `DIR_LISTING_BATCH_SIZE` entries, so
+	// the first bytes go out before the whole directory is read. Unsorted listings only keep the current batch
+	// in memory, while sorted ones have to collect (and stat) every entry before the first one is emitted.
+	// Small enough listings are additionally kept in the listing cache once they are complete.
+	class DirListingProducer: public IBodyProducer {
+	public:
+		DirListingProducer(
+			DIR* dir,
+			const struct stat& dirStat,
+			const std::string& cacheKey,
+			const std::string& urlPath,
+			bool fileUploading,
+			const DirListingOptions& options
+		):
+			dir(dir),
+			dirStat(dirStat),
+			cacheKey(cacheKey),
+			urlPath(urlPath),
+			fileUploading(fileUploading),
+			options(options),
+			stage(HEADER),
+			entries(),
+			entryIdx(0),
+			skipped(0),
+			emitted(0),
+			hasMore(false),
+			cacheBuffer(),
+			cacheable(true) {}
+
+		~DirListingProducer() {
+			closedir(dir);
+		}
+
+		Result<bool, Error> produce(std::string& out) {
+			std::ostringstream html;
+			bool more = true;
+			switch (stage) {
+				case HEADER:
+					html << "<html><head><title>Index of " << urlPath << "</title></head><body>";
+					html << "<h1>Index of " << urlPath << "</h1><hr><pre>";
+					stage = options.sortKey == DirListingOptions::SORT_NONE ? ENTRIES : COLLECT;
+					break;
+				case COLLECT:
+					collectBatch();
+					break;
+				case ENTRIES:
+					if (options.sortKey == DirListingOptions::SORT_NONE)
+						renderUnsortedBatch(html);
+					else
+						renderSortedBatch(html);
+					break;
+				case FOOTER:
+					renderFooter(html);
+					more = false;
+					break;
+			}
+
+			std::string piece = html.str();
+			out.append(piece);
+			rememberForCache(piece, !more);
+			return more;
+		}
+	private:
+		enum Stage {
+			HEADER,
+			COLLECT,
+			ENTRIES,
+			FOOTER,
+		};
+
+		DIR* dir;
+		struct stat dirStat;
+		std::string cacheKey;
+		std::string urlPath;
+		bool fileUploading;
+		DirListingOptions options;
+		Stage stage;
+		std::vector<DirEntry> entries;
+		size_t entryIdx;
+		size_t skipped;
+		size_t emitted;
+		bool hasMore;
+		std::string cacheBuffer;
+		bool cacheable;
+
+		size_t pageOffset() const {
+			if (options.limit.isNone()) return 0;
+			return static_cast<size_t>(options.page - 1) * options.limit.get();
+		}
+
+		// Reads the name of the next entry of the directory, skipping `.` and `..`.
+		bool readName(std::string& name) {
+			struct dirent *entry;
+			while ((entry = readdir(dir)) != NULL) {
+				name = entry->d_name;
+				if (name == "." || name == "..") continue;
+				return true;
+			}
+			return false;
+		}
+
+		// Entries are stat'ed relative to the already opened directory, so the kernel does not have to walk the
+		// whole path again for each of them.
+		bool statEntry(const std::string& name, struct stat& st) {
+			return fstatat(dirfd(dir), name.c_str(), &st, 0) == 0;
+		}
+
+		// Reads the next entry of the directory, skipping the entries that can not be stat'ed.
+		bool readEntry(std::string& name, struct stat& st) {
+			while (readName(name)) {
+				if (statEntry(name, st)) return true;
+			}
+			return false;
+		}
+
+		void collectBatch() {
+			for (uint i = 0; i < DIR_LISTING_BATCH_SIZE; i++) {
+				DirEntry entry;
+				if (!readEntry(entry.name, entry.st)) {
+					switch (options.sortKey) {
+						case DirListingOptions::SORT_NAME:
+							std::sort(entries.begin(), entries.end(), compareByName);
+							break;
+						case DirListingOptions::SORT_MTIME:
+							std::sort(entries.begin(), entries.end(), compareByMTime);
+							break;
+						case DirListingOptions::SORT_SIZE:
+							std::sort(entries.begin(), entries.end(), compareBySize);
+							break;
+						case DirListingOptions::SORT_NONE:
+							break;
+					}
+					if (options.descending) std::reverse(entries.begin(), entries.end());
+					entryIdx = pageOffset();
+					stage = ENTRIES;
+					return;
+				}
+				entries.push_back(entry);
+			}
+		}
+
+		// Entries before the page are skipped by their names alone, so only the rendered ones are stat'ed.
+		void renderUnsortedBatch(std::ostringstream& html) {
+			for (uint i = 0; i < DIR_LISTING_BATCH_SIZE; i++) {
+				std::string name;
+				if (!readName(name)) {
+					stage = FOOTER;
+					return;
+				}
+				if (skipped < pageOffset()) {
+					skipped++;
+					continue;
+				}
+				if (options.limit.isSome() && emitted == options.limit.get()) {
+					hasMore = true;
+					stage = FOOTER;
+					return;
+				}
+				struct stat st;
+				if (!statEntry(name, st)) continue; // skip if cannot stat
+				renderEntry(html, urlPath, name, st);
+				emitted++;
+			}
+		}
+
+		void renderSortedBatch(std::ostringstream& html) {
+			for (uint i = 0; i < DIR_LISTING_BATCH_SIZE; i++) {
+				if (entryIdx >= entries.size()) {
+					stage = FOOTER;
+					return;
+				}
+				if (options.limit.isSome() && emitted == options.limit.get()) {
+					hasMore = true;
+					stage = FOOTER;
+					return;
+				}
+				renderEntry(html, urlPath, entries[entryIdx].name, entries[entryIdx].st);
+				entryIdx++;
+				emitted++;
+			}
+		}
+
+		void renderFooter(std::ostringstream& html) {
+			html << "</pre><hr>";
+			if (options.limit.isSome() && (options.page > 1 || hasMore)) {
+				if (options.page > 1)
+					html << "<a href=\"" << pageLink(urlPath, options, options.page - 1) << "\">Previous page</a> ";
+				html << "Page " << options.page;
+				if (hasMore)
+					html << " <a href=\"" << pageLink(urlPath, options, options.page + 1) << "\">Next page</a>";
+				html << "<hr>";
+			}
+			if (fileUploading) {
+				html << "File uploading is enabled.<br>"
+					"<form method=\"post\" enctype=\"multipart/form-data\">"
+					"<label for=\"file\">Pick a file!</label>"
+					"<br>"
+					"<input id=\"file\" name=\"file\" type=\"file\"/>"
+					"<br>"
+					// "<label for=\"fileName\">Type a file name!</label>"
+					// "<input id=\"fileName\" name=\"fileName\" type=\"text\"/>"
+					"<button>Upload</button>"
+					"</form>";
+			}
+			html << "</body></html>";
+		}
+
+		void rememberForCache(const std::string& piece, bool complete) {
+			if (!cacheable) return;
+			if (cacheBuffer.size() + piece.size() > DIR_LISTING_CACHEABLE_SIZE) {
+				cacheable = false;
+				cacheBuffer.clear();
+				return;
+			}
+			cacheBuffer.append(piece);
+			if (!complete) return;
+
+			// Timestamps have a limited granularity, so a directory that was modified within the last second
+			// may still be modified again without its mtime changing. Such listings are not worth trusting
+			// yet, and neither are the ones whose directory has changed while they were being generated.
+			struct stat currentStat;
+			time_t now = std::time(NULL);
+			if (fstat(dirfd(dir), &currentStat) < 0
+			|| statCTime(dirStat).tv_sec >= now - 1
+			|| statMTime(dirStat).tv_sec >= now - 1) {
+				dirListingCache.erase(cacheKey);
+				return;
+			}
+			DirListingCacheEntry entry;
+			entry.device = dirStat.st_dev;
+			entry.inode = dirStat.st_ino;
+			entry.mtime = statMTime(dirStat);
+			entry.ctime = statCTime(dirStat);
+			if (!isListingFresh(entry, currentStat)) return;
+			Option<SharedPtr<SealedBlob> > blob = SealedBlob::make(cacheBuffer);
+			if (blob.isNone()) return;
+			entry.html = blob.get();
+			dirListingCache.insert(cacheKey, entry, cacheBuffer.size() + cacheKey.size());
+		}
+	};
+
+	Result<SharedPtr<IResponseBody>, Error> makeDirectoryListing(
+		const RootDirectory& root,
+		const std::string& relativePath,
+		const std::string& urlPath,
+		bool topLevel,
+		bool fileUploading,
+		const DirListingOptions& options
+	) {
+		(void)topLevel;
+		std::string diskPath = root.diskPath(relativePath);
+		int dfd = openBeneath(root, relativePath, O_RDONLY | O_DIRECTORY);
+		if (dfd < 0) {
+			return Error(HTTP_NOT_FOUND, "Could not open directory: " + diskPath);
+		}
+
+		struct stat dirStat;
+		if (fstat(dfd, &dirStat) < 0) {
+			close(dfd);
+			return Error(HTTP_NOT_FOUND, "Could not open directory: " + diskPath);
+		}
+
+		std::string cacheKey = diskPath + '\0' + urlPath + '\0' + (fileUploading ? "1" : "0") + options.toString();
+		DirListingCacheEntry* cached = dirListingCache.find(cacheKey);
+		if (cached && isListingFresh(*cached, dirStat)) {
+			close(dfd);
+			// The cached listing is named by its key and by the directory version it was rendered from.
+			std::ostringstream identity;
+			identity << "listing:" << cacheKey << '\0' << cached->device << ':' << cached->inode << ':'
+				<< cached->mtime.tv_sec << '.' << cached->mtime.tv_nsec << ':'
+				<< cached->ctime.tv_sec << '.' << cached->ctime.tv_nsec;
+			return SharedPtr<IResponseBody>(new BlobBody(cached->html, identity.str()));
+		}
+
+		DIR* dir = fdopendir(dfd);
+		if (!dir) {
+			close(dfd);
+			return Error(HTTP_NOT_FOUND, "Could not open directory: " + diskPath);
+		}
+		SharedPtr<IBodyProducer> producer(
+			new DirListingProducer(dir, dirStat, cacheKey, urlPath, fileUploading, options)
+		);
+		return SharedPtr<IResponseBody>(new StreamBody(producer));
 	}
-	html << "</body></html>";
-	closedir(dir);
-	return html.str();
 }
@@ -214,6 +214,55 @@ namespace Webserv {
 		return NONE;
 	}
 	
+	void FDTaskDispatcher::suspendIO(int fd) {
+		if (activeDescriptors.find(fd) == activeDescriptors.end()) return;
+	#ifdef LINUX
+		// Error conditions are always reported, even with no events requested.
+		struct epoll_event ev;
+		ev.events = 0;
+		ev.data.fd = fd;
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+	#endif
+	#ifdef OSX
+		std::map<int, SharedPtr<IFDTask> >::iterator handler = activeHandlers.find(fd);
+		short filter = handler != activeHandlers.end() && handler->second->ioMode == READ_MODE ? EVFILT_READ : EVFILT_WRITE;
+		struct kevent ev;
+		EV_SET(&ev, fd, filter, EV_DISABLE, 0, 0, NULL);
+		kevent(kqueueFd, &ev, 1, NULL, 0, NULL);
+	#endif
+	}
+
+	void FDTaskDispatcher::resumeIO(int fd) {
+		if (activeDescriptors.find(fd) == activeDescriptors.end()) return;
+		std::map<int, SharedPtr<IFDTask> >::iterator handler = activeHandlers.find(fd);
+		if (handler == activeHandlers.end()) return;
+		IOMode mode = handler->second->ioMode;
+	#ifdef LINUX
+		struct epoll_event ev;
+	#ifndef COMBINED_IO_MODES
+		ev.events = mode == READ_MODE ? EPOLLIN : EPOLLOUT;
+	#else
+		(void)mode;
+		ev.events = EPOLLIN | EPOLLOUT;
+	#endif
+		ev.data.fd = fd;
+		epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &ev);
+	#endif
+	#ifdef OSX
+		struct kevent ev;
+		EV_SET(&ev, fd, mode == READ_MODE ? EVFILT_READ : EVFILT_WRITE, EV_ENABLE, 0, 0, NULL);
+		kevent(kqueueFd, &ev, 1, NULL, 0, NULL);
+	#endif
+	}
+
+	void FDTaskDispatcher::retainDescriptor(int fd) {
+		registerDescriptor(fd);
+	}
+
+	void FDTaskDispatcher::releaseDescriptor(int fd) {
+		tryCloseDescriptor(fd);
+	}
+
 	void FDTaskDispatcher::removeByFd(int fd) {
 		tryUnregisterDescriptor(fd);
 		std::vector<SharedPtr<IFDTask> > newInserted;
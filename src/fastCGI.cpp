@@ -0,0 +1,185 @@
+#include "fastCGI.hpp"
+#include "error.hpp"
+#include "http.hpp"
+#include "webserv.hpp"
+#include "ystl.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Size of the header that every record starts with.
+#define FASTCGI_HEADER_SIZE 8
+
+// The only version of the protocol there is.
+#define FASTCGI_VERSION 1
+
+// The role of an application that receives a request and produces its response.
+#define FASTCGI_RESPONDER 1
+
+// Flag of `FCGI_BEGIN_REQUEST` that keeps the connection open once the request has ended.
+#define FASTCGI_KEEP_CONN 1
+
+namespace Webserv {
+	void appendFastCGIRecord(std::string& out, FastCGIRecordType type, ushort requestId, const std::string& content) {
+		size_t padding = (8 - content.size() % 8) % 8;
+		char header[FASTCGI_HEADER_SIZE];
+		header[0] = FASTCGI_VERSION;
+		header[1] = static_cast<char>(type);
+		header[2] = static_cast<char>(requestId >> 8);
+		header[3] = static_cast<char>(requestId & 0xff);
+		header[4] = static_cast<char>(content.size() >> 8);
+		header[5] = static_cast<char>(content.size() & 0xff);
+		header[6] = static_cast<char>(padding);
+		header[7] = 0;
+		out.append(header, FASTCGI_HEADER_SIZE);
+		out.append(content);
+		out.append(padding, '\0');
+	}
+
+	void appendFastCGIStream(std::string& out, FastCGIRecordType type, ushort requestId, const std::string& data) {
+		for (size_t offset = 0; offset < data.size(); offset += FASTCGI_RECORD_SIZE) {
+			appendFastCGIRecord(out, type, requestId, data.substr(offset, FASTCGI_RECORD_SIZE));
+		}
+		appendFastCGIRecord(out, type, requestId, "");
+	}
+
+	void appendFastCGIBeginRequest(std::string& out, ushort requestId, bool keepConnection) {
+		char body[8] = {0};
+		body[0] = 0;
+		body[1] = FASTCGI_RESPONDER;
+		body[2] = keepConnection ? FASTCGI_KEEP_CONN : 0;
+		appendFastCGIRecord(out, FCGI_BEGIN_REQUEST, requestId, std::string(body, sizeof(body)));
+	}
+
+	// Lengths of up to 127 bytes take a single byte, and longer ones take four, with the highest bit set.
+	static void appendPairLength(std::string& out, size_t length) {
+		if (length < 128) {
+			out.push_back(static_cast<char>(length));
+			return;
+		}
+		out.push_back(static_cast<char>(((length >> 24) & 0x7f) | 0x80));
+		out.push_back(static_cast<char>((length >> 16) & 0xff));
+		out.push_back(static_cast<char>((length >> 8) & 0xff));
+		out.push_back(static_cast<char>(length & 0xff));
+	}
+
+	static bool readPairLength(const std::string& content, size_t& pos, size_t& length) {
+		if (pos >= content.size()) return false;
+		unsigned char first = content[pos];
+		if (first < 128) {
+			length = first;
+			pos++;
+			return true;
+		}
+		if (pos + 4 > content.size()) return false;
+		length = (static_cast<size_t>(first & 0x7f) << 24)
+			| (static_cast<size_t>(static_cast<unsigned char>(content[pos + 1])) << 16)
+			| (static_cast<size_t>(static_cast<unsigned char>(content[pos + 2])) << 8)
+			| static_cast<size_t>(static_cast<unsigned char>(content[pos + 3]));
+		pos += 4;
+		return true;
+	}
+
+	void appendFastCGIPair(std::string& out, const std::string& name, const std::string& value) {
+		appendPairLength(out, name.size());
+		appendPairLength(out, value.size());
+		out.append(name);
+		out.append(value);
+	}
+
+	Option<std::map<std::string, std::string> > parseFastCGIPairs(const std::string& content) {
+		std::map<std::string, std::string> pairs;
+		size_t pos = 0;
+		while (pos < content.size()) {
+			size_t nameLength;
+			size_t valueLength;
+			if (!readPairLength(content, pos, nameLength) || !readPairLength(content, pos, valueLength)) return NONE;
+			if (nameLength > content.size() - pos || valueLength > content.size() - pos - nameLength) return NONE;
+			pairs[content.substr(pos, nameLength)] = content.substr(pos + nameLength, valueLength);
+			pos += nameLength + valueLength;
+		}
+		return pairs;
+	}
+
+	FastCGIRecordParser::FastCGIRecordParser(): buffer(), offset(0) {}
+
+	void FastCGIRecordParser::append(const char* data, size_t length) {
+		// The records that were taken out are only dropped from the buffer once they make up most of it, so that
+		// the rest of it is not moved after every record.
+		if (offset > 0 && offset >= buffer.size() / 2) {
+			buffer.erase(0, offset);
+			offset = 0;
+		}
+		buffer.append(data, length);
+	}
+
+	Result<bool, Error> FastCGIRecordParser::next(FastCGIRecord& record) {
+		if (buffer.size() - offset < FASTCGI_HEADER_SIZE) return false;
+		const unsigned char* header = reinterpret_cast<const unsigned char*>(buffer.data() + offset);
+		if (header[0] != FASTCGI_VERSION) {
+			return Error(HTTP_BAD_GATEWAY, "FastCGI application sent a record of an unknown version");
+		}
+		size_t contentLength = (static_cast<size_t>(header[4]) << 8) | header[5];
+		size_t recordLength = FASTCGI_HEADER_SIZE + contentLength + header[6];
+		if (buffer.size() - offset < recordLength) return false;
+
+		record.type = static_cast<FastCGIRecordType>(header[1]);
+		record.requestId = static_cast<ushort>((header[2] << 8) | header[3]);
+		record.content = buffer.substr(offset + FASTCGI_HEADER_SIZE, contentLength);
+		offset += recordLength;
+		return true;
+	}
+
+	Option<FastCGIAddress> parseFastCGIAddress(const std::string& str) {
+		FastCGIAddress result;
+		std::memset(&result.address, 0, sizeof(result.address));
+		if (str.compare(0, 5, "unix:") == 0) {
+			std::string path = str.substr(5);
+			sockaddr_un* address = reinterpret_cast<sockaddr_un*>(&result.address);
+			if (path.empty() || path.size() >= sizeof(address->sun_path)) return NONE;
+			address->sun_family = AF_UNIX;
+			path.copy(address->sun_path, path.size());
+			result.length = sizeof(sockaddr_un);
+			return result;
+		}
+
+		size_t colon = str.rfind(':');
+		if (colon == std::string::npos) return NONE;
+		std::string host = str.substr(0, colon);
+		Option<int> port = strToInt(str.substr(colon + 1));
+		if (port.isNone() || port.get() <= 0 || port.get() > 65535) return NONE;
+		if (host == "localhost") host = "127.0.0.1";
+		sockaddr_in* address = reinterpret_cast<sockaddr_in*>(&result.address);
+		address->sin_family = AF_INET;
+		address->sin_port = htons(static_cast<ushort>(port.get()));
+		if (inet_pton(AF_INET, host.c_str(), &address->sin_addr) != 1) return NONE;
+		result.length = sizeof(sockaddr_in);
+		return result;
+	}
+
+	Result<int, Error> connectFastCGI(const FastCGIAddress& address) {
+		int fd = socket(address.address.ss_family, SOCK_STREAM, 0);
+		if (fd < 0) {
+			return Error(HTTP_SERVICE_UNAVAILABLE, "Failed to create a socket for the FastCGI application");
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (connect(fd, reinterpret_cast<const sockaddr*>(&address.address), address.length) != 0
+		&& errno != EINPROGRESS) {
+			int error = errno;
+			close(fd);
+			// A Unix socket with a full backlog refuses the connection right away, instead of keeping it pending.
+			if (error == EAGAIN) {
+				return Error(HTTP_SERVICE_UNAVAILABLE, "FastCGI application is overloaded");
+			}
+			return Error(HTTP_BAD_GATEWAY, std::string("Failed to connect to the FastCGI application: ") + strerror(error));
+		}
+		return fd;
+	}
+}
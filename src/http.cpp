@@ -3,6 +3,7 @@
 #include "url.hpp"
 #include "webserv.hpp"
 #include "ystl.hpp"
+#include <algorithm>
 #include <cstddef>
 #include <cstdio>
 #include <ostream>
@@ -28,6 +29,10 @@ const char* Webserv::httpMethodName(HTTPMethod method) {
 			return "DELETE";
 		case HEAD:
 			return "HEAD";
+		case COPY:
+			return "COPY";
+		case MOVE:
+			return "MOVE";
 		}
 	return "UNKNOWN";
 };
@@ -39,6 +44,8 @@ Option<HTTPMethod> Webserv::httpMethodFromStr(const std::string &str) {
 	else if (lower == "put") return Webserv::PUT;
 	else if (lower == "delete") return Webserv::DELETE;
 	else if (lower == "head") return Webserv::HEAD;
+	else if (lower == "copy") return Webserv::COPY;
+	else if (lower == "move") return Webserv::MOVE;
 	return NONE;
 };
 
@@ -185,6 +192,10 @@ Option<std::string> Webserv::HTTPRequest::getHeader(const std::string& key) cons
 	return NONE;
 }
 
+const std::map<std::string, std::string>& Webserv::HTTPRequest::getHeaders() const {
+	return headers;
+}
+
 std::string Webserv::HTTPRequest::toString() const {
 	std::stringstream result;
 
@@ -234,6 +245,17 @@ Option<HTTPRequest> Webserv::HTTPRequest::unchunked() const {
 	return result;
 }
 
+HTTPRequest Webserv::HTTPRequest::withDecodedData(const std::string& decoded) const {
+	HTTPRequest result = withData(decoded);
+	result.headers.erase("Content-Encoding");
+
+	std::stringstream lengthNum;
+	lengthNum << decoded.size();
+	result.headers["Content-Length"] = lengthNum.str();
+
+	return result;
+}
+
 HTTPResponse::HTTPResponse(Webserv::Url uri, ReturnCode retCode): resourcePath(uri), retCode(retCode), headers() {
 	headers["Content-Type"] = "text/html";
 }
@@ -478,10 +500,43 @@ void HTTPResponse::setHeader(const std::string& key, const std::string& value) {
 	headers[key] = value;
 }
 
+Option<std::string> HTTPResponse::getHeader(const std::string& key) const {
+	std::string lowerKey = strToLower(key);
+	for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); it++) {
+		if (strToLower(it->first) == lowerKey) return it->second;
+	}
+	return NONE;
+}
+
+void HTTPResponse::removeHeader(const std::string& key) {
+	std::string lowerKey = strToLower(key);
+	std::map<std::string, std::string>::iterator it = headers.begin();
+	while (it != headers.end()) {
+		if (strToLower(it->first) == lowerKey) headers.erase(it++);
+		else it++;
+	}
+}
+
 void HTTPResponse::setCode(HTTPReturnCode code) {
 	retCode = code;
 }
 
+ReturnCode HTTPResponse::getCode() const {
+	return retCode;
+}
+
+const std::string& HTTPResponse::getData() const {
+	return data;
+}
+
+void HTTPResponse::setBody(const SharedPtr<Webserv::IResponseBody>& responseBody) {
+	body = responseBody;
+}
+
+Option<SharedPtr<Webserv::IResponseBody> > HTTPResponse::getBody() const {
+	return body;
+}
+
 std::string HTTPResponse::build() const {
 	std::stringstream result;
 	result << "HTTP/1.1 " << retCode << " " << httpReturnCodeMessage(retCode) << std::endl;
@@ -489,7 +544,18 @@ std::string HTTPResponse::build() const {
 	for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); it++) {
 		result << it->first << ": " << it->second << std::endl;
 	}
-	result << "Content-Length: " << data.length() << std::endl;
+	if (body.isSome()) {
+		Option<size_t> bodyLength = body.get()->getLength();
+		if (bodyLength.isSome())
+			result << "Content-Length: " << bodyLength.get() << std::endl;
+		else
+			result << "Transfer-Encoding: chunked" << std::endl;
+		result << std::endl;
+		return result.str();
+	}
+	// Responses that can not have a body must not announce a (misleading) length of zero either.
+	if (retCode != HTTP_NOT_MODIFIED && retCode != HTTP_NO_CONTENT)
+		result << "Content-Length: " << data.length() << std::endl;
 
 	result << std::endl;
 
@@ -503,6 +569,98 @@ std::string HTTPResponse::build() const {
 	// return result.str();
 }
 
+#ifndef MAX_BYTE_RANGES
+#define MAX_BYTE_RANGES 16
+#endif
+
+static bool compareRanges(const Webserv::ByteRange& a, const Webserv::ByteRange& b) {
+	return a.first < b.first;
+}
+
+Option<std::vector<Webserv::ByteRange> > Webserv::parseByteRanges(const std::string& header, size_t size) {
+	std::string value = trimString(header, ' ');
+	if (value.compare(0, 6, "bytes=") != 0) return NONE;
+
+	std::vector<ByteRange> ranges;
+	std::stringstream specStream(value.substr(6));
+	std::string spec;
+	uint specCount = 0;
+	while (std::getline(specStream, spec, ',')) {
+		spec = trimString(spec, ' ');
+		// Requests with absurd amounts of ranges are served as a whole instead.
+		if (++specCount > MAX_BYTE_RANGES) return NONE;
+
+		size_t dash = spec.find('-');
+		if (dash == spec.npos) return NONE;
+		std::string firstStr = spec.substr(0, dash);
+		std::string lastStr = spec.substr(dash + 1);
+
+		ByteRange range;
+		if (firstStr.empty()) {
+			// Suffix range: the last N bytes of the resource.
+			Option<size_t> suffix = strToSize(lastStr);
+			if (suffix.isNone()) return NONE;
+			if (suffix.get() == 0 || size == 0) continue;
+			range.first = suffix.get() >= size ? 0 : size - suffix.get();
+			range.last = size - 1;
+		}
+		else {
+			Option<size_t> first = strToSize(firstStr);
+			if (first.isNone()) return NONE;
+			range.first = first.get();
+			if (lastStr.empty()) {
+				range.last = size - 1;
+			}
+			else {
+				Option<size_t> last = strToSize(lastStr);
+				if (last.isNone() || last.get() < range.first) return NONE;
+				range.last = std::min(last.get(), size - 1);
+			}
+			if (range.first >= size) continue;
+		}
+		ranges.push_back(range);
+	}
+	if (specCount == 0) return NONE;
+
+	std::sort(ranges.begin(), ranges.end(), compareRanges);
+	std::vector<ByteRange> merged;
+	for (std::vector<ByteRange>::iterator it = ranges.begin(); it != ranges.end(); it++) {
+		if (!merged.empty() && it->first <= merged.back().last + 1) {
+			merged.back().last = std::max(merged.back().last, it->last);
+		}
+		else {
+			merged.push_back(*it);
+		}
+	}
+	return merged;
+}
+
+float Webserv::encodingQuality(const std::string& acceptEncoding, const std::string& coding) {
+	std::stringstream listStream(acceptEncoding);
+	std::string element;
+	Option<float> exact = NONE;
+	Option<float> wildcard = NONE;
+	while (std::getline(listStream, element, ',')) {
+		std::string name = element;
+		float quality = 1;
+		size_t semicolon = element.find(';');
+		if (semicolon != element.npos) {
+			name = element.substr(0, semicolon);
+			std::string param = trimString(element.substr(semicolon + 1), ' ');
+			if (param.compare(0, 2, "q=") == 0) {
+				std::stringstream qStream(param.substr(2));
+				if (!(qStream >> quality)) quality = 0;
+			}
+		}
+		name = strToLower(trimString(name, ' '));
+		if (name == coding || (coding == "gzip" && name == "x-gzip")) exact = quality;
+		else if (name == "*") wildcard = quality;
+	}
+	if (exact.isSome()) return exact.get();
+	if (wildcard.isSome()) return wildcard.get();
+	return 0;
+}
+
 std::string Webserv::contentTypeString(HTTPContentType cType) {
 	switch (cType) {
 		case PLAIN_TEXT:
@@ -568,7 +726,8 @@ Builder::Builder():
 	chunked(false),
 	chunkReadLeftover(),
 	chunkSizeLeftover(),
-	chunkedReadComplete(false)
+	chunkedReadComplete(false),
+	dataDetached(false)
 	{};
 
 static bool findDoubleNl(const std::vector<std::string>& vec, const std::string& substr) {
@@ -595,7 +754,7 @@ Result<Builder::State, Webserv::Error> Builder::appendData(const std::string& st
 			break;
 		case HEADER_COMPLETE:
 			if (!chunked) {
-				lines.push_back(str);
+				if (!dataDetached) lines.push_back(str);
 				dataSize += str.size();
 			}
 			break;
@@ -720,6 +879,16 @@ bool Builder::chunkedReadFinished() const {
 	return chunkedReadComplete;
 }
 
+std::string Builder::detachData() {
+	std::string collectedData;
+	for (uint i = 0; i < lines.size(); i++) {
+		collectedData += lines[i];
+	}
+	lines.clear();
+	dataDetached = true;
+	return collectedData;
+}
+
 Result<UniquePtr<Webserv::HTTPRequest>, Webserv::Error> Builder::build() {
 	std::stringstream collectedDataStream;
 	for (uint i = 0; i < lines.size(); i++) {
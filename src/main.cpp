@@ -2,20 +2,71 @@
 #include <iostream>
 #include <ostream>
 #include <vector>
+#include "bundle.hpp"
 #include "config.hpp"
 #include "error.hpp"
+#include "rootDirectory.hpp"
 #include "dispatcher.hpp"
 #include "tasks.hpp"
 #include "ystl.hpp"
 #include "url.hpp"
+#include "warmup.hpp"
 
 typedef Webserv::Url Url;
 typedef Webserv::Config Config;
 typedef Webserv::Error Error;
 typedef Webserv::FDTaskDispatcher FDTaskDispatcher;
 typedef Webserv::ClientListener ClientListener;
+typedef Webserv::CGIWorkerPool CGIWorkerPool;
+
+// Packs a directory into a bundle: `webserv --bundle <source directory> <bundle path> [--gzip]`.
+static int runBundleTool(int argc, char* argv[]) {
+	if (argc < 4 || argc > 5 || (argc == 5 && std::string(argv[4]) != "--gzip")) {
+		std::cerr << "Usage: " << argv[0] << " --bundle <source directory> <bundle path> [--gzip]" << std::endl;
+		return 1;
+	}
+	Option<Error> error = Webserv::buildBundle(argv[2], argv[3], argc == 5);
+	if (error.isSome()) {
+		std::cerr << "Could not build the bundle: " << error.get().message << std::endl;
+		return 1;
+	}
+	Result<SharedPtr<Webserv::Bundle>, Error> bundle = Webserv::Bundle::open(argv[3]);
+	if (bundle.isError()) {
+		std::cerr << bundle.getError().message << std::endl;
+		return 1;
+	}
+	std::cout << "Packed " << bundle.getValue()->getEntryCount() << " files into " << argv[3] << std::endl;
+	return 0;
+}
+
+// Maps the bundles and opens the root directories of all the locations ahead of time, so that broken bundles
+// are reported right away. Root directories that are missing are only reported, since they may appear later.
+static bool preloadLocations(const Config& config) {
+	for (uint i = 0; i < config.servers.size(); i++) {
+		const std::map<std::string, Config::Server::Location>& locations = config.servers[i].locations;
+		std::map<std::string, Config::Server::Location>::const_iterator it;
+		for (it = locations.begin(); it != locations.end(); it++) {
+			if (it->second.bundle.isSome()) {
+				Result<SharedPtr<Webserv::Bundle>, Error> bundle = Webserv::loadBundle(it->second.bundle.get());
+				if (bundle.isError()) {
+					std::cerr << "Error occured when loading a bundle: " << bundle.getError().message << std::endl;
+					return false;
+				}
+			}
+			Option<std::string> root = it->second.root.isSome() ? it->second.root : config.servers[i].defaultRoot;
+			if (root.isSome() && Webserv::openRootDirectory(root.get()).isError()) {
+				std::cerr << "Warning: could not open root directory " << root.get() << std::endl;
+			}
+		}
+	}
+	return true;
+}
 
 int main(int argc, char* argv[], char *envp[]) {
+	if (argc > 1 && std::string(argv[1]) == "--bundle") {
+		return runBundleTool(argc, argv);
+	}
+
 	// Get the path of a config file
 	std::string configPath;
 	if (argc == 1) {
@@ -33,6 +84,14 @@ int main(int argc, char* argv[], char *envp[]) {
 		return 1;
 	}
 	Config config = maybeConfig.getValue();
+	if (!preloadLocations(config)) {
+		return 1;
+	}
+
+	// The caches are warmed up before the listeners start, so that the first requests already find them warm.
+	for (uint i = 0; i < config.servers.size(); i++) {
+		Webserv::warmUpServer(config.servers[i]);
+	}
 
 	std::cout << "Running the server" << std::endl;
 
@@ -57,6 +116,7 @@ int main(int argc, char* argv[], char *envp[]) {
 			dispatcher->registerTask(maybeListener.getValue());
 		}
 	}
+	CGIWorkerPool::startPools(config, envp, dispatcher.ref());
 
 	// I'm not entirely sure this is a good idea yet...
 	// Nevermind, apparently it is (source: https://stackoverflow.com/questions/108183/how-to-prevent-sigpipes-or-handle-them-properly).
@@ -0,0 +1,260 @@
+#include "multipart.hpp"
+#include "error.hpp"
+#include "http.hpp"
+#include "rootDirectory.hpp"
+#include "ystl.hpp"
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+namespace Webserv {
+	// Reads a parameter value that starts at `pos`, which is either a quoted string or a token.
+	static std::string readParameterValue(const std::string& str, size_t pos) {
+		std::string value;
+		if (pos < str.size() && str[pos] == '"') {
+			for (pos++; pos < str.size() && str[pos] != '"'; pos++) {
+				if (str[pos] == '\\' && pos + 1 < str.size()) pos++;
+				value.push_back(str[pos]);
+			}
+			return value;
+		}
+		size_t end = str.find_first_of("; \t", pos);
+		return str.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+	}
+
+	// Finds the value of the parameter (such as `boundary` or `filename`) within a header value.
+	static Option<std::string> findParameter(const std::string& header, const std::string& name) {
+		std::string lowered = strToLower(header);
+		std::string key = name + "=";
+		for (size_t pos = lowered.find(key); pos != std::string::npos; pos = lowered.find(key, pos + 1)) {
+			if (pos == 0 || lowered[pos - 1] == ';' || lowered[pos - 1] == ' ' || lowered[pos - 1] == '\t') {
+				return readParameterValue(header, pos + key.size());
+			}
+		}
+		return NONE;
+	}
+
+	Option<std::string> multipartBoundary(const std::string& contentType) {
+		if (strToLower(contentType).compare(0, 19, "multipart/form-data") != 0) return NONE;
+		Option<std::string> boundary = findParameter(contentType, "boundary");
+		if (boundary.isNone() || boundary.get().empty() || boundary.get().size() > 70) return NONE;
+		return boundary;
+	}
+
+	BoundaryMatcher::BoundaryMatcher(const std::string& delimiter): delimiter(delimiter) {
+		size_t length = delimiter.size();
+		for (size_t i = 0; i < 256; i++) {
+			skip[i] = length;
+		}
+		for (size_t i = 0; i + 1 < length; i++) {
+			skip[static_cast<unsigned char>(delimiter[i])] = length - 1 - i;
+		}
+	}
+
+	size_t BoundaryMatcher::find(const char* data, size_t length) const {
+		size_t needleLength = delimiter.size();
+		if (needleLength == 0 || length < needleLength) return std::string::npos;
+		const char* needle = delimiter.data();
+		unsigned char last = needle[needleLength - 1];
+		for (size_t pos = 0; pos + needleLength <= length;) {
+			unsigned char c = data[pos + needleLength - 1];
+			if (c == last && std::memcmp(data + pos, needle, needleLength - 1) == 0) return pos;
+			pos += skip[c];
+		}
+		return std::string::npos;
+	}
+
+	const std::string& BoundaryMatcher::getDelimiter() const {
+		return delimiter;
+	}
+
+	// The delimiter of a part is the boundary on a line of its own, so it is preceded by a line break. The line
+	// break that precedes the first delimiter is implied, and is fed to the parser up front.
+	MultipartUpload::MultipartUpload(
+		const RootDirectory& uploadDir,
+		const std::string& boundary,
+		Durability durability
+	):
+		uploadDir(uploadDir),
+		matcher("\r\n--" + boundary),
+		state(PREAMBLE),
+		buffer("\r\n"),
+		file(NULL),
+		fileCount(0),
+		durability(durability),
+		syncFd() {}
+
+	MultipartUpload::~MultipartUpload() {
+		abandonFile();
+		if (syncFd.isSome()) close(syncFd.get());
+	}
+
+	Option<Error> MultipartUpload::feed(const char* data, size_t length) {
+		if (state == FAILED) return Error(HTTP_BAD_REQUEST, "Multipart body is malformed");
+		for (size_t offset = 0; offset < length;) {
+			size_t slice = std::min(length - offset, static_cast<size_t>(MULTIPART_SLICE_SIZE));
+			buffer.append(data + offset, slice);
+			offset += slice;
+			Option<Error> error = parse();
+			if (error.isSome()) return error;
+		}
+		return NONE;
+	}
+
+	Option<Error> MultipartUpload::finish() {
+		if (state == EPILOGUE) return NONE;
+		if (state == FAILED) return Error(HTTP_BAD_REQUEST, "Multipart body is malformed");
+		return fail(Error(HTTP_BAD_REQUEST, "Multipart body ended unexpectedly"));
+	}
+
+	Option<int> MultipartUpload::takeSyncDescriptor() {
+		Option<int> taken = syncFd;
+		syncFd = NONE;
+		return taken;
+	}
+
+	size_t MultipartUpload::getFileCount() const {
+		return fileCount;
+	}
+
+	Option<Error> MultipartUpload::parse() {
+		size_t delimiterLength = matcher.getDelimiter().size();
+		while (true) {
+			switch (state) {
+			case PREAMBLE:
+			case PART_DATA: {
+				size_t delimiterPos = matcher.find(buffer.data(), buffer.size());
+				if (delimiterPos == std::string::npos) {
+					// Everything but a tail that may turn out to be the start of the delimiter is file contents.
+					size_t consumed = buffer.size() - std::min(buffer.size(), delimiterLength - 1);
+					if (state == PART_DATA) {
+						Option<Error> error = writeData(consumed);
+						if (error.isSome()) return error;
+					}
+					buffer.erase(0, consumed);
+					return NONE;
+				}
+				if (state == PART_DATA) {
+					Option<Error> error = writeData(delimiterPos);
+					if (error.isSome()) return error;
+					error = closeFile();
+					if (error.isSome()) return error;
+				}
+				buffer.erase(0, delimiterPos + delimiterLength);
+				state = DELIMITER_END;
+				break;
+			}
+			case DELIMITER_END: {
+				if (buffer.size() < 2) return NONE;
+				if (buffer.compare(0, 2, "--") == 0) {
+					state = EPILOGUE;
+					break;
+				}
+				size_t lineEnd = buffer.find("\r\n");
+				if (lineEnd == std::string::npos) {
+					if (buffer.size() > MULTIPART_HEADER_LIMIT) {
+						return fail(Error(HTTP_BAD_REQUEST, "Malformed multipart delimiter"));
+					}
+					return NONE;
+				}
+				// Only whitespace may follow the boundary on its line.
+				if (buffer.find_first_not_of(" \t") < lineEnd) {
+					return fail(Error(HTTP_BAD_REQUEST, "Malformed multipart delimiter"));
+				}
+				buffer.erase(0, lineEnd + 2);
+				state = PART_HEADERS;
+				break;
+			}
+			case PART_HEADERS: {
+				if (buffer.size() < 2) return NONE;
+				size_t headersEnd = buffer.compare(0, 2, "\r\n") == 0 ? 0 : buffer.find("\r\n\r\n");
+				if (headersEnd == std::string::npos) {
+					if (buffer.size() > MULTIPART_HEADER_LIMIT) {
+						return fail(Error(HTTP_BAD_REQUEST, "Multipart part headers are too large"));
+					}
+					return NONE;
+				}
+				std::string headers = buffer.substr(0, headersEnd);
+				buffer.erase(0, headersEnd == 0 ? 2 : headersEnd + 4);
+				Option<Error> error = startPart(headers);
+				if (error.isSome()) return error;
+				state = PART_DATA;
+				break;
+			}
+			case EPILOGUE:
+				buffer.clear();
+				return NONE;
+			case FAILED:
+				return Error(HTTP_BAD_REQUEST, "Multipart body is malformed");
+			}
+		}
+	}
+
+	// Opens the file for the part, if the part carries a file name. Only the last component of the name is used,
+	// as clients may send the whole path of the file.
+	Option<Error> MultipartUpload::startPart(const std::string& headers) {
+		size_t lineStart = 0;
+		while (lineStart < headers.size()) {
+			size_t lineEnd = headers.find("\r\n", lineStart);
+			if (lineEnd == std::string::npos) lineEnd = headers.size();
+			std::string line = headers.substr(lineStart, lineEnd - lineStart);
+			lineStart = lineEnd + 2;
+
+			size_t colon = line.find(':');
+			if (colon == std::string::npos) continue;
+			if (strToLower(trimString(line.substr(0, colon), ' ')) != "content-disposition") continue;
+
+			Option<std::string> maybeName = findParameter(line.substr(colon + 1), "filename");
+			if (maybeName.isNone()) return NONE;
+			std::string name = maybeName.get();
+			size_t slash = name.find_last_of("/\\");
+			if (slash != std::string::npos) name = name.substr(slash + 1);
+			if (name.empty() || name == "." || name == "..") return NONE;
+
+			Result<FileUpload*, Error> upload = FileUpload::start(uploadDir, name, NONE, durability);
+			if (upload.isError()) {
+				return fail(upload.getError());
+			}
+			file = upload.getValue();
+			return NONE;
+		}
+		return NONE;
+	}
+
+	// Writes the start of the buffer out into the file of the current part, if there is one.
+	Option<Error> MultipartUpload::writeData(size_t length) {
+		if (!file) return NONE;
+		Option<Error> error = file->feed(buffer.data(), length);
+		if (error.isSome()) return fail(error.get());
+		return NONE;
+	}
+
+	Option<Error> MultipartUpload::closeFile() {
+		if (!file) return NONE;
+		Option<Error> error = file->finish();
+		// All the files go into the same directory, so syncing its file system once covers every one of them.
+		Option<int> fileSyncFd = error.isNone() ? file->takeSyncDescriptor() : NONE;
+		if (fileSyncFd.isSome()) {
+			if (syncFd.isNone()) syncFd = fileSyncFd;
+			else close(fileSyncFd.get());
+		}
+		delete file;
+		file = NULL;
+		if (error.isSome()) return fail(error.get());
+		fileCount++;
+		return NONE;
+	}
+
+	void MultipartUpload::abandonFile() {
+		delete file;
+		file = NULL;
+	}
+
+	Error MultipartUpload::fail(const Error& error) {
+		abandonFile();
+		state = FAILED;
+		buffer.clear();
+		return error;
+	}
+}
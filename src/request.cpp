@@ -1,15 +1,28 @@
+#include "bundle.hpp"
+#include "compression.hpp"
 #include "config.hpp"
 #include "dispatcher.hpp"
 #include "error.hpp"
 #include "http.hpp"
+#include "multipart.hpp"
+#include "upload.hpp"
+#include "rootDirectory.hpp"
 #include "tasks.hpp"
 #include "url.hpp"
 #include "webserv.hpp"
 #include "ystl.hpp"
+#include <arpa/inet.h>
+#include <cctype>
+#include <climits>
 #include <cstddef>
 #include <cstdio>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream> //added for file uploading
+#include <sstream>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 typedef Result<SharedPtr<Webserv::IFDTask>, Webserv::Error> TaskResult;
 typedef Webserv::Config::Server::Location Location;
@@ -27,19 +40,167 @@ namespace Webserv {
 			return HTTP_DELETE_FLAG & configByte;
 		case Webserv::HEAD:
 			return HTTP_GET_FLAG & configByte;
+		case Webserv::COPY:
+			return HTTP_COPY_FLAG & configByte;
+		case Webserv::MOVE:
+			return HTTP_MOVE_FLAG & configByte;
 		}
 		return false;
 	}
 
+	// Joins the segments of a url into a relative path (with no leading slash).
+	static std::string joinSegments(const std::vector<std::string>& segments) {
+		std::string path;
+		for (std::vector<std::string>::const_iterator it = segments.begin(); it != segments.end(); it++) {
+			if (!path.empty()) path += "/";
+			path += *it;
+		}
+		return path;
+	}
+
+	// The file that `tryFiles` has settled on: its path beneath the root directory, and its type.
+	struct TriedFile {
+		std::string path;
+		FSType type;
+	};
+
+	static FSType fsTypeOf(const struct stat& st) {
+		if (S_ISREG(st.st_mode)) return FS_FILE;
+		if (S_ISDIR(st.st_mode)) return FS_DIRECTORY;
+		return FS_NONE;
+	}
+
+	// Picks the first candidate of the `tryFiles` list of the location that exists. Candidates that end with
+	// a slash only match directories. The candidates are checked against the cached metadata, so resolving the
+	// usual paths takes no system calls at all. The fallback is served internally, without redirecting the client.
+	static Result<TriedFile, Error> resolveTryFiles(
+		const std::vector<std::string>& candidates,
+		const RootDirectory& root,
+		const std::string& requestedPath
+	) {
+		for (size_t i = 0; i < candidates.size(); i++) {
+			std::string candidate = candidates[i];
+			bool isFallback = i + 1 == candidates.size();
+			if (isFallback && candidate.size() > 1 && candidate[0] == '=') {
+				Option<int> code = strToInt(candidate.substr(1));
+				if (code.isNone() || code.get() < 100 || code.get() > 599) {
+					return Error(HTTP_INTERNAL_SERVER_ERROR, "Invalid tryFiles status code: " + candidate);
+				}
+				return Error(static_cast<HTTPReturnCode>(code.get()), "File was not found");
+			}
+
+			for (size_t pos = candidate.find("$uri"); pos != std::string::npos; pos = candidate.find("$uri", pos)) {
+				candidate.replace(pos, 4, requestedPath);
+				pos += requestedPath.size();
+			}
+			bool directoryOnly = !candidate.empty() && candidate[candidate.size() - 1] == '/';
+			Option<Url> url = Url::fromString("/" + candidate);
+			if (url.isNone()) continue;
+
+			TriedFile tried;
+			tried.path = joinSegments(url.get().getSegments());
+			tried.type = FS_NONE;
+			struct stat st;
+			if (statCached(root, tried.path, st) == 0) tried.type = fsTypeOf(st);
+			if (isFallback || tried.type == FS_DIRECTORY || (tried.type == FS_FILE && !directoryOnly)) {
+				return tried;
+			}
+		}
+		return Error(HTTP_NOT_FOUND, "File was not found");
+	}
+
+	// Passes the request on to a FastCGI application, with the same meta-variables that a CGI script gets in its
+	// environment. The application runs in a process of its own, so the script is given by its absolute path.
+	static TaskResult handleFastCGI(
+		int clientSocketFd,
+		const std::string& address,
+		const Url& scriptLocation,
+		const Url& rest,
+		const Config::Server::Location& location,
+		HTTPRequest& request,
+		ServerData& sData
+	) {
+		std::map<std::string, std::string> params;
+		const std::map<std::string, std::string>& headers = request.getHeaders();
+		for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); it++) {
+			std::string name = "HTTP_" + it->first;
+			for (size_t i = 5; i < name.size(); i++) {
+				name[i] = name[i] == '-' ? '_' : std::toupper(static_cast<unsigned char>(name[i]));
+			}
+			if (name != "HTTP_CONTENT_LENGTH" && name != "HTTP_CONTENT_TYPE") params[name] = it->second;
+		}
+
+		std::string scriptPath = scriptLocation.toString(false, true);
+		if (scriptPath.empty() || scriptPath[0] != '/') {
+			char cwd[PATH_MAX];
+			if (getcwd(cwd, sizeof(cwd))) scriptPath = std::string(cwd) + "/" + scriptPath;
+		}
+		const std::vector<std::string>& segments = request.getPath().getSegments();
+		std::vector<std::string> scriptSegments(segments.begin(), segments.end() - rest.tail().getSegments().size());
+		std::ostringstream length;
+		length << request.getData().size();
+		std::ostringstream port;
+		port << sData.port;
+
+		params["GATEWAY_INTERFACE"] = "CGI/1.1";
+		params["SERVER_SOFTWARE"] = "webserv";
+		params["SERVER_PROTOCOL"] = "HTTP/1.1";
+		params["SERVER_PORT"] = port.str();
+		params["REQUEST_METHOD"] = httpMethodName(request.getMethod());
+		params["REQUEST_URI"] = request.getPath().toString();
+		params["SCRIPT_NAME"] = "/" + joinSegments(scriptSegments);
+		params["SCRIPT_FILENAME"] = scriptPath;
+		params["PATH_INFO"] = rest.tail().getSegments().empty() ? "" : rest.tail().toString(true, true);
+		params["QUERY_STRING"] = request.getPath().queryToString();
+		params["CONTENT_LENGTH"] = length.str();
+		params["CONTENT_TYPE"] = request.getHeader("Content-Type").getOr("");
+		struct sockaddr_in peer;
+		socklen_t peerLength = sizeof(peer);
+		if (getpeername(clientSocketFd, reinterpret_cast<struct sockaddr*>(&peer), &peerLength) == 0
+		&& peer.sin_family == AF_INET) {
+			char peerAddress[INET_ADDRSTRLEN];
+			if (inet_ntop(AF_INET, &peer.sin_addr, peerAddress, sizeof(peerAddress))) {
+				params["REMOTE_ADDR"] = peerAddress;
+			}
+		}
+
+		ConnectionInfo conn;
+		conn.connectionFd = clientSocketFd;
+		Result<SharedPtr<FastCGIWriter>, Error> writer = FastCGIConnection::submit(
+			conn,
+			address,
+			params,
+			request.getData(),
+			location,
+			request.getHeader("Accept-Encoding")
+		);
+		if (writer.isError()) return writer.getError();
+		return writer.getValue().tryAs<IFDTask>().get();
+	}
+
+	// Reads the body that was spooled into a file back into memory.
+	static Result<std::string, Error> readSpooledBody(int fd) {
+		std::string body;
+		char buffer[UPLOAD_RECEIVE_SIZE];
+		off_t offset = 0;
+		while (true) {
+			long readResult = pread(fd, buffer, sizeof(buffer), offset);
+			if (readResult < 0) return Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to read the spooled request body");
+			if (readResult == 0) return body;
+			body.append(buffer, readResult);
+			offset += readResult;
+		}
+	}
+
 	TaskResult handleCGI(
 		int clientSocketFd,
 		const Url& root,
 		const Url& rest,
 		const Config::Server::Location& location,
 		HTTPRequest& request,
-		ServerData& sData
+		ServerData& sData,
+		const Option<int>& spooledBody
 	) {
-		(void)location;
 		// First - determine what kind of interpreter to run for the CGI
 		if (rest.getSegments().empty()) {
 			return Error(HTTP_FORBIDDEN, "No script was selected");
@@ -47,6 +208,24 @@ namespace Webserv {
 
 		Url scriptLocation = root + rest.head();
 		std::string extension = scriptLocation.getExtension().getOr("");
+
+		// The body is sent to FastCGI applications along with the rest of the request, so it is needed in memory.
+		std::map<std::string, std::string>::const_iterator application = sData.fastcgiApplications.find(extension);
+		bool fastCGI = location.fastcgiPass.isSome() || application != sData.fastcgiApplications.end();
+		if (fastCGI && spooledBody.isSome()) {
+			Result<std::string, Error> body = readSpooledBody(spooledBody.get());
+			if (body.isError()) return body.getError();
+			HTTPRequest bodyRequest = request.withDecodedData(body.getValue());
+			return handleCGI(clientSocketFd, root, rest, location, bodyRequest, sData, NONE);
+		}
+
+		// Scripts that a FastCGI application runs are passed on to it, and no interpreter is started.
+		if (location.fastcgiPass.isSome()) {
+			return handleFastCGI(clientSocketFd, location.fastcgiPass.get(), scriptLocation, rest, location, request, sData);
+		}
+		if (application != sData.fastcgiApplications.end()) {
+			return handleFastCGI(clientSocketFd, application->second, scriptLocation, rest, location, request, sData);
+		}
 		std::string interpPath;
 		if (extension.empty()) {
 			interpPath = "";
@@ -66,134 +245,240 @@ namespace Webserv {
 		ConnectionInfo conn;
 		conn.connectionFd = clientSocketFd;
 		// Now construct the pipeline.
-		Result<CGIPipeline, Error> maybePipeline = makeCGIPipeline(
+		Result<SharedPtr<CGIReader>, Error> maybeReader = makeCGIPipeline(
 			conn,
 			maybeInterpLocation.get(),
 			scriptLocation,
 			rest.tail(),
 			request,
-			sData.envp,
+			spooledBody,
+			CGIEnvironment::forLocation(location, sData),
+			location.cgiPool ? CGIWorkerPool::forExtension(extension) : NULL,
 			sData.messageBufferSize
 		);
-		if (maybePipeline.isError())
-			return maybePipeline.getError();
-
-		std::string cgiStdinData;
-		cgiStdinData = request.toString();
+		if (maybeReader.isError())
+			return maybeReader.getError();
 
-		CGIPipeline& pipeline = maybePipeline.getValue();
-		pipeline.first->consumeFileData(cgiStdinData);
+		SharedPtr<CGIReader>& reader = maybeReader.getValue();
+		reader->setCompression(location, request.getHeader("Accept-Encoding"));
+		return reader.tryAs<IFDTask>().get();
+	}
 
-		return pipeline.second.tryAs<IFDTask>().get();
+	// Returns the durability of the uploads that are stored after their whole body was read. Their responses are
+	// not held back for a group commit, so each of them is synced on its own instead.
+	static Durability immediateDurability(const Config::Server::Location& location) {
+		if (location.durability == Config::Server::Location::DURABILITY_GROUP) {
+			return Config::Server::Location::DURABILITY_FILE;
+		}
+		return location.durability;
 	}
 
+	// Stores the files of a `multipart/form-data` body that was read into memory as a whole.
 	static Option<Error> handleFileUploadWithPUSH(
-		HTTPRequest& request,
-		const Url& uploadPath
+		const HTTPRequest& request,
+		const RootDirectory& uploadDir,
+		Durability durability
 	) {
-		// 1) Get the uploaded file from the request
-		std::string requestData = request.getData();
-		// std::cout << "(DEBUG) Received file data:\n" << requestData << std::endl;
-
-		// 2) Validate the uploaded file
-		Option<std::string> requestHeader = request.getHeader("Content-Type");
-		if (requestHeader.isNone()) {
+		Option<std::string> contentType = request.getHeader("Content-Type");
+		if (contentType.isNone()) {
 			return Error(HTTP_BAD_REQUEST, "Missing Content-Type header");
 		}
-		// std::cout << "(DEBUG) Received Content-Type header:\n" << requestHeader.get() << std::endl;
-
-		// 3) Parse the request body; retrieve the content type from the header
-		std::string contentTypeHeader = requestHeader.get();
-		std::string boundaryPrefix = "boundary=";
-		std::size_t boundaryPos = contentTypeHeader.find(boundaryPrefix);
-		if (boundaryPos == std::string::npos) {
+		Option<std::string> boundary = multipartBoundary(contentType.get());
+		if (boundary.isNone()) {
 			return Error(HTTP_BAD_REQUEST, "Missing boundary in Content-Type header");
 		}
 
-		std::string boundary = contentTypeHeader.substr(boundaryPos + boundaryPrefix.length(), contentTypeHeader.npos);
-		std::string boundLine = "--" + boundary;
-		std::size_t partStart = requestData.find(boundLine);
-		if (partStart == std::string::npos) {
-			return Error(HTTP_BAD_REQUEST, "Boundary not found in request data");
+		MultipartUpload upload(uploadDir, boundary.get(), durability);
+		const std::string& data = request.getData();
+		Option<Error> maybeError = upload.feed(data.data(), data.size());
+		if (maybeError.isSome()) {
+			return maybeError;
 		}
-		partStart += boundLine.length();
-		if (requestData.substr(partStart, 2) == "\r\n") {
-			partStart += 2;
+		return upload.finish();
+	}
+
+	// Returns the root directory of the location, falling back to the default one of the server.
+	static Option<std::string> locationRoot(const Config::Server::Location& location, const ServerData& sData) {
+		if (location.root.isSome()) return location.root.get();
+		return sData.config.defaultRoot;
+	}
+
+	// Returns the coding that the request body is decoded from at the location, or `NONE` if it is taken as is.
+	static Result<Option<ContentCoding>, Error> requestCoding(
+		const Option<std::string>& contentEncoding,
+		const Config::Server::Location& location
+	) {
+		if (!location.decodeRequestBodies) {
+			Option<ContentCoding> none = NONE;
+			return none;
 		}
-		std::string contentType = contentTypeHeader.substr(0, boundaryPos);
+		return requestBodyCoding(contentEncoding);
+	}
+
+	// Returns the largest size that a request body may decode into at the location.
+	static size_t maxDecodedSize(const Config::Server::Location& location, const ServerData& sData) {
+		return location.maxDecodedSize.getOr(location.maxRequestSize.getOr(sData.maxRequestSize));
+	}
 
-		std::size_t headersEndPos = requestData.find("\r\n\r\n", partStart);
-		if (headersEndPos == std::string::npos){
-			return Error(HTTP_BAD_REQUEST, "Malformed headers in request data");
+	// Makes the upload decode the body on its way in, if the body is encoded.
+	static SharedPtr<IUploadSink> decodedUpload(
+		IUploadSink* upload,
+		const Option<ContentCoding>& coding,
+		const Config::Server::Location& location,
+		const ServerData& sData
+	) {
+		SharedPtr<IUploadSink> target(upload);
+		if (coding.isNone()) return target;
+		return SharedPtr<IUploadSink>(
+			new DecodingUpload(target, coding.get(), maxDecodedSize(location, sData), location.maxDecodeRatio)
+		);
+	}
+
+	// Starts storing the body of a PUT request as the file, or as a range of it if the request has a `Content-Range`.
+	static Result<FileUpload*, Error> startFileUpload(
+		const RootDirectory& root,
+		const std::string& filePath,
+		const Option<std::string>& contentRange,
+		Option<size_t> size,
+		Durability durability
+	) {
+		if (contentRange.isNone()) {
+			return FileUpload::start(root, filePath, size, durability);
+		}
+		Option<ContentRange> range = parseContentRange(contentRange.get());
+		if (range.isNone()) {
+			return Error(HTTP_BAD_REQUEST, "Malformed Content-Range header");
 		}
-		std::string headers = requestData.substr(partStart, headersEndPos - partStart);
-		// std::cout << "(DEBUG) Headers: " << headers << std::endl;
+		if (size.isNone() || size.get() != range.get().last - range.get().first + 1) {
+			return Error(HTTP_BAD_REQUEST, "Content-Range does not match the length of the body");
+		}
+		return FileUpload::resume(root, filePath, range.get(), durability);
+	}
 
-		std::string filename;
-		std::size_t contentDispPos = headers.find("Content-Disposition:");
-		if (contentDispPos != std::string::npos) {
-			std::size_t filenamePos = headers.find("filename=\"", contentDispPos);
-			if (filenamePos != std::string::npos) {
-				filenamePos += 10;
-				std::size_t filenameEndPos = headers.find("\"", filenamePos);
-				if (filenameEndPos != std::string::npos){
-					filename = headers.substr(filenamePos, filenameEndPos - filenamePos);
-				}
-				else {
-					return Error(HTTP_BAD_REQUEST, "Malformed filename in Content-Disposition.");
-				}
-			}
-			else {
-				return Error(HTTP_BAD_REQUEST, "Filename not found in Content-Disposition.");
-			}
+	Result<Option<SharedPtr<IUploadSink> >, Error> startUpload(
+		const HTTPRequest::Builder& builder,
+		const LocationTreeNode::LocationSearchResult& query,
+		const ServerData& sData
+	) {
+		const Config::Server::Location& location = *query.location;
+		Option<HTTPMethod> method = builder.getHTTPMethod();
+		Option<SharedPtr<IUploadSink> > noUpload = NONE;
+		if (
+			method.isNone()
+			|| builder.isChunked()
+			|| location.redirection.isSome()
+			|| location.bundle.isSome()
+			|| !checkIfMethodIsInByte(method.get(), location.allowedMethods)
+		) {
+			return noUpload;
 		}
-		else {
-			return Error(HTTP_BAD_REQUEST, "Filename not found.");
-		}
-
-		std::size_t fileStart = headersEndPos + 4;
-		std::string closingBoundary = boundLine + "--";
-		std::size_t fileEnd = requestData.find(closingBoundary, fileStart);
-		std::cout << closingBoundary << std::endl;
-		if (fileEnd == std::string::npos) {
-			std::string altClosingBoundary = "\r\n" + closingBoundary;
-			fileEnd = requestData.find(altClosingBoundary, fileStart);
-			if (fileEnd != std::string::npos) {
-				closingBoundary = altClosingBoundary;
-			}
-			// std::cout << "(DEBUG) Found closing boundary: " << fileEnd << std::endl;
-		}
-		std::string fileContent = requestData.substr(fileStart, fileEnd - fileStart);
-		fileContent = fileContent.substr(0, fileContent.length() - closingBoundary.length() - 2);
-
-		// std::cout << "(DEBUG) Retrieved content type:\n" << contentType << std::endl;
-		if (contentType == "multipart/form-data; ") {
-			// 4) Store the uploaded file in exampleSite/upload
-			// 4.1) Create the file in the upload directory
-			std::string filePath = uploadPath.toString(false, true) + "/" + filename;
-			std::ofstream uploadFile(filePath.c_str());
-			if (!uploadFile.is_open()) {
-				return Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to create an upload file");
+
+		Option<std::string> root = locationRoot(location, sData);
+		if (root.isNone()) return noUpload;
+		Result<RootDirectory, Error> rootDir = openRootDirectory(root.get());
+		if (rootDir.isError()) return noUpload;
+		Result<Option<ContentCoding>, Error> coding = requestCoding(builder.getHeader("Content-Encoding"), location);
+		if (coding.isError()) return coding.getError();
+
+		if (method.get() == PUT && !query.tail.getSegments().empty()) {
+			// A range is a range of the file, which can not be matched against a body before it is decoded.
+			if (coding.getValue().isSome() && builder.getHeader("Content-Range").isSome()) {
+				return Error(HTTP_UNSUPPORTED_MEDIA_TYPE, "Ranges of a file can not be uploaded encoded");
 			}
+			// The size of an encoded body tells nothing about the size of the file.
+			Option<uint> contentLength = builder.getContentLength();
+			Option<size_t> size = NONE;
+			if (contentLength.isSome() && coding.getValue().isNone()) size = contentLength.get();
+			Result<FileUpload*, Error> upload = startFileUpload(
+				rootDir.getValue(),
+				joinSegments(query.tail.getSegments()),
+				builder.getHeader("Content-Range"),
+				size,
+				location.durability
+			);
+			if (upload.isError()) return upload.getError();
+			return Option<SharedPtr<IUploadSink> >(decodedUpload(upload.getValue(), coding.getValue(), location, sData));
+		}
 
-			// 4.2) Write the file content
-			uploadFile << fileContent;
+		// Large bodies of requests to CGI scripts are spooled into a file as they arrive, for the script to read.
+		if (
+			method.get() == POST
+			&& location.allowCGI
+			&& location.fastcgiPass.isNone()
+			&& builder.getContentLength().getOr(0) >= SPOOL_MIN_SIZE
+		) {
+			Result<SpooledBody*, Error> spool = SpooledBody::start();
+			if (spool.isError()) return spool.getError();
+			return Option<SharedPtr<IUploadSink> >(decodedUpload(spool.getValue(), coding.getValue(), location, sData));
 		}
-		return NONE;
+
+		if (
+			method.get() == POST
+			&& location.fileUploadFieldId.isSome()
+			&& !location.allowCGI
+			&& location.fastcgiPass.isNone()
+			&& query.tail.getSegments().empty()
+		) {
+			Option<std::string> contentType = builder.getHeader("Content-Type");
+			Option<std::string> boundary = contentType.isSome() ? multipartBoundary(contentType.get()) : NONE;
+			if (boundary.isNone()) return noUpload;
+			MultipartUpload* upload = new MultipartUpload(rootDir.getValue(), boundary.get(), location.durability);
+			return Option<SharedPtr<IUploadSink> >(decodedUpload(upload, coding.getValue(), location, sData));
+		}
+		return noUpload;
+	}
+
+	// Acknowledges a file that is being uploaded in ranges with the amount of it received so far.
+	static TaskResult respondWithUploadOffset(ConnectionInfo conn, size_t received) {
+		std::ostringstream offset;
+		offset << received;
+		HTTPResponse response = HTTPResponse(Url(), HTTP_NO_CONTENT);
+		response.setHeader("Upload-Offset", offset.str());
+
+		Result<ResponseHandler*, Error> handler = ResponseHandler::tryMake(conn, response);
+		if (handler.isError()) {
+			return handler.getError();
+		}
+		return SharedPtr<IFDTask>(handler.getValue());
 	}
 
 	static TaskResult handleFileUploadWithPUT(
 		ConnectionInfo conn,
 		HTTPRequest& request,
-		const Url& uploadPath
+		const RootDirectory& root,
+		const std::string& filePath,
+		Durability durability,
+		bool uploadStored
 	) {
-		std::string filePath = uploadPath.toString(false, true);
-		std::ofstream uploadFile(filePath.c_str());
-		if (!uploadFile.is_open()) {
-			return Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to create/open an upload file");
+		// Bodies that were not stored as they arrived are stored the same way, out of memory.
+		Option<std::string> contentRange = request.getHeader("Content-Range");
+		if (!uploadStored) {
+			const std::string& data = request.getData();
+			Result<FileUpload*, Error> maybeUpload = startFileUpload(
+				root,
+				filePath,
+				contentRange,
+				data.size(),
+				durability
+			);
+			if (maybeUpload.isError()) {
+				return maybeUpload.getError();
+			}
+			UniquePtr<FileUpload> upload(maybeUpload.getValue());
+			Option<Error> maybeError = upload->feed(data.data(), data.size());
+			if (maybeError.isNone()) {
+				maybeError = upload->finish();
+			}
+			if (maybeError.isSome()) {
+				return maybeError.get();
+			}
 		}
 
-		uploadFile << request.getData();
+		// A range that leaves the file incomplete is not a new file yet.
+		Option<size_t> received = contentRange.isSome() ? receivedUploadSize(root, filePath) : NONE;
+		if (received.isSome()) {
+			return respondWithUploadOffset(conn, received.get());
+		}
 
 		HTTPResponse response = HTTPResponse(Url(), HTTP_CREATED);
 
@@ -208,10 +493,11 @@ namespace Webserv {
 
 	static TaskResult handleFileRemoval(
 		ConnectionInfo conn,
-		const Url& filePath
+		const RootDirectory& root,
+		const std::string& filePath
 	) {
 		// This might not be compliant with the subject document, but IDGAF at this point.
-		int status = std::remove(filePath.toString(false, true).c_str());
+		int status = unlinkBeneath(root, filePath);
 
 		HTTPResponse response = HTTPResponse(Url(), status < 0? HTTP_INTERNAL_SERVER_ERROR : HTTP_OK);
 
@@ -224,12 +510,120 @@ namespace Webserv {
 		return SharedPtr<IFDTask>(handler.getValue());
 	}
 
+	// Returns the path within the location that the `Destination` header of the request points to. The header
+	// holds either an absolute URL or an absolute path, which has to lead into the same location.
+	static Result<std::string, Error> destinationPath(
+		const HTTPRequest& request,
+		const Config::Server::Location& location,
+		const ServerData& sData
+	) {
+		Option<std::string> header = request.getHeader("Destination");
+		if (header.isNone()) {
+			return Error(HTTP_BAD_REQUEST, "Missing Destination header");
+		}
+		std::string destination = trimString(header.get(), ' ');
+		size_t scheme = destination.find("://");
+		if (scheme != std::string::npos) {
+			size_t pathStart = destination.find('/', scheme + 3);
+			destination = pathStart == std::string::npos ? "/" : destination.substr(pathStart);
+		}
+		Option<Url> url = NONE;
+		if (!destination.empty() && destination[0] == '/') url = Url::fromString(destination);
+		if (url.isNone()) {
+			return Error(HTTP_BAD_REQUEST, "Malformed Destination header");
+		}
+
+		const std::vector<std::string>& segments = url.get().getSegments();
+		for (std::vector<std::string>::const_iterator it = segments.begin(); it != segments.end(); it++) {
+			if (*it == "." || *it == "..") {
+				return Error(HTTP_BAD_REQUEST, "Malformed Destination header");
+			}
+		}
+		Option<LocationTreeNode::LocationSearchResult> found = sData.locations.tryFindLocation(url.get());
+		std::string path = found.isSome() && found.get().location == &location
+			? joinSegments(found.get().tail.getSegments())
+			: "";
+		if (path.empty()) {
+			return Error(HTTP_FORBIDDEN, "Destination is outside of the location");
+		}
+		return path;
+	}
+
+	// Copies or moves the file to the `Destination` of the request, without its contents ever passing through the
+	// server. The destination is replaced unless the request has `Overwrite: F`.
+	static TaskResult handleFileTransfer(
+		ConnectionInfo conn,
+		HTTPRequest& request,
+		const Config::Server::Location& location,
+		const ServerData& sData,
+		const RootDirectory& root,
+		const std::string& filePath
+	) {
+		Result<std::string, Error> destination = destinationPath(request, location, sData);
+		if (destination.isError()) {
+			return destination.getError();
+		}
+		if (filePath.empty() || destination.getValue() == filePath) {
+			return Error(HTTP_FORBIDDEN, "Destination has to differ from the file");
+		}
+		bool replace = strToLower(trimString(request.getHeader("Overwrite").getOr("T"), ' ')) != "f";
+
+		Result<bool, Error> replaced = request.getMethod() == COPY
+			? copyFile(root, filePath, destination.getValue(), replace, immediateDurability(location))
+			: moveFile(root, filePath, destination.getValue(), replace, immediateDurability(location));
+		if (replaced.isError()) {
+			return replaced.getError();
+		}
+
+		HTTPResponse response = HTTPResponse(Url(), replaced.getValue() ? HTTP_NO_CONTENT : HTTP_CREATED);
+
+		Result<ResponseHandler*, Error> handler = ResponseHandler::tryMake(conn, response);
+
+		if (handler.isError()) {
+			return handler.getError();
+		}
+
+		return SharedPtr<IFDTask>(handler.getValue());
+	}
+
+	// Serves the file from the bundle of the location. Paths that name directories resolve to their index files.
+	static TaskResult handleBundleLocation(
+		ConnectionInfo conn,
+		const Url& path,
+		const Config::Server::Location& location,
+		HTTPRequest& request
+	) {
+		if (request.getMethod() != GET && request.getMethod() != HEAD) {
+			return Error(HTTP_METHOD_NOT_ALLOWED, "Bundled locations only serve files");
+		}
+		Result<SharedPtr<Bundle>, Error> bundle = loadBundle(location.bundle.get());
+		if (bundle.isError()) {
+			return Error(HTTP_INTERNAL_SERVER_ERROR, bundle.getError().message);
+		}
+
+		std::string filePath = joinSegments(request.getPath().tailDiff(path).getSegments());
+
+		const BundleEntry* entry = filePath.empty() ? NULL : bundle.getValue()->find(filePath);
+		if (!entry) {
+			std::string index = location.index.getOr("index.html");
+			filePath = filePath.empty() ? index : filePath + "/" + index;
+			entry = bundle.getValue()->find(filePath);
+		}
+		if (!entry) {
+			return Error(HTTP_NOT_FOUND, "File was not found");
+		}
+		HTTPContentType contentType = getContentType(Url::fromString("/" + filePath).getOr(Url()));
+		return serveBundleFile(conn, request, location, bundle.getValue(), *entry, contentType);
+	}
+
 	TaskResult handleLocation(
 		const Url& path,
 		const Config::Server::Location& location,
 		HTTPRequest& request,
 		ServerData& sData,
-		int clientSocketFd
+		int clientSocketFd,
+		bool uploadStored,
+		const Option<int>& spooledBody
 	) {
 		ConnectionInfo conn;
 		conn.connectionFd = clientSocketFd;
@@ -252,34 +646,43 @@ namespace Webserv {
 			return SharedPtr<IFDTask>(response.getValue());
 		}
 
-		std::string root;
-
-		// Existing root location checks
-		if (location.root.isSome()) {
-			root = location.root.get();
-		}
-		else if (sData.config.defaultRoot.isSome()) {
-			root = sData.config.defaultRoot.get();
+		if (location.bundle.isSome()) {
+			if (!checkIfMethodIsInByte(request.getMethod(), location.allowedMethods)) {
+				return Error(HTTP_METHOD_NOT_ALLOWED, "HTTP method is not allowed");
+			}
+			return handleBundleLocation(conn, path, location, request);
 		}
-		else {
+
+		Option<std::string> maybeRoot = locationRoot(location, sData);
+		if (maybeRoot.isNone()) {
 			return Error(Error::CONFIG_ERROR, "Missing root location in configuration");
 		}
+		std::string root = maybeRoot.get();
 
 		Url rootUrl = Url::fromString(root).get();
 		Url tail = request.getPath().tailDiff(path);
-		if (location.allowCGI && (request.getMethod() == POST || request.getMethod() == GET)) {
-			return handleCGI(clientSocketFd, rootUrl, tail, location, request, sData);
+		bool runsScripts = location.allowCGI || location.fastcgiPass.isSome();
+		if (runsScripts && (request.getMethod() == POST || request.getMethod() == GET)) {
+			return handleCGI(clientSocketFd, rootUrl, tail, location, request, sData, spooledBody);
+		}
+
+		// Files are resolved relative to the root directory, which confines them beneath it.
+		Result<RootDirectory, Error> maybeRootDir = openRootDirectory(root);
+		if (maybeRootDir.isError()) {
+			return maybeRootDir.getError();
 		}
+		const RootDirectory& rootDir = maybeRootDir.getValue();
+		std::string respFilePath = joinSegments(tail.getSegments());
 
 		if (!checkIfMethodIsInByte(request.getMethod(), location.allowedMethods)) {
 			return Error(HTTP_METHOD_NOT_ALLOWED, "HTTP method is not allowed");
 		};
 		
-		Option<std::string> fileContent = NONE;
 		if (tail.getSegments().empty()
 		&& request.getMethod() == POST
-		&& location.fileUploadFieldId.isSome()) {
-			Option<Error> maybeError = handleFileUploadWithPUSH(request, rootUrl);
+		&& location.fileUploadFieldId.isSome()
+		&& !uploadStored) {
+			Option<Error> maybeError = handleFileUploadWithPUSH(request, rootDir, immediateDurability(location));
 			if (maybeError.isSome()) {
 				return maybeError.get();
 			}
@@ -287,36 +690,60 @@ namespace Webserv {
 
 		Url respFileUrl = rootUrl + tail;
 		if (request.getMethod() == PUT) {
-			return handleFileUploadWithPUT(conn, request, respFileUrl);
+			return handleFileUploadWithPUT(
+				conn,
+				request,
+				rootDir,
+				respFilePath,
+				immediateDurability(location),
+				uploadStored
+			);
 		}
 
 		if (request.getMethod() == DELETE) {
-			return handleFileRemoval(conn, respFileUrl);
+			return handleFileRemoval(conn, rootDir, respFilePath);
+		}
+
+		if (request.getMethod() == COPY || request.getMethod() == MOVE) {
+			return handleFileTransfer(conn, request, location, sData, rootDir, respFilePath);
+		}
+
+		// A file that is being uploaded in ranges reports how much of it was received, so that the upload can be
+		// resumed from there.
+		if (request.getMethod() == HEAD && checkIfMethodIsInByte(PUT, location.allowedMethods)) {
+			Option<size_t> received = receivedUploadSize(rootDir, respFilePath);
+			if (received.isSome()) {
+				return respondWithUploadOffset(conn, received.get());
+			}
 		}
 
-		std::string respFilePath = respFileUrl.toString(false);
 #ifdef DEBUG
-		std::cout << "Trying to load: " << respFilePath << std::endl;
+		std::cout << "Trying to load: " << rootDir.diskPath(respFilePath) << std::endl;
 #endif
 
 		// Check file system type and load content
-		FSType fsType = checkFSType(respFilePath);
+		struct stat respFileStat;
+		FSType fsType = FS_NONE;
+		if (!location.tryFiles.empty() && (request.getMethod() == GET || request.getMethod() == HEAD)) {
+			Result<TriedFile, Error> tried = resolveTryFiles(location.tryFiles, rootDir, respFilePath);
+			if (tried.isError()) {
+				return tried.getError();
+			}
+			respFilePath = tried.getValue().path;
+			fsType = tried.getValue().type;
+			tail = Url::fromString("/" + respFilePath).getOr(Url());
+			respFileUrl = rootUrl + tail;
+		}
+		else if (statBeneath(rootDir, respFilePath, respFileStat) == 0) {
+			fsType = fsTypeOf(respFileStat);
+		}
 		HTTPContentType contentType = BYTE_STREAM;
+		Option<SharedPtr<IResponseBody> > responseBody = NONE;
 		switch (fsType) {
 		case FS_NONE:
-			fileContent = NONE;
-			break;
-		case FS_FILE: {
-				std::ifstream respFile(respFilePath.c_str());
-				if (respFile.is_open()) {
-					fileContent = readAll(respFile);
-					contentType = getContentType(respFileUrl);
-				}
-				else {
-					return Error(Error::GENERIC_ERROR, "Failed to open a file");
-				}
-			}
 			break;
+		case FS_FILE:
+			return serveStaticFile(conn, request, location, rootDir, respFilePath, getContentType(respFileUrl));
 		case FS_DIRECTORY:
 			if (!location.dirListing) {
 				std::string indexStr = location.index.getOr("index.html");
@@ -325,39 +752,52 @@ namespace Webserv {
 					return Error(Error::CONFIG_ERROR, "Invalid index file URL");
 				}
 				Url index = maybeIndex.get();
-	
-				std::string indexFilePath = (respFileUrl + index).toString(false);
-				std::cout << "Trying to load: " << indexFilePath << std::endl;
-				std::ifstream respFile(indexFilePath.c_str());
-	
-				if (respFile.is_open()) { // Try to load index file
-					fileContent = readAll(respFile);
-					Url indexFileUrl = respFileUrl + index;
-					contentType = getContentType(indexFileUrl);
-				}
-				else {
+
+				std::string indexFilePath = joinSegments((tail + index).getSegments());
+#ifdef DEBUG
+				std::cout << "Trying to load: " << rootDir.diskPath(indexFilePath) << std::endl;
+#endif
+
+				// Try to load index file
+				TaskResult indexResponse = serveStaticFile(
+					conn,
+					request,
+					location,
+					rootDir,
+					indexFilePath,
+					getContentType(respFileUrl + index)
+				);
+				if (indexResponse.isError()) {
 					return Error(HTTP_NOT_FOUND, "Index file was not found");
 				}
+				return indexResponse;
 			}
 			else { // Try to create directory listing
-				std::string urlPath = request.getPath().toString(true);
-				fileContent = makeDirectoryListing(
+				std::string urlPath = request.getPath().toString(true, true);
+				Result<SharedPtr<IResponseBody>, Error> listing = makeDirectoryListing(
+					rootDir,
 					respFilePath,
 					urlPath,
 					tail.getSegments().size() == 0,
-					location.fileUploadFieldId.isSome()
+					location.fileUploadFieldId.isSome(),
+					DirListingOptions::fromUrl(request.getPath())
 				);
+				if (listing.isError()) {
+					return listing.getError();
+				}
+				responseBody = listing.getValue();
 				contentType = HTML;
 			}
 			break;
 		}
 
-		if (fileContent.isSome()) {
+		if (responseBody.isSome()) {
 			HTTPResponse resp = HTTPResponse(Url(), HTTP_OK);
 			if (request.getMethod() != HEAD)
-				resp.setData(fileContent.get());
+				resp.setBody(responseBody.get());
 			resp.setContentType(contentTypeString(contentType));
-			
+			compressResponse(resp, request.getHeader("Accept-Encoding"), location);
+
 			Result<ResponseHandler*, Error> response = ResponseHandler::tryMake(conn, resp);
 			if (response.isError()) {
 #ifdef DEBUG
@@ -369,15 +809,50 @@ namespace Webserv {
 			return SharedPtr<IFDTask>(response.getValue());
 		}
 		else {
-			return Error(Error::FILE_NOT_FOUND, respFilePath);
+			return Error(Error::FILE_NOT_FOUND, rootDir.diskPath(respFilePath));
 		}
 
 		return Error(HTTP_NOT_IMPLEMENTED, "Not implemented");
 	}
 
-	TaskResult handleRequest(HTTPRequest& request, LocationTreeNode::LocationSearchResult& query, ServerData& sData, int clientSocketFd) {
+	TaskResult handleRequest(
+		HTTPRequest& request,
+		LocationTreeNode::LocationSearchResult& query,
+		ServerData& sData,
+		int clientSocketFd,
+		bool uploadStored,
+		const Option<int>& spooledBody
+	) {
 		const Location* location = query.location;
-		return handleLocation(query.locationPath, *location, request, sData, clientSocketFd);
+		// Bodies that were read into memory are decoded as a whole, before they are stored or passed on to CGI.
+		if (!uploadStored && !request.getData().empty()) {
+			Result<Option<ContentCoding>, Error> coding = requestCoding(request.getHeader("Content-Encoding"), *location);
+			if (coding.isError()) {
+				return coding.getError();
+			}
+			if (coding.getValue().isSome()) {
+				Result<std::string, Error> decoded = decompressString(
+					request.getData(),
+					coding.getValue().get(),
+					maxDecodedSize(*location, sData),
+					location->maxDecodeRatio
+				);
+				if (decoded.isError()) {
+					return decoded.getError();
+				}
+				HTTPRequest decodedRequest = request.withDecodedData(decoded.getValue());
+				return handleLocation(
+					query.locationPath,
+					*location,
+					decodedRequest,
+					sData,
+					clientSocketFd,
+					uploadStored,
+					spooledBody
+				);
+			}
+		}
+		return handleLocation(query.locationPath, *location, request, sData, clientSocketFd, uploadStored, spooledBody);
 	};
 }
 
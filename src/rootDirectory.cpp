@@ -0,0 +1,182 @@
+#include "rootDirectory.hpp"
+#include "cache.hpp"
+#include "error.hpp"
+#include "ystl.hpp"
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <map>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef LINUX
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#endif
+
+// Descriptors that are only used as the base for path resolution, or for reading the metadata, don't need to grant
+// any access to the files themselves.
+#ifdef O_PATH
+#define ROOT_OPEN_FLAGS (O_PATH | O_DIRECTORY)
+#define STAT_OPEN_FLAGS O_PATH
+#else
+#define ROOT_OPEN_FLAGS (O_RDONLY | O_DIRECTORY)
+#define STAT_OPEN_FLAGS (O_RDONLY | O_NONBLOCK)
+#endif
+
+namespace Webserv {
+	std::string RootDirectory::diskPath(const std::string& relativePath) const {
+		if (relativePath.empty()) return path;
+		if (!path.empty() && path[path.size() - 1] == '/') return path + relativePath;
+		return path + "/" + relativePath;
+	}
+
+	static std::map<std::string, RootDirectory> openedRoots;
+
+	Result<RootDirectory, Error> openRootDirectory(const std::string& path) {
+		std::map<std::string, RootDirectory>::iterator it = openedRoots.find(path);
+		if (it != openedRoots.end()) return it->second;
+
+		RootDirectory root;
+		root.path = path;
+		root.fd = open(path.c_str(), ROOT_OPEN_FLAGS | O_CLOEXEC);
+		if (root.fd < 0) {
+			return Error(Error::FILE_NOT_FOUND, "Could not open root directory: " + path);
+		}
+		openedRoots[path] = root;
+		return root;
+	}
+
+	// Checks that a relative path can not lead outside of the directory it is resolved against by itself. Symbolic
+	// links are not taken into account, so this is only a fallback for the systems without `openat2`.
+	static bool isConfinedPath(const std::string& path) {
+		if (!path.empty() && path[0] == '/') return false;
+		std::stringstream pathStream(path);
+		std::string segment;
+		while (std::getline(pathStream, segment, '/')) {
+			if (segment == "..") return false;
+		}
+		return true;
+	}
+
+	static int openConfined(int dirFd, const std::string& path, int flags, mode_t mode) {
+#if defined(LINUX) && defined(SYS_openat2)
+		static bool openat2Unsupported = false;
+		if (!openat2Unsupported) {
+			struct open_how how;
+			std::memset(&how, 0, sizeof(how));
+			how.flags = flags;
+			how.mode = (flags & O_CREAT) ? mode : 0;
+			how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+			long fd = syscall(SYS_openat2, dirFd, path.c_str(), &how, sizeof(how));
+			if (fd >= 0 || errno != ENOSYS) return fd;
+			openat2Unsupported = true;
+		}
+#endif
+		if (!isConfinedPath(path)) {
+			errno = EXDEV;
+			return -1;
+		}
+		return openat(dirFd, path.c_str(), flags, mode);
+	}
+
+	int openBeneath(const RootDirectory& root, const std::string& relativePath, int flags, mode_t mode) {
+		return openConfined(root.fd, relativePath.empty() ? "." : relativePath, flags | O_CLOEXEC, mode);
+	}
+
+	int statBeneath(const RootDirectory& root, const std::string& relativePath, struct stat& st) {
+		int fd = openBeneath(root, relativePath, STAT_OPEN_FLAGS);
+		if (fd < 0) return -1;
+		int statResult = fstat(fd, &st);
+		int statErrno = errno;
+		close(fd);
+		errno = statErrno;
+		return statResult;
+	}
+
+	// A recent result of `statBeneath`, which is trusted until it expires.
+	struct StatCacheEntry {
+		struct stat st;
+		int error;
+		struct timespec expires;
+	};
+
+	static LRUCache<std::string, StatCacheEntry> statCache(STAT_CACHE_SIZE);
+
+	static std::string statCacheKey(const RootDirectory& root, const std::string& relativePath) {
+		return root.path + '\0' + relativePath;
+	}
+
+	// The monotonic clock is read without entering the kernel.
+	static struct timespec monotonicNow() {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now;
+	}
+
+	static bool isBefore(const struct timespec& a, const struct timespec& b) {
+		return a.tv_sec < b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec < b.tv_nsec);
+	}
+
+	int statCached(const RootDirectory& root, const std::string& relativePath, struct stat& st) {
+		std::string key = statCacheKey(root, relativePath);
+		struct timespec now = monotonicNow();
+		StatCacheEntry* cached = statCache.find(key);
+		if (cached && isBefore(now, cached->expires)) {
+			if (cached->error != 0) {
+				errno = cached->error;
+				return -1;
+			}
+			st = cached->st;
+			return 0;
+		}
+
+		StatCacheEntry entry;
+		std::memset(&entry, 0, sizeof(entry));
+		int statResult = statBeneath(root, relativePath, entry.st);
+		entry.error = statResult < 0 ? errno : 0;
+		entry.expires = now;
+		entry.expires.tv_sec += STAT_CACHE_TTL_MS / 1000;
+		entry.expires.tv_nsec += (STAT_CACHE_TTL_MS % 1000) * 1000000L;
+		if (entry.expires.tv_nsec >= 1000000000L) {
+			entry.expires.tv_sec++;
+			entry.expires.tv_nsec -= 1000000000L;
+		}
+		statCache.insert(key, entry, sizeof(entry) + key.size());
+		if (statResult < 0) {
+			errno = entry.error;
+			return -1;
+		}
+		st = entry.st;
+		return 0;
+	}
+
+	void forgetCachedStat(const RootDirectory& root, const std::string& relativePath) {
+		statCache.erase(statCacheKey(root, relativePath));
+	}
+
+	int unlinkBeneath(const RootDirectory& root, const std::string& relativePath) {
+		size_t slash = relativePath.rfind('/');
+		std::string parent = slash == std::string::npos ? "" : relativePath.substr(0, slash);
+		std::string name = slash == std::string::npos ? relativePath : relativePath.substr(slash + 1);
+		if (name.empty() || name == "." || name == "..") {
+			errno = EINVAL;
+			return -1;
+		}
+
+		// Only the parent directory is resolved, the file itself is removed by its name within it.
+		int parentFd = openBeneath(root, parent, ROOT_OPEN_FLAGS);
+		if (parentFd < 0) return -1;
+		forgetCachedStat(root, relativePath);
+		int unlinkResult = unlinkat(parentFd, name.c_str(), 0);
+		if (unlinkResult < 0 && errno == EISDIR) {
+			unlinkResult = unlinkat(parentFd, name.c_str(), AT_REMOVEDIR);
+		}
+		int unlinkErrno = errno;
+		close(parentFd);
+		errno = unlinkErrno;
+		return unlinkResult;
+	}
+}
@@ -0,0 +1,424 @@
+#include "webserv.hpp"
+#include "body.hpp"
+#include "bundle.hpp"
+#include "compression.hpp"
+#include "config.hpp"
+#include "error.hpp"
+#include "http.hpp"
+#include "rootDirectory.hpp"
+#include "tasks.hpp"
+#include "ystl.hpp"
+#include <ctime>
+#include <fcntl.h>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Amount of the beginning of a static file that the kernel is asked to read as soon as the file is opened.
+#ifndef WILLNEED_SIZE
+#define WILLNEED_SIZE (2 * 1024 * 1024)
+#endif
+
+typedef Result<SharedPtr<Webserv::IFDTask>, Webserv::Error> TaskResult;
+typedef Webserv::Config::Server::Location Location;
+
+namespace Webserv {
+	static TaskResult respondWith(ConnectionInfo conn, const HTTPResponse& resp) {
+		Result<ResponseHandler*, Error> handler = ResponseHandler::tryMake(conn, resp);
+		if (handler.isError()) {
+			return handler.getError();
+		}
+		return SharedPtr<IFDTask>(handler.getValue());
+	}
+
+	static std::string contentRange(const ByteRange& range, size_t size) {
+		std::ostringstream str;
+		str << "bytes " << range.first << "-" << range.last << "/" << size;
+		return str.str();
+	}
+
+	// The error page is a representation of its own, so it takes none of the headers (coding, validators, caching)
+	// of the file whose range was asked for.
+	static TaskResult respondRangeNotSatisfiable(ConnectionInfo conn, size_t size, bool negotiated) {
+		std::ostringstream unsatisfied;
+		unsatisfied << "bytes */" << size;
+		HTTPResponse resp(Url(), HTTP_RANGE_NOT_SATISFIABLE);
+		resp.setHeader("Content-Range", unsatisfied.str());
+		resp.setHeader("Accept-Ranges", "bytes");
+		if (negotiated) resp.setHeader("Vary", "Accept-Encoding");
+		resp.setContentType(contentTypeString(HTML));
+		resp.setData(makeErrorPage(Error(HTTP_RANGE_NOT_SATISFIABLE, "Requested range is not satisfiable")));
+		return respondWith(conn, resp);
+	}
+
+	static std::string makeBoundary() {
+		static uint counter = 0;
+		std::ostringstream str;
+		str << "webserv-" << std::hex << std::time(NULL) << "-" << counter++;
+		return str.str();
+	}
+
+	// Builds an entity tag out of the file's inode, size and modification time, so that it changes whenever
+	// the file is replaced or modified.
+	static std::string makeETag(const struct stat& st, Location::ETagMode mode) {
+		if (mode == Location::ETAG_OFF) return "";
+		std::ostringstream etag;
+		if (mode == Location::ETAG_WEAK) etag << "W/";
+		etag << "\"" << std::hex << st.st_ino << "-" << st.st_size << "-" << st.st_mtime;
+#ifdef LINUX
+		etag << "." << st.st_mtim.tv_nsec;
+#endif
+		etag << "\"";
+		return etag.str();
+	}
+
+	static std::string opaqueTag(const std::string& etag) {
+		if (etag.compare(0, 2, "W/") == 0) return etag.substr(2);
+		return etag;
+	}
+
+	// Checks if the `etag` is present in the comma-separated list of entity tags (or if the list is `*`).
+	// Weak comparison ignores the weakness indicators, while strong comparison requires both tags to be strong.
+	static bool etagListMatches(const std::string& list, const std::string& etag, bool weakComparison) {
+		if (etag.empty()) return false;
+		if (trimString(list, ' ') == "*") return true;
+		std::stringstream listStream(list);
+		std::string candidate;
+		while (std::getline(listStream, candidate, ',')) {
+			candidate = trimString(candidate, ' ');
+			if (weakComparison) {
+				if (opaqueTag(candidate) == opaqueTag(etag)) return true;
+			}
+			else if (candidate == etag && etag.compare(0, 2, "W/") != 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Evaluates `If-None-Match` and `If-Modified-Since` preconditions. `If-Modified-Since` is only considered when
+	// `If-None-Match` is missing.
+	static bool isNotModified(const HTTPRequest& request, const std::string& etag, time_t lastModified) {
+		if (request.getMethod() != GET && request.getMethod() != HEAD) return false;
+
+		Option<std::string> ifNoneMatch = request.getHeader("If-None-Match");
+		if (ifNoneMatch.isSome()) {
+			return etagListMatches(ifNoneMatch.get(), etag, true);
+		}
+
+		Option<std::string> ifModifiedSince = request.getHeader("If-Modified-Since");
+		if (ifModifiedSince.isSome()) {
+			Option<time_t> date = parseHTTPDate(trimString(ifModifiedSince.get(), ' '));
+			return date.isSome() && lastModified <= date.get();
+		}
+		return false;
+	}
+
+	// Checks whether the `If-Range` precondition allows the requested ranges to be served. It holds if the
+	// precondition is either a strong entity tag of the file, or exactly the date of its last modification.
+	static bool ifRangeMatches(const HTTPRequest& request, const std::string& etag, time_t lastModified) {
+		Option<std::string> ifRange = request.getHeader("If-Range");
+		if (ifRange.isNone()) return true;
+		std::string value = trimString(ifRange.get(), ' ');
+		if (!value.empty() && (value[0] == '"' || value.compare(0, 2, "W/") == 0)) {
+			return etagListMatches(value, etag, false);
+		}
+		Option<time_t> date = parseHTTPDate(value);
+		return date.isSome() && date.get() == lastModified;
+	}
+
+	// Sets the validators and the caching policy of the location on the response.
+	static void setCacheHeaders(HTTPResponse& resp, const Location& location, const std::string& etag, time_t lastModified) {
+		if (!etag.empty()) resp.setHeader("ETag", etag);
+		resp.setHeader("Last-Modified", formatHTTPDate(lastModified));
+		if (location.expires.isSome()) {
+			resp.setHeader("Expires", formatHTTPDate(std::time(NULL) + location.expires.get()));
+		}
+		if (location.cacheControl.isSome()) {
+			resp.setHeader("Cache-Control", location.cacheControl.get());
+		}
+		else if (location.expires.isSome()) {
+			std::ostringstream maxAge;
+			maxAge << "max-age=" << location.expires.get();
+			resp.setHeader("Cache-Control", maxAge.str());
+		}
+	}
+
+	// Distinguishes the entity tag of a representation that is compressed on the fly from the one of the file.
+	static std::string codedETag(const std::string& etag, ContentCoding coding) {
+		if (etag.empty()) return etag;
+		return etag.substr(0, etag.size() - 1) + "-" + contentCodingName(coding) + "\"";
+	}
+
+	// A precompressed sibling of a static file, such as `style.css.br` for `style.css`.
+	struct PrecompressedVariant {
+		std::string path;
+		std::string encoding;
+		struct stat st;
+	};
+
+	// Picks the precompressed sibling of the file which the client prefers the most, as long as it exists and is
+	// not older than the file itself. Brotli wins the ties against gzip.
+	static Option<PrecompressedVariant> selectPrecompressed(
+		const HTTPRequest& request,
+		const Location& location,
+		const RootDirectory& root,
+		const std::string& path,
+		const struct stat& original
+	) {
+		Option<std::string> acceptEncoding = request.getHeader("Accept-Encoding");
+		if (acceptEncoding.isNone()) return NONE;
+
+		const char* encodings[] = { "br", "gzip" };
+		const char* suffixes[] = { ".br", ".gz" };
+		bool enabled[] = { location.brotliStatic, location.gzipStatic };
+
+		Option<PrecompressedVariant> best = NONE;
+		float bestQuality = 0;
+		for (uint i = 0; i < 2; i++) {
+			if (!enabled[i]) continue;
+			float quality = encodingQuality(acceptEncoding.get(), encodings[i]);
+			if (quality <= bestQuality) continue;
+
+			PrecompressedVariant variant;
+			variant.path = path + suffixes[i];
+			variant.encoding = encodings[i];
+			if (statBeneath(root, variant.path, variant.st) < 0
+			|| !S_ISREG(variant.st.st_mode)
+			|| variant.st.st_mtime < original.st_mtime) {
+				continue;
+			}
+			best = variant;
+			bestQuality = quality;
+		}
+		return best;
+	}
+
+	std::string staticFileIdentity(const RootDirectory& root, const std::string& relativePath, const struct stat& st) {
+		return root.diskPath(relativePath) + '\0' + makeETag(st, Location::ETAG_STRONG);
+	}
+
+	// Passes the access advice of the location on to the kernel for a freshly opened file, if it is large enough.
+	static void adviseOpenedFile(int fd, const Location& location, size_t size) {
+#ifdef LINUX
+		if (size < location.fadviseMinSize) return;
+		if (location.fadviseSequential) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		if (location.fadviseWillNeed) posix_fadvise(fd, 0, size < WILLNEED_SIZE ? size : WILLNEED_SIZE, POSIX_FADV_WILLNEED);
+#else
+		(void)fd;
+		(void)location;
+		(void)size;
+#endif
+	}
+
+	TaskResult serveStaticFile(
+		ConnectionInfo conn,
+		const HTTPRequest& request,
+		const Location& location,
+		const RootDirectory& root,
+		const std::string& path,
+		HTTPContentType contentType
+	) {
+		// Validators come from the metadata alone, so revalidation requests never open the file.
+		struct stat st;
+		if (statBeneath(root, path, st) < 0 || !S_ISREG(st.st_mode)) {
+			return Error(Error::FILE_NOT_FOUND, root.diskPath(path));
+		}
+
+		// A precompressed variant is a separate file, so it gets its own validators as well.
+		bool negotiated = location.gzipStatic || location.brotliStatic;
+		std::string servedPath = path;
+		Option<std::string> contentEncoding = NONE;
+		if (negotiated) {
+			Option<PrecompressedVariant> variant = selectPrecompressed(request, location, root, path, st);
+			if (variant.isSome()) {
+				servedPath = variant.get().path;
+				contentEncoding = variant.get().encoding;
+				st = variant.get().st;
+			}
+		}
+
+		// Otherwise the file itself may get compressed on the fly, which makes it a different representation.
+		Option<ContentCoding> coding = NONE;
+		if (contentEncoding.isNone()) {
+			Option<std::string> acceptEncoding = request.getHeader("Accept-Encoding");
+			coding = negotiateCompression(acceptEncoding, location, contentTypeString(contentType), st.st_size);
+			negotiated = negotiated || isCompressible(location, contentTypeString(contentType));
+		}
+		std::string etag = makeETag(st, location.etagMode);
+		if (coding.isSome()) etag = codedETag(etag, coding.get());
+
+		if (isNotModified(request, etag, st.st_mtime)) {
+			HTTPResponse resp(Url(), HTTP_NOT_MODIFIED);
+			// A 304 has no body, so it carries no media type either (instead of the default one of a response).
+			resp.removeHeader("Content-Type");
+			setCacheHeaders(resp, location, etag, st.st_mtime);
+			if (negotiated) resp.setHeader("Vary", "Accept-Encoding");
+			return respondWith(conn, resp);
+		}
+
+		int fd = openBeneath(root, servedPath, O_RDONLY);
+		if (fd < 0) {
+			return Error(Error::FILE_NOT_FOUND, root.diskPath(path));
+		}
+		SharedPtr<FileHandle> file(new FileHandle(fd));
+
+		// The file might have been replaced in between, so the metadata of the opened file takes precedence.
+		if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+			return Error(Error::FILE_NOT_FOUND, root.diskPath(path));
+		}
+		etag = makeETag(st, location.etagMode);
+		if (coding.isSome()) etag = codedETag(etag, coding.get());
+		size_t size = st.st_size;
+		if (request.getMethod() != HEAD) adviseOpenedFile(fd, location, size);
+
+		HTTPResponse resp(Url(), HTTP_OK);
+		resp.setContentType(contentTypeString(contentType));
+		setCacheHeaders(resp, location, etag, st.st_mtime);
+		if (negotiated) resp.setHeader("Vary", "Accept-Encoding");
+		if (contentEncoding.isSome()) resp.setHeader("Content-Encoding", contentEncoding.get());
+
+		// Compressed representations are produced as a stream, so ranges of them can not be served.
+		if (coding.isSome()) {
+			resp.setHeader("Content-Encoding", contentCodingName(coding.get()));
+			if (request.getMethod() == HEAD) return respondWith(conn, resp);
+
+			// The file is named by its path and its version, so its compressed form can be kept in the cache.
+			std::string identity = staticFileIdentity(root, path, st);
+			Option<SharedPtr<SealedBlob> > cached = findCompressed(coding.get(), location.gzipLevel, identity);
+			if (cached.isSome()) {
+				resp.setBody(SharedPtr<IResponseBody>(new BlobBody(cached.get())));
+			}
+			else {
+				SharedPtr<IBodyProducer> producer(new CompressingProducer(
+					SharedPtr<IBodyProducer>(new FileProducer(file, 0, size)),
+					coding.get(),
+					location.gzipLevel,
+					identity
+				));
+				resp.setBody(SharedPtr<IResponseBody>(new StreamBody(producer)));
+			}
+			return respondWith(conn, resp);
+		}
+		resp.setHeader("Accept-Ranges", "bytes");
+
+		FileBody* fileBody = new FileBody(file);
+		SharedPtr<IResponseBody> body(fileBody);
+		fileBody->setDropBehind(location.dropBehindSize.isSome() && size >= location.dropBehindSize.get());
+		fileBody->setReadahead(location.readaheadSize);
+
+		Option<std::string> rangeHeader = request.getHeader("Range");
+		Option<std::vector<ByteRange> > ranges = NONE;
+		if (rangeHeader.isSome() && request.getMethod() == GET && ifRangeMatches(request, etag, st.st_mtime)) {
+			ranges = parseByteRanges(rangeHeader.get(), size);
+		}
+
+		if (ranges.isNone()) {
+			fileBody->addRegion(0, size);
+		}
+		else if (ranges.get().empty()) {
+			return respondRangeNotSatisfiable(conn, size, negotiated);
+		}
+		else if (ranges.get().size() == 1) {
+			const ByteRange& range = ranges.get()[0];
+			resp.setCode(HTTP_PARTIAL_CONTENT);
+			resp.setHeader("Content-Range", contentRange(range, size));
+			fileBody->addRegion(range.first, range.last - range.first + 1);
+		}
+		else {
+			std::string boundary = makeBoundary();
+			resp.setCode(HTTP_PARTIAL_CONTENT);
+			resp.setContentType("multipart/byteranges; boundary=" + boundary);
+			const std::vector<ByteRange>& parts = ranges.get();
+			for (std::vector<ByteRange>::const_iterator it = parts.begin(); it != parts.end(); it++) {
+				fileBody->addString(
+					"\r\n--" + boundary + "\r\n"
+					"Content-Type: " + contentTypeString(contentType) + "\r\n"
+					"Content-Range: " + contentRange(*it, size) + "\r\n\r\n"
+				);
+				fileBody->addRegion(it->first, it->last - it->first + 1);
+			}
+			fileBody->addString("\r\n--" + boundary + "--\r\n");
+		}
+
+		if (request.getMethod() != HEAD)
+			resp.setBody(body);
+		return respondWith(conn, resp);
+	}
+
+	TaskResult serveBundleFile(
+		ConnectionInfo conn,
+		const HTTPRequest& request,
+		const Location& location,
+		const SharedPtr<Bundle>& bundle,
+		const BundleEntry& entry,
+		HTTPContentType contentType
+	) {
+		// Precompressed variants are used whenever the client accepts them, with brotli winning the ties.
+		const char* encodings[BUNDLE_VARIANT_COUNT] = { "identity", "gzip", "br" };
+		bool negotiated = entry.variants != (1 << BUNDLE_IDENTITY);
+		int variant = BUNDLE_IDENTITY;
+		Option<std::string> acceptEncoding = request.getHeader("Accept-Encoding");
+		if (negotiated && acceptEncoding.isSome()) {
+			float bestQuality = 0;
+			for (int v = BUNDLE_VARIANT_COUNT - 1; v > BUNDLE_IDENTITY; v--) {
+				if (!(entry.variants & (1 << v))) continue;
+				float quality = encodingQuality(acceptEncoding.get(), encodings[v]);
+				if (quality > bestQuality) {
+					variant = v;
+					bestQuality = quality;
+				}
+			}
+		}
+
+		std::string etag = bundle->getString(entry.etags[variant]);
+		if (location.etagMode == Location::ETAG_OFF) etag = "";
+		else if (location.etagMode == Location::ETAG_WEAK) etag = "W/" + etag;
+		time_t lastModified = entry.mtime;
+
+		if (isNotModified(request, etag, lastModified)) {
+			HTTPResponse resp(Url(), HTTP_NOT_MODIFIED);
+			// A 304 has no body, so it carries no media type either (instead of the default one of a response).
+			resp.removeHeader("Content-Type");
+			setCacheHeaders(resp, location, etag, lastModified);
+			if (negotiated) resp.setHeader("Vary", "Accept-Encoding");
+			return respondWith(conn, resp);
+		}
+
+		HTTPResponse resp(Url(), HTTP_OK);
+		resp.setContentType(contentTypeString(contentType));
+		setCacheHeaders(resp, location, etag, lastModified);
+		if (negotiated) resp.setHeader("Vary", "Accept-Encoding");
+		if (variant != BUNDLE_IDENTITY) resp.setHeader("Content-Encoding", encodings[variant]);
+
+		const char* data = bundle->getData(entry.contents[variant]);
+		size_t size = entry.contents[variant].length;
+		size_t first = 0;
+		size_t length = size;
+
+		// Only a single range of the identity is served, any other request for ranges gets the whole file.
+		if (variant == BUNDLE_IDENTITY) {
+			resp.setHeader("Accept-Ranges", "bytes");
+			Option<std::string> rangeHeader = request.getHeader("Range");
+			if (rangeHeader.isSome() && request.getMethod() == GET && ifRangeMatches(request, etag, lastModified)) {
+				Option<std::vector<ByteRange> > ranges = parseByteRanges(rangeHeader.get(), size);
+				if (ranges.isSome() && ranges.get().empty()) {
+					return respondRangeNotSatisfiable(conn, size, negotiated);
+				}
+				if (ranges.isSome() && ranges.get().size() == 1) {
+					const ByteRange& range = ranges.get()[0];
+					resp.setCode(HTTP_PARTIAL_CONTENT);
+					resp.setHeader("Content-Range", contentRange(range, size));
+					first = range.first;
+					length = range.last - range.first + 1;
+				}
+			}
+		}
+
+		if (request.getMethod() != HEAD)
+			resp.setBody(SharedPtr<IResponseBody>(new BundleBody(bundle, data + first, length)));
+		return respondWith(conn, resp);
+	}
+}
@@ -1,18 +1,488 @@
+#include "cgi.hpp"
+#include "compression.hpp"
 #include "dispatcher.hpp"
 #include "http.hpp"
 #include "tasks.hpp"
 #include "error.hpp"
 #include "webserv.hpp"
 #include "ystl.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <poll.h>
+#include <spawn.h>
 #include <sstream>
 #include <string>
 #include <unistd.h>
 #include <utility>
+#include <vector>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 
 namespace Webserv {
+	Result<bool, Error> parseCGIHeaders(std::string& output, HTTPResponse& response) {
+		size_t crlfEnd = output.find("\r\n\r\n");
+		size_t lfEnd = output.find("\n\n");
+		size_t headerEnd = std::min(crlfEnd, lfEnd);
+		if (headerEnd == std::string::npos) return false;
+		size_t bodyStart = headerEnd + (headerEnd == crlfEnd ? 4 : 2);
+
+		bool hasStatus = false;
+		size_t lineStart = 0;
+		while (lineStart < headerEnd) {
+			size_t lineEnd = std::min(output.find('\n', lineStart), headerEnd);
+			std::string line = trimString(output.substr(lineStart, lineEnd - lineStart), '\r');
+			lineStart = lineEnd + 1;
+			size_t colon = line.find(':');
+			if (colon == std::string::npos) {
+				return Error(Error::CGI_RUNTIME_FAULT, "CGI script has sent a malformed header line: " + line);
+			}
+			std::string name = trimString(line.substr(0, colon), ' ');
+			std::string value = trimString(line.substr(colon + 1), ' ');
+			if (name.empty() || name.find_first_of(" \t\"(),/;<=>?@[\\]{}") != std::string::npos) {
+				return Error(Error::CGI_RUNTIME_FAULT, "CGI script has sent a malformed header line: " + line);
+			}
+			if (strToLower(name) != "status") {
+				// Names are case-insensitive, so the headers of the script replace the defaults however they are spelt.
+				response.removeHeader(name);
+				response.setHeader(name, value);
+				continue;
+			}
+			Option<int> code = strToInt(value.substr(0, value.find(' ')));
+			if (code.isNone() || code.get() < 100 || code.get() > 599) {
+				return Error(Error::CGI_RUNTIME_FAULT, "CGI script has sent an invalid status: " + value);
+			}
+			response.setCode(static_cast<HTTPReturnCode>(code.get()));
+			hasStatus = true;
+		}
+		// A script that only names another location redirects the client there.
+		if (!hasStatus && response.getHeader("Location").isSome()) response.setCode(HTTP_FOUND);
+		output.erase(0, bodyStart);
+		return true;
+	}
+
+	// Takes the framing headers off a response parsed out of CGI output, as the framing of the body is up to the
+	// server. Returns the length that the script has announced, if any, and sets `chunked` if the script has applied
+	// chunked transfer encoding to its output itself.
+	static Option<size_t> takeCGIFraming(HTTPResponse& response, bool& chunked) {
+		Option<std::string> transferEncoding = response.getHeader("Transfer-Encoding");
+		chunked = transferEncoding.isSome() && strToLower(transferEncoding.get()) == "chunked";
+		Option<size_t> length = NONE;
+		Option<std::string> contentLength = response.getHeader("Content-Length");
+		if (contentLength.isSome() && !chunked) {
+			std::stringstream lengthStream(contentLength.get());
+			size_t value;
+			if (lengthStream >> value && lengthStream.eof()) length = value;
+		}
+		response.removeHeader("Transfer-Encoding");
+		response.removeHeader("Content-Length");
+		return length;
+	}
+
+	// Takes the complete chunks of chunked transfer encoding off the start of `in`, and appends their data to `out`.
+	// Returns true once the last chunk is taken, and an error if the encoding is malformed.
+	static Result<bool, Error> takeCGIChunks(std::string& in, std::string& out) {
+		size_t pos = 0;
+		while (true) {
+			size_t lineEnd = in.find('\n', pos);
+			if (lineEnd == std::string::npos) break;
+			std::string sizeLine = trimString(in.substr(pos, lineEnd - pos), '\r');
+			sizeLine = trimString(sizeLine.substr(0, sizeLine.find(';')), ' ');
+			char* sizeEnd;
+			unsigned long size = std::strtoul(sizeLine.c_str(), &sizeEnd, 16);
+			if (sizeLine.empty() || *sizeEnd != '\0') {
+				return Error(Error::CGI_RUNTIME_FAULT, "CGI script has sent a malformed chunk");
+			}
+			if (size == 0) {
+				// Trailers (if any) are dropped along with the last chunk.
+				in.clear();
+				return true;
+			}
+
+			// The data of a chunk is followed by a line break.
+			size_t dataStart = lineEnd + 1;
+			size_t next = dataStart + size;
+			if (next < in.size() && in[next] == '\r') next++;
+			if (next >= in.size()) break;
+			if (in[next] != '\n') return Error(Error::CGI_RUNTIME_FAULT, "CGI script has sent a malformed chunk");
+			out.append(in, dataStart, size);
+			pos = next + 1;
+		}
+		in.erase(0, pos);
+		return false;
+	}
+
+	CGIOutput::CGIOutput(FDTaskDispatcher& dispatcher, int readerFd, int socketFd, const Option<size_t>& length):
+		dispatcher(dispatcher), readerFd(readerFd), socketFd(socketFd), remaining(length), buffer(),
+		finished(false), failed(false), abandoned(false), readerPaused(false), socketPaused(false),
+		spliced(false), pipeFd(-1), sentOffset(0), chunkRemaining(0), lastChunkSent(false) {}
+
+	CGIOutput::~CGIOutput() {
+		if (pipeFd >= 0) close(pipeFd);
+	}
+
+	void CGIOutput::append(const std::string& data) {
+		if (finished || abandoned) return;
+		if (remaining.isSome()) {
+			size_t length = std::min(data.size(), remaining.get());
+			buffer.append(data, 0, length);
+			remaining = remaining.get() - length;
+		}
+		else {
+			buffer.append(data);
+		}
+
+		if (socketPaused && !buffer.empty()) {
+			socketPaused = false;
+			dispatcher.resumeIO(socketFd);
+		}
+		// The script blocks on its output once the pipe fills up, so it goes no further than the client does.
+		if (!readerPaused && readerFd >= 0 && buffer.size() >= CGI_OUTPUT_BUFFER_SIZE) {
+			readerPaused = true;
+			dispatcher.suspendIO(readerFd);
+		}
+	}
+
+	void CGIOutput::finish(bool hasFailed) {
+		if (finished) return;
+		finished = true;
+		failed = hasFailed;
+		if (socketPaused) {
+			socketPaused = false;
+			dispatcher.resumeIO(socketFd);
+		}
+	}
+
+	// A paused socket only wakes the response handler up with an error condition (the zero-copy completions are
+	// collected by then), which means that the client is gone.
+	bool CGIOutput::clientGone() const {
+		if (!socketPaused) return false;
+		struct pollfd pfd;
+		pfd.fd = socketFd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+		return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLERR | POLLHUP));
+	}
+
+	Result<bool, Error> CGIOutput::take(std::string& out) {
+		if (clientGone()) return Error(Error::GENERIC_ERROR, "The client has gone away");
+
+		out.append(buffer);
+		buffer.clear();
+		if (readerPaused) {
+			readerPaused = false;
+			dispatcher.resumeIO(readerFd);
+		}
+		if (!finished) {
+			if (out.empty() && !socketPaused) {
+				socketPaused = true;
+				dispatcher.suspendIO(socketFd);
+			}
+			return true;
+		}
+		if (!failed) return false;
+		// The rest of the output is sent before the connection is broken.
+		if (!out.empty()) return true;
+		return Error(Error::CGI_RUNTIME_FAULT, "CGI script has failed while its response was sent");
+	}
+
+	void CGIOutput::abandon() {
+		abandoned = true;
+		socketPaused = false;
+		buffer.clear();
+		// The reader drops the rest of the output, so that the script can finish.
+		if (readerPaused) {
+			readerPaused = false;
+			dispatcher.resumeIO(readerFd);
+		}
+	}
+
+	bool CGIOutput::isAbandoned() const {
+		return abandoned;
+	}
+
+	void CGIOutput::detachReader() {
+		if (readerPaused) {
+			readerPaused = false;
+			dispatcher.resumeIO(readerFd);
+		}
+		readerFd = -1;
+	}
+
+	bool CGIOutput::isSpliced() const {
+		return spliced;
+	}
+
+	void CGIOutput::pipeReadable() {
+		if (!readerPaused) {
+			readerPaused = true;
+			dispatcher.suspendIO(readerFd);
+		}
+		if (socketPaused) {
+			socketPaused = false;
+			dispatcher.resumeIO(socketFd);
+		}
+	}
+
+#ifdef LINUX
+	// Sends the buffered part of the output. Returns true while some of it is left.
+	Result<bool, Error> CGIOutput::flush() {
+		if (sentOffset >= buffer.size()) return false;
+		long written = write(socketFd, buffer.data() + sentOffset, buffer.size() - sentOffset);
+		if (written <= 0) return Error(Error::GENERIC_ERROR, "Failed to write the response body");
+		sentOffset += written;
+		if (sentOffset < buffer.size()) return true;
+		buffer.clear();
+		sentOffset = 0;
+		return false;
+	}
+
+	Result<bool, Error> CGIOutput::transmit() {
+		if (clientGone()) return Error(Error::GENERIC_ERROR, "The client has gone away");
+		if (!spliced) {
+			spliced = true;
+			// The output that was read so far goes first, as a chunk of its own.
+			if (remaining.isNone() && !buffer.empty()) {
+				std::string data;
+				data.swap(buffer);
+				appendChunk(buffer, data);
+			}
+			// The pipe is kept open for the rest of the output, even once the reader is done with it.
+			if (readerFd >= 0) {
+				pipeFd = fcntl(readerFd, F_DUPFD_CLOEXEC, 0);
+				if (pipeFd < 0) return Error(Error::GENERIC_ERROR, "Failed to splice the response body");
+			}
+		}
+
+		// The output that passes through the server (such as the part of it that came along with the header block,
+		// and the framing of the chunks) goes first.
+		Result<bool, Error> flushed = flush();
+		if (flushed.isError() || flushed.getValue()) return flushed;
+		// The output past the announced length is dropped by the reader, once the response is gone.
+		if (remaining.isSome() && remaining.get() == 0) return false;
+
+		int available = 0;
+		if (pipeFd >= 0 && ioctl(pipeFd, FIONREAD, &available) != 0) available = 0;
+		if (available <= 0 && finished) {
+			if (failed) return Error(Error::CGI_RUNTIME_FAULT, "CGI script has failed while its response was sent");
+			if (remaining.isSome()) return Error(Error::GENERIC_ERROR, "The body does not match its announced length");
+			if (lastChunkSent) return false;
+			lastChunkSent = true;
+			appendLastChunk(buffer);
+			return flush();
+		}
+		if (available <= 0) {
+			// The reader wakes the response handler up once there is more output, or once it has ended.
+			if (!socketPaused) {
+				socketPaused = true;
+				dispatcher.suspendIO(socketFd);
+			}
+			if (readerPaused) {
+				readerPaused = false;
+				dispatcher.resumeIO(readerFd);
+			}
+			return true;
+		}
+		size_t length = available;
+		if (remaining.isSome()) {
+			length = std::min(length, remaining.get());
+		}
+		else {
+			// Each chunk takes the output that is in the pipe at the moment.
+			if (chunkRemaining == 0) {
+				char sizeLine[32];
+				int lineLength = std::snprintf(sizeLine, sizeof(sizeLine), "%lx\r\n", static_cast<unsigned long>(length));
+				buffer.append(sizeLine, lineLength);
+				chunkRemaining = length;
+				flushed = flush();
+				if (flushed.isError() || flushed.getValue()) return flushed;
+			}
+			length = std::min(length, chunkRemaining);
+		}
+
+		long moved = splice(pipeFd, NULL, socketFd, NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (moved < 0 && errno == EAGAIN) return true;
+		if (moved <= 0) return Error(Error::GENERIC_ERROR, "Failed to write the response body");
+		if (remaining.isSome()) {
+			remaining = remaining.get() - moved;
+		}
+		else {
+			chunkRemaining -= moved;
+			if (chunkRemaining == 0) buffer.append("\r\n");
+		}
+		return true;
+	}
+#endif
+
+	// `CGIOutputProducer` is the producer of the body of a CGI response. Only the body holds it, so it is gone along
+	// with the response, which is when the output is abandoned.
+	class CGIOutputProducer: public IBodyProducer {
+	public:
+		CGIOutputProducer(const SharedPtr<CGIOutput>& output): output(output) {}
+
+		~CGIOutputProducer() {
+			output->abandon();
+		}
+
+		Result<bool, Error> produce(std::string& out) {
+			return output->take(out);
+		}
+	private:
+		SharedPtr<CGIOutput> output;
+	};
+
+#ifdef LINUX
+	// `CGISplicedBody` is the body of a CGI response that is spliced into the socket. It is a stream body of the
+	// output all the same, so that a compressed response may take its producer over instead.
+	class CGISplicedBody: public StreamBody {
+	public:
+		CGISplicedBody(
+			const SharedPtr<IBodyProducer>& producer,
+			const SharedPtr<CGIOutput>& output,
+			const Option<size_t>& length
+		): StreamBody(producer, length), output(output) {}
+
+		Result<bool, Error> transmit(int socketFd) {
+			(void)socketFd;
+			return output->transmit();
+		}
+	private:
+		SharedPtr<CGIOutput> output;
+	};
+#endif
+
+	CGIResponseStream::CGIResponseStream():
+		responseHandler(), started(false), headerBuffer(), output(NONE), length(NONE), dechunk(false), chunkBuffer(),
+		compressionLocation(NULL), acceptEncoding(NONE) {}
+
+	CGIResponseStream::CGIResponseStream(const SharedPtr<ResponseHandler>& responseHandler):
+		responseHandler(responseHandler), started(false), headerBuffer(), output(NONE), length(NONE), dechunk(false),
+		chunkBuffer(), compressionLocation(NULL), acceptEncoding(NONE) {}
+
+	void CGIResponseStream::setCompression(const Config::Server::Location& location, const Option<std::string>& accept) {
+		compressionLocation = &location;
+		acceptEncoding = accept;
+	}
+
+	Result<bool, Error> CGIResponseStream::takeHeaders(const std::string& data, HTTPResponse& response) {
+		headerBuffer.append(data);
+		Result<bool, Error> parsed = parseCGIHeaders(headerBuffer, response);
+		if (parsed.isError() || parsed.getValue()) return parsed;
+		if (headerBuffer.size() > CGI_HEADER_MAX_SIZE) {
+			return Error(Error::CGI_RUNTIME_FAULT, "CGI script has sent too large a header block");
+		}
+		return false;
+	}
+
+	Option<SharedPtr<CGIOutput> > CGIResponseStream::openOutput(
+		FDTaskDispatcher& dispatcher,
+		HTTPResponse& response,
+		int readerFd
+	) {
+		length = takeCGIFraming(response, dechunk);
+		HTTPReturnCode code = response.getCode();
+		if (code == HTTP_NO_CONTENT || code == HTTP_NOT_MODIFIED) return NONE;
+		output = SharedPtr<CGIOutput>(new CGIOutput(dispatcher, readerFd, responseHandler->fileDescriptor, length));
+		return output;
+	}
+
+	void CGIResponseStream::start(
+		HTTPResponse& response,
+		const Option<SharedPtr<IBodyProducer> >& producer,
+		bool splice
+	) {
+		if (output.isSome() && producer.isSome()) {
+			IResponseBody* body = NULL;
+#ifdef LINUX
+			// Output that the server does not have to change is spliced into the socket, unless it is compressed
+			// after all.
+			if (splice && !dechunk) body = new CGISplicedBody(producer.get(), output.get(), length);
+#else
+			(void)splice;
+#endif
+			if (!body) body = new StreamBody(producer.get(), length);
+			response.setBody(SharedPtr<IResponseBody>(body));
+			if (compressionLocation) compressResponse(response, acceptEncoding, *compressionLocation);
+		}
+		respond(response);
+
+		std::string rest;
+		rest.swap(headerBuffer);
+		pass(rest);
+	}
+
+	void CGIResponseStream::respond(const HTTPResponse& response) {
+		started = true;
+		responseHandler->setResponse(response);
+		responseHandler = SharedPtr<ResponseHandler>();
+	}
+
+	void CGIResponseStream::respondWithError(const Error& error) {
+		HTTPResponse response((Url()));
+		response.setCode(error.getHTTPCode());
+		response.setContentType(contentTypeString(HTML));
+		response.setData(makeErrorPage(error));
+		respond(response);
+	}
+
+	void CGIResponseStream::pass(const std::string& data) {
+		if (output.isNone() || data.empty()) return;
+		if (!dechunk) {
+			output.get()->append(data);
+			return;
+		}
+
+		chunkBuffer.append(data);
+		std::string body;
+		Result<bool, Error> lastChunk = takeCGIChunks(chunkBuffer, body);
+		output.get()->append(body);
+		if (lastChunk.isError()) {
+			endOutput(true);
+		}
+		else if (lastChunk.getValue()) {
+			endOutput(false);
+		}
+	}
+
+	void CGIResponseStream::endOutput(bool failed) {
+		if (output.isNone()) return;
+		output.get()->finish(failed);
+		detachOutput();
+	}
+
+	void CGIResponseStream::end(const Option<Error>& error) {
+		if (output.isSome()) endOutput(error.isSome() || dechunk);
+		else if (error.isSome() && !started) respondWithError(error.get());
+	}
+
+	void CGIResponseStream::detachOutput() {
+		if (output.isNone()) return;
+		output.get()->detachReader();
+		output = NONE;
+	}
+
+	bool CGIResponseStream::hasStarted() const {
+		return started;
+	}
+
+	Option<SharedPtr<CGIOutput> > CGIResponseStream::getOutput() const {
+		return output;
+	}
+
+	SharedPtr<ResponseHandler> CGIResponseStream::getResponseHandler() const {
+		return responseHandler;
+	}
+
+	const std::string& CGIResponseStream::getHeaderBuffer() const {
+		return headerBuffer;
+	}
+
 	CGIReader::CGIReader(
 		ConnectionInfo conn,
 		const SharedPtr<ResponseHandler>& resp,
@@ -20,71 +490,145 @@ namespace Webserv {
 		int fd,
 		uint rSize
 	):
-		IFDTask(fd, READ_MODE), fd(fd), pid(pid), readSize(rSize), writer(NONE), responseHandler(resp), connectionInfo(conn) {}
+		IFDTask(fd, READ_MODE), fd(fd), pid(pid), readSize(rSize), stream(resp), writer(NONE), connectionInfo(conn),
+		pool(NULL), worker(NONE) {}
+
+	CGIReader::~CGIReader() {
+		// A body that was cut short must not pass for a complete one.
+		stream.endOutput(true);
+		// The output of the script was abandoned, so the worker may be left with the rest of it.
+		if (worker.isSome()) pool->discard(worker.get());
+	}
 
 	void CGIReader::setWriter(const SharedPtr<CGIWriter> wPtr) {
 		writer = wPtr;
 	}
 
+	void CGIReader::setWorker(CGIWorkerPool* workerPool, const CGIWorker& pooledWorker) {
+		pool = workerPool;
+		worker = pooledWorker;
+	}
+
+	void CGIReader::setCompression(const Config::Server::Location& location, const Option<std::string>& accept) {
+		stream.setCompression(location, accept);
+	}
+
 	SharedPtr<ResponseHandler> CGIReader::getResponseHandler() {
-		return responseHandler;
+		return stream.getResponseHandler();
+	}
+
+	void CGIReader::startResponse(FDTaskDispatcher& dispatcher, HTTPResponse& resp) {
+		Option<SharedPtr<CGIOutput> > output = stream.openOutput(dispatcher, resp, fd);
+		Option<SharedPtr<IBodyProducer> > producer = NONE;
+		if (output.isSome()) producer = SharedPtr<IBodyProducer>(new CGIOutputProducer(output.get()));
+		stream.start(resp, producer, true);
+	}
+
+	void CGIReader::passOutput(const std::string& data) {
+		Option<SharedPtr<CGIOutput> > output = stream.getOutput();
+		if (output.isSome() && output.get()->isAbandoned()) {
+			stream.detachOutput();
+			// Nobody is going to see the rest of the output, so the script is stopped. Whatever it writes until it
+			// exits is dropped.
+			if (worker.isSome()) {
+				pool->discard(worker.get());
+				worker = NONE;
+			}
+			else {
+				kill(pid, SIGTERM);
+			}
+			return;
+		}
+		stream.pass(data);
+	}
+
+	// Returns true once nobody is going to write into the pipe anymore.
+	static bool pipeIsClosed(int fd) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLHUP);
 	}
 
 	Result<bool, Error> CGIReader::runTask(FDTaskDispatcher& dispatcher) {
-		(void)dispatcher;
-		char* buffer = new char[readSize + 1]();
-		int readResult = read(fd, buffer, readSize);
-		if (readResult < 0) return Error(Error::CGI_IO_ERROR, "CGIReader fail");
-		std::string bufStr = std::string(buffer, readResult);
-		delete[] buffer;
+		Option<SharedPtr<CGIOutput> > output = stream.getOutput();
+		if (output.isSome() && output.get()->isSpliced() && !output.get()->isAbandoned()) {
+			// Spliced output is left in the pipe for the response handler, so the reader only tells it that there is
+			// more of it. Once the script has closed its output, the script is done with, and the rest of the
+			// output stays in the pipe until it is sent.
+			if (pipeIsClosed(fd)) return endScript(dispatcher);
+			output.get()->pipeReadable();
+			return true;
+		}
+		return readOutput(dispatcher);
+	}
+
+	Result<bool, Error> CGIReader::readOutput(FDTaskDispatcher& dispatcher) {
+
+		std::string data(readSize, '\0');
+		ssize_t readResult = read(fd, &data[0], readSize);
+		if (readResult < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+			return Error(Error::CGI_IO_ERROR, "CGIReader fail");
+		}
+		data.resize(readResult);
 #ifdef DEBUG
-		std::cout << "Got this from CGI: " << bufStr << std::endl;
+		std::cout << "Got this from CGI: " << data << std::endl;
 #endif
-		readBuffer.push_back(bufStr);
 
-		if (readResult == 0) {
-			std::cout << "CGIReader is done" << std::endl;
-			if (writer.isSome()) {
-				writer.get()->close();
+		if (readResult > 0) {
+			if (stream.hasStarted()) {
+				passOutput(data);
+				return true;
 			}
+			HTTPResponse resp((Url()), HTTP_OK);
+			Result<bool, Error> parsed = stream.takeHeaders(data, resp);
+			if (parsed.isError()) {
+				// The rest of the output is dropped, so that the script can finish.
+				stream.respondWithError(parsed.getError());
+			}
+			else if (parsed.getValue()) {
+				startResponse(dispatcher, resp);
+			}
+			return true;
+		}
+		return endScript(dispatcher);
+	}
+
+	Result<bool, Error> CGIReader::endScript(FDTaskDispatcher& dispatcher) {
+		std::cout << "CGIReader is done" << std::endl;
+		if (writer.isSome()) {
+			writer.get()->close();
+		}
 
+		int exitCode;
+		if (worker.isSome()) {
+			// The worker outlives the script, so it reports the exit status of the script itself.
+			exitCode = pool->checkIn(worker.get(), dispatcher).getOr(1);
+			worker = NONE;
+		}
+		else {
 			int wstatus;
 			// No WNOHANG, because otherwise we will never be able to determine if it finishes running.
 			int waitResult = waitpid(pid, &wstatus, 0);
 			if (waitResult < 0) return Error(Error::CGI_IO_ERROR, "waitpid error :()");
-			if (WIFEXITED(wstatus)) {
+			exitCode = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 1;
+		}
 #ifdef DEBUG
-				std::cout << "Process " << pid << " has stopeed, cooking it rn" << std::endl;
+		std::cout << "Process " << pid << " has stopeed, cooking it rn" << std::endl;
 #endif
-				int exitCode = WEXITSTATUS(wstatus);
-
-				HTTPResponse resp((Url()));
-				std::stringstream finalBuffer;
-				for (std::vector<std::string>::iterator it = readBuffer.begin(); it != readBuffer.end(); it++) {
-					finalBuffer << *it;
-				}
-
-				if (exitCode != 0) {
-					resp.setCode(HTTP_INTERNAL_SERVER_ERROR);
-					resp.setContentType(contentTypeString(HTML));
-					resp.setData(makeErrorPage(Error(Error::CGI_RUNTIME_FAULT, finalBuffer.str())));
-				}
-				else {
-					std::string finalBufferStr = "HTTP/1.1 200 OK\n" + finalBuffer.str();
-					Option<HTTPResponse> maybeResponse = HTTPResponse::fromString(finalBufferStr);
-					if (maybeResponse.isNone()) {
-						return Error(Error::HTTP_ERROR, "Failed to construct a response. " + finalBufferStr);
-					}
-					resp = maybeResponse.get();
-				}
-				responseHandler->setResponse(resp);
-				return false;
-			}
 
-			return false;
+		// The exit status can not change a response that is under way.
+		Option<Error> error = NONE;
+		if (!stream.hasStarted() && exitCode != 0) {
+			error = Error(Error::CGI_RUNTIME_FAULT, stream.getHeaderBuffer());
 		}
-
-		return true;
+		else if (!stream.hasStarted()) {
+			error = Error(Error::CGI_RUNTIME_FAULT, "CGI script has ended before its header block");
+		}
+		stream.end(error);
+		return false;
 	}
 
 	// int CGIReader::getDescriptor() const {
@@ -99,7 +643,8 @@ namespace Webserv {
 		return writer;
 	}
 
-	CGIWriter::CGIWriter(int fd, bool cont): IFDTask(fd, WRITE_MODE), fd(fd), continuous(cont), closed(false) {
+	CGIWriter::CGIWriter(int fd, bool cont):
+		IFDTask(fd, WRITE_MODE), fd(fd), continuous(cont), closed(false), writeBuffer(), writeOffset(0) {
 		std::cout << "CGIWriter: " << fd << std::endl;
 	}
 
@@ -107,14 +652,10 @@ namespace Webserv {
 		(void)dispatcher;
 
 		if (closed) return false;
-		std::stringstream bufStream;
-		for (std::vector<std::string>::const_iterator it = writeBuffer.begin(); it != writeBuffer.end(); it++) {
-			bufStream << *it;
-		}
-		writeBuffer.clear();
-		std::string str = bufStream.str();
-		std::cout << "Trying to write: " << str << std::endl;
-		int writeResult = write(fd, str.c_str(), str.size());
+		if (writeOffset >= writeBuffer.size()) return continuous;
+		// The pipe is non-blocking, so the script takes as much as fits into the pipe, and the rest waits for it.
+		long writeResult = write(fd, writeBuffer.data() + writeOffset, writeBuffer.size() - writeOffset);
+		if (writeResult < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
 		if (writeResult <= 0) {
 #ifdef DEBUG
 			std::cerr << "write error :(" << std::endl;
@@ -122,10 +663,10 @@ namespace Webserv {
 			return false;
 		}
 
-		if (str.size() - writeResult > 0) {
-			writeBuffer.push_back(str.substr(0, writeResult));
-			return true;
-		}
+		writeOffset += writeResult;
+		if (writeOffset < writeBuffer.size()) return true;
+		writeBuffer.clear();
+		writeOffset = 0;
 		return continuous;
 	}
 
@@ -138,135 +679,214 @@ namespace Webserv {
 	}
 
 	void CGIWriter::consumeFileData(const std::string& data) {
-		writeBuffer.push_back(data);
+		writeBuffer.append(data);
 	}
 
 	void CGIWriter::close() {
 		closed = true;
 	}
 
-	char** setupEnvp(const std::map<std::string, std::string>& extraEnvs, char** parentEnvp) {
-		uint sizeOfEnvp = 0;
-		char** envpPtr = parentEnvp;
-		while (*envpPtr != NULL) {
-			envpPtr++;
-			sizeOfEnvp++;
-		}
-		char** newEnvp = new char*[sizeOfEnvp + extraEnvs.size() + 1]();
-		envpPtr = parentEnvp;
-		uint i = 0;
-		while (*envpPtr != NULL) {
-			newEnvp[i] = *envpPtr;
-			envpPtr++;
-			i++;
-		}
-		for (std::map<std::string, std::string>::const_iterator it = extraEnvs.begin(); it != extraEnvs.end(); it++) {
-			char* cstr = new char[it->first.size() + it->second.size() + 2];
-			it->first.copy(cstr, it->first.size());
-			cstr[it->first.size()] = '=';
-			it->second.copy(cstr + it->first.size() + 1, it->second.size());
-			cstr[it->first.size() + it->second.size() + 1] = '\0';
-			newEnvp[i] = cstr;
-			i++;
-		}
-		newEnvp[i] = NULL;
-		return newEnvp;
-	}
-
-	Option<std::string> getPwd(char** envp) {
-		while (*envp) {
-			if (std::strncmp(*envp, "PWD=", 4) == 0) {
-				std::string str(*envp);
-				return str.substr(4, str.size() - 4);
-			}
-			envp++;
+	static std::map<const Config::Server::Location*, CGIEnvironment> cgiEnvironments;
+
+	CGIEnvironment::CGIEnvironment(const ServerData& sData): inherited(), variables(), pwd(NONE) {
+		for (char** envp = sData.envp; *envp != NULL; envp++) {
+			inherited.push_back(*envp);
+			if (std::strncmp(*envp, "PWD=", 4) == 0) pwd = std::string(*envp + 4);
+		}
+		std::ostringstream port;
+		port << "SERVER_PORT=" << sData.port;
+		variables.push_back("SERVER_SOFTWARE=webserv");
+		variables.push_back("GATEWAY_INTERFACE=CGI/1.1");
+		variables.push_back("SERVER_PROTOCOL=HTTP/1.1");
+		variables.push_back(port.str());
+	}
+
+	const CGIEnvironment& CGIEnvironment::forLocation(const Config::Server::Location& location, const ServerData& sData) {
+		std::map<const Config::Server::Location*, CGIEnvironment>::iterator it = cgiEnvironments.find(&location);
+		if (it == cgiEnvironments.end()) {
+			it = cgiEnvironments.insert(std::make_pair(&location, CGIEnvironment(sData))).first;
+		}
+		return it->second;
+	}
+
+	std::vector<char*> CGIEnvironment::withRequest(const std::vector<std::string>& requestVariables) const {
+		std::vector<char*> envp;
+		envp.reserve(inherited.size() + variables.size() + requestVariables.size() + 1);
+		envp.insert(envp.end(), inherited.begin(), inherited.end());
+		for (uint i = 0; i < variables.size(); i++) {
+			envp.push_back(const_cast<char*>(variables[i].c_str()));
+		}
+		for (uint i = 0; i < requestVariables.size(); i++) {
+			envp.push_back(const_cast<char*>(requestVariables[i].c_str()));
 		}
-		return NONE;
+		envp.push_back(NULL);
+		return envp;
+	}
+
+	const Option<std::string>& CGIEnvironment::getPwd() const {
+		return pwd;
+	}
+
+	// Starts the interpreter with its standard input and output on the pipes. Its standard error stays the one of
+	// the server, so that the diagnostics of the script end up in the log of the server instead of its response.
+	// With `posix_spawn`, the C library starts the child in the memory of the server (with `CLONE_VM | CLONE_VFORK`
+	// on Linux) until it executes the interpreter, so no page tables are copied, and starting a script takes just as
+	// long however large the server has grown. The rest of the descriptors of the server, such as the sockets of
+	// other clients, are not inherited where the C library can close them.
+	static Result<pid_t, Error> spawnScript(
+		const std::string& binary,
+		char** argv,
+		char** envp,
+		const std::string& workingDirectory,
+		int stdinFd,
+		int stdoutFd
+	) {
+		pid_t pid;
+#ifdef CGI_SPAWN_CHDIR
+		posix_spawn_file_actions_t actions;
+		if (posix_spawn_file_actions_init(&actions) != 0) {
+			return Error(Error::CGI_IO_ERROR, "Failed to prepare the CGI process");
+		}
+		posix_spawn_file_actions_adddup2(&actions, stdinFd, STDIN_FILENO);
+		posix_spawn_file_actions_adddup2(&actions, stdoutFd, STDOUT_FILENO);
+#ifdef CGI_SPAWN_CLOSEFROM
+		posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+#endif
+		posix_spawn_file_actions_addchdir_np(&actions, workingDirectory.c_str());
+		int spawnResult = posix_spawn(&pid, binary.c_str(), &actions, NULL, argv, envp);
+		posix_spawn_file_actions_destroy(&actions);
+		if (spawnResult != 0) {
+			return Error(Error::CGI_RUNTIME_FAULT, std::string("Failed to start the CGI script: ") + strerror(spawnResult));
+		}
+#else
+		// Only system calls are made between `vfork` and `execve`, as the child runs in the memory of the server.
+		pid = vfork();
+		if (pid < 0) return Error(Error::CGI_IO_ERROR, "Failed to start the CGI process");
+		if (pid == 0) {
+			dup2(stdinFd, STDIN_FILENO);
+			dup2(stdoutFd, STDOUT_FILENO);
+			if (chdir(workingDirectory.c_str()) == 0) execve(binary.c_str(), argv, envp);
+			_exit(127);
+		}
+#endif
+		return pid;
 	}
 
-	Result<CGIPipeline, Error> makeCGIPipeline(
+	Result<SharedPtr<CGIReader>, Error> makeCGIPipeline(
 		ConnectionInfo conn,
 		const Url& binaryLocation,
 		const Url& scriptLocation,
 		const Url& extraPath,
 		const HTTPRequest& request,
-		char** envp,
+		const Option<int>& bodyFile,
+		const CGIEnvironment& environment,
+		CGIWorkerPool* pool,
 		uint readBufferSize
 	) {
 		std::string scriptName = scriptLocation.getSegments().back();
 		int readPipe[2];
-		int writePipe[2];
+		int writePipe[2] = {-1, -1};
 
-		if (pipe(readPipe) == -1) {
-			return Error(Error::CGI_IO_ERROR, "Pipe error");
+		size_t contentLength = request.getData().size();
+		if (bodyFile.isSome()) {
+			struct stat st;
+			if (fstat(bodyFile.get(), &st) != 0) {
+				return Error(Error::CGI_IO_ERROR, "Failed to read the spooled request body");
+			}
+			contentLength = st.st_size;
 		}
 
-		if (pipe(writePipe) == -1) {
+		// The ends of the pipes are only inherited by the child as its standard streams. A body that was spooled into
+		// a file is read by the script straight out of the file, so it needs no pipe.
+		if (pipe(readPipe) == -1) {
 			return Error(Error::CGI_IO_ERROR, "Pipe error");
 		}
-
-		int forkResult = fork();
-		if (forkResult == 0) {
-			dup2(writePipe[0], STDIN_FILENO);
-			dup2(readPipe[1], STDOUT_FILENO);
-			dup2(readPipe[1], STDERR_FILENO); // Eh, screw it.
-
-			close(writePipe[1]);
+		if (bodyFile.isNone() && pipe(writePipe) == -1) {
 			close(readPipe[0]);
-
-			// Wha... why???? (source: https://stackoverflow.com/questions/7369286/c-passing-a-pipe-thru-execve)
-			close(writePipe[0]);
 			close(readPipe[1]);
-
-			char* args[3];
-			args[0] = new char[1]();
-			args[1] = new char[scriptName.size() + 1]();
-			args[2] = NULL;
-
-			scriptName.copy(args[1], scriptName.size());
-			args[1][scriptName.size()] = 0;
-
-			// Construct new envp
-			std::map<std::string, std::string> extraEnvs;
-			extraEnvs["PATH_INFO"] = extraPath.toString(false, true);
-			extraEnvs["HTTP_COOKIE"] = request.getHeader("Cookie").getOr("");
-			extraEnvs["QUERY_STRING"] = request.getPath().queryToString();
-			extraEnvs["CONTENT_LENGTH"] = request.getHeader("Content-Length").getOr("0");
-			extraEnvs["CONTENT_TYPE"] = request.getHeader("Content-Type").getOr("");
-			extraEnvs["SERVER_SOFTWARE"] = "webserv";
-			extraEnvs["REQUEST_METHOD"] = httpMethodName(request.getMethod());
-			Option<std::string> pwd = getPwd(envp);
-			if (pwd.isSome()) {
-				extraEnvs["PATH_TRANSLATED"] = pwd.get() + scriptLocation.toString(true, true);
-			}
-			char** newEnvp = setupEnvp(extraEnvs, envp);
-
-			chdir(scriptLocation.exceptLast().toString(false, true).c_str());
-
+			return Error(Error::CGI_IO_ERROR, "Pipe error");
+		}
+		for (uint i = 0; i < 2; i++) {
+			fcntl(readPipe[i], F_SETFD, FD_CLOEXEC);
+			if (writePipe[i] >= 0) fcntl(writePipe[i], F_SETFD, FD_CLOEXEC);
+		}
+		// The ends of the server never block it, whatever the script does with the other ends.
+		fcntl(readPipe[0], F_SETFL, O_NONBLOCK);
+		if (writePipe[1] >= 0) fcntl(writePipe[1], F_SETFL, O_NONBLOCK);
+#ifdef LINUX
+		// The output waits in the pipe instead of the server while the client falls behind.
+		fcntl(readPipe[0], F_SETPIPE_SZ, CGI_OUTPUT_BUFFER_SIZE);
+#endif
+		int stdinFd = bodyFile.isSome() ? bodyFile.get() : writePipe[0];
+
+		std::vector<std::string> requestVariables;
+		requestVariables.push_back("PATH_INFO=" + extraPath.toString(false, true));
+		requestVariables.push_back("HTTP_COOKIE=" + request.getHeader("Cookie").getOr(""));
+		requestVariables.push_back("QUERY_STRING=" + request.getPath().queryToString());
+		std::ostringstream contentLengthVariable;
+		contentLengthVariable << "CONTENT_LENGTH=" << contentLength;
+		requestVariables.push_back(contentLengthVariable.str());
+		requestVariables.push_back("CONTENT_TYPE=" + request.getHeader("Content-Type").getOr(""));
+		requestVariables.push_back(std::string("REQUEST_METHOD=") + httpMethodName(request.getMethod()));
+		std::string scriptPath = scriptLocation.toString(false, true);
+		if (!scriptPath.empty() && scriptPath[0] == '/') {
+			requestVariables.push_back("PATH_TRANSLATED=" + scriptPath);
+		}
+		else if (environment.getPwd().isSome()) {
+			requestVariables.push_back("PATH_TRANSLATED=" + environment.getPwd().get() + scriptLocation.toString(true, true));
+		}
+		std::vector<char*> envp = environment.withRequest(requestVariables);
+
+		char emptyArg[] = "";
+		char* argv[3];
+		argv[0] = emptyArg;
+		argv[1] = const_cast<char*>(scriptName.c_str());
+		argv[2] = NULL;
+
+		std::string workingDirectory = scriptLocation.exceptLast().toString(false, true);
+		Option<CGIWorker> worker = NONE;
+		if (pool) worker = pool->dispatch(workingDirectory, scriptName, &envp[0], stdinFd, readPipe[1]);
+		Result<pid_t, Error> pid = 0;
+		if (worker.isSome()) {
+			pid = worker.get().pid;
+		}
+		else {
 			Url finalBinaryLocation = binaryLocation.getSegments().empty()? scriptLocation : binaryLocation;
-			execve(finalBinaryLocation.toString(false, true).c_str(), args, newEnvp);
-
-			delete[] args[0];
-			delete[] args[1];
-			char** cstr = newEnvp;
-			while(*cstr) {
-				delete[] *cstr;
-				cstr++;
-			}
-			delete[] newEnvp;
-			std::cerr << "Something bad happened, and execve failed" << std::endl;
-			exit(1);
+			pid = spawnScript(
+				finalBinaryLocation.toString(false, true),
+				argv,
+				&envp[0],
+				workingDirectory,
+				stdinFd,
+				readPipe[1]
+			);
 		}
-		
-		close(writePipe[0]);
+		if (writePipe[0] >= 0) close(writePipe[0]);
 		close(readPipe[1]);
+		if (pid.isError()) {
+			if (writePipe[1] >= 0) close(writePipe[1]);
+			close(readPipe[0]);
+			return pid.getError();
+		}
 
 		SharedPtr<ResponseHandler> respHandler = new ResponseHandler(conn);
-		SharedPtr<CGIWriter> writer = new CGIWriter(writePipe[1]);
-		SharedPtr<CGIReader> reader = new CGIReader(conn, respHandler, forkResult, readPipe[0], readBufferSize);
-		reader->setWriter(writer);
-		writer->consumeFileData(request.getData());
-
-		return std::make_pair(writer, reader);
+		SharedPtr<CGIReader> reader = new CGIReader(conn, respHandler, pid.getValue(), readPipe[0], readBufferSize);
+		if (worker.isSome()) reader->setWorker(pool, worker.get());
+		if (writePipe[1] >= 0) {
+			// Most bodies fit into the pipe as a whole, so they are written right away, and only the rest of a
+			// larger one is left for a writer. The script sees the end of the body once the pipe is closed.
+			const std::string& body = request.getData();
+			long written = body.empty() ? 0 : write(writePipe[1], body.data(), body.size());
+			if (written < 0) written = 0;
+			if (static_cast<size_t>(written) == body.size()) {
+				close(writePipe[1]);
+			}
+			else {
+				SharedPtr<CGIWriter> writer = new CGIWriter(writePipe[1]);
+				writer->consumeFileData(body.substr(written));
+				reader->setWriter(writer);
+			}
+		}
+		return reader;
 	}
 }
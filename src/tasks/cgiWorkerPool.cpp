@@ -0,0 +1,285 @@
+#include "cgi.hpp"
+#include "config.hpp"
+#include "dispatcher.hpp"
+#include "error.hpp"
+#include "tasks.hpp"
+#include "ystl.hpp"
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <spawn.h>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#ifdef LINUX
+#include <sys/timerfd.h>
+#endif
+
+namespace Webserv {
+	std::map<std::string, CGIWorkerPool*> CGIWorkerPool::pools;
+
+	static double monotonicTime() {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return now.tv_sec + now.tv_nsec / 1e9;
+	}
+
+	CGIWorkerPool::CGIWorkerPool(
+		const std::string& interpreter,
+		const std::string& workerScript,
+		const Config& config,
+		char** envp
+	):
+		interpreter(interpreter), workerScript(workerScript), envp(envp),
+		minIdle(config.cgiPoolMinIdle), maxWorkers(config.cgiPoolMaxWorkers),
+		maxRequests(config.cgiPoolMaxRequests), spawnRate(config.cgiPoolSpawnRate),
+		idle(), busy(0), retired(),
+		spawnTokens(config.cgiPoolSpawnRate), lastRefillTime(monotonicTime()), refillScheduled(false) {}
+
+	void CGIWorkerPool::startPools(const Config& config, char** envp, FDTaskDispatcher& dispatcher) {
+		for (std::map<std::string, std::string>::const_iterator it = config.cgiWorkers.begin();
+		it != config.cgiWorkers.end(); it++) {
+			std::map<std::string, std::string>::const_iterator interpreter = config.cgiBinds.find(it->first);
+			if (interpreter == config.cgiBinds.end()) {
+				std::cout << "No interpreter to run the CGI workers of ." << it->first << " with" << std::endl;
+				continue;
+			}
+			CGIWorkerPool* pool = new CGIWorkerPool(interpreter->second, it->second, config, envp);
+			pools[it->first] = pool;
+			pool->refill(&dispatcher);
+			if (pool->idle.empty() && pool->minIdle > 0) {
+				std::cout << "Failed to start the CGI workers of ." << it->first << std::endl;
+			}
+		}
+	}
+
+	CGIWorkerPool* CGIWorkerPool::forExtension(const std::string& extension) {
+		std::map<std::string, CGIWorkerPool*>::iterator it = pools.find(extension);
+		if (it == pools.end()) return NULL;
+		return it->second;
+	}
+
+	// Starts a worker with its end of the control socket as descriptor 3, and no other descriptor of the server.
+	bool CGIWorkerPool::spawn() {
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) return false;
+		fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+		if (sockets[1] == CGI_WORKER_CONTROL_FD) {
+			// `dup2` onto the same descriptor keeps it as it is, so it must be inherited on its own.
+			fcntl(sockets[1], F_SETFD, 0);
+		}
+		else {
+			fcntl(sockets[1], F_SETFD, FD_CLOEXEC);
+		}
+
+		posix_spawn_file_actions_t actions;
+		if (posix_spawn_file_actions_init(&actions) != 0) {
+			close(sockets[0]);
+			close(sockets[1]);
+			return false;
+		}
+		if (sockets[1] != CGI_WORKER_CONTROL_FD) {
+			posix_spawn_file_actions_adddup2(&actions, sockets[1], CGI_WORKER_CONTROL_FD);
+		}
+#ifdef CGI_SPAWN_CLOSEFROM
+		posix_spawn_file_actions_addclosefrom_np(&actions, CGI_WORKER_CONTROL_FD + 1);
+#endif
+		char* argv[3];
+		argv[0] = const_cast<char*>(interpreter.c_str());
+		argv[1] = const_cast<char*>(workerScript.c_str());
+		argv[2] = NULL;
+		pid_t pid;
+		int spawnResult = posix_spawn(&pid, interpreter.c_str(), &actions, NULL, argv, envp);
+		posix_spawn_file_actions_destroy(&actions);
+		close(sockets[1]);
+		if (spawnResult != 0) {
+			close(sockets[0]);
+			return false;
+		}
+
+		CGIWorker worker;
+		worker.pid = pid;
+		worker.controlFd = sockets[0];
+		worker.requestsServed = 0;
+		idle.push_back(worker);
+		return true;
+	}
+
+	bool CGIWorkerPool::takeSpawnToken() {
+		double now = monotonicTime();
+		spawnTokens += (now - lastRefillTime) * spawnRate;
+		if (spawnTokens > spawnRate) spawnTokens = spawnRate;
+		lastRefillTime = now;
+		if (spawnTokens < 1) return false;
+		spawnTokens -= 1;
+		return true;
+	}
+
+	void CGIWorkerPool::retire(const CGIWorker& worker) {
+		// The worker exits once its control socket is closed, after the script it may still be running.
+		close(worker.controlFd);
+		retired.push_back(worker.pid);
+	}
+
+	void CGIWorkerPool::reapRetired() {
+		for (uint i = 0; i < retired.size();) {
+			pid_t result = waitpid(retired[i], NULL, WNOHANG);
+			if (result == 0) {
+				i++;
+				continue;
+			}
+			retired[i] = retired.back();
+			retired.pop_back();
+		}
+	}
+
+	// `CGIPoolRefiller` is a one-shot timer task that resumes refilling a pool once the spawn rate allows it.
+	class CGIPoolRefiller: public IFDTask {
+	public:
+		CGIPoolRefiller(int timerFd, CGIWorkerPool& pool): IFDTask(timerFd, READ_MODE), pool(pool) {}
+
+		Result<bool, Error> runTask(FDTaskDispatcher& dispatcher) {
+			uint64_t expirations;
+			if (read(fileDescriptor, &expirations, sizeof(expirations)) < 0) {
+				return true;
+			}
+			pool.refillScheduled = false;
+			pool.refill(&dispatcher);
+			return false;
+		}
+	private:
+		CGIWorkerPool& pool;
+	};
+
+	void CGIWorkerPool::refill(FDTaskDispatcher* dispatcher) {
+		reapRetired();
+		while (idle.size() < minIdle && idle.size() + busy < maxWorkers) {
+			if (!takeSpawnToken()) break;
+			// A worker that fails to start is not retried right away, as the next one would most likely fail too.
+			if (!spawn()) return;
+		}
+		if (idle.size() >= minIdle || idle.size() + busy >= maxWorkers) return;
+		if (dispatcher == NULL || refillScheduled) return;
+
+#ifdef LINUX
+		// The rest are started once the next token is there.
+		long delayNs = static_cast<long>((1 - spawnTokens) / spawnRate * 1e9) + 1;
+		int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (timerFd < 0) return;
+		struct itimerspec delay;
+		delay.it_interval.tv_sec = 0;
+		delay.it_interval.tv_nsec = 0;
+		delay.it_value.tv_sec = delayNs / 1000000000L;
+		delay.it_value.tv_nsec = delayNs % 1000000000L;
+		if (timerfd_settime(timerFd, 0, &delay, NULL) != 0) {
+			close(timerFd);
+			return;
+		}
+		refillScheduled = true;
+		dispatcher->registerTask(SharedPtr<IFDTask>(new CGIPoolRefiller(timerFd, *this)));
+#endif
+		// Elsewhere, the rest are started as the workers come back.
+	}
+
+	// The request is a length-prefixed message (`<length>\n`, then the working directory, the script and the
+	// environment entries, each one terminated by a null byte), with the two descriptors attached to it.
+	static bool sendRequest(
+		const CGIWorker& worker,
+		const std::string& workingDirectory,
+		const std::string& script,
+		char** envp,
+		int stdinFd,
+		int stdoutFd
+	) {
+		std::string payload;
+		payload.append(workingDirectory).push_back('\0');
+		payload.append(script).push_back('\0');
+		for (; *envp != NULL; envp++) {
+			payload.append(*envp).push_back('\0');
+		}
+		std::ostringstream message;
+		message << payload.size() << '\n' << payload;
+		std::string messageStr = message.str();
+
+		struct iovec iov;
+		iov.iov_base = const_cast<char*>(messageStr.data());
+		iov.iov_len = messageStr.size();
+		char control[CMSG_SPACE(2 * sizeof(int))];
+		std::memset(control, 0, sizeof(control));
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+		int fds[2] = {stdinFd, stdoutFd};
+		std::memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+		// An idle worker has nothing else in its socket, so the message only fails to fit if the worker is gone.
+		ssize_t sent = sendmsg(worker.controlFd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		return sent == static_cast<ssize_t>(messageStr.size());
+	}
+
+	Option<CGIWorker> CGIWorkerPool::dispatch(
+		const std::string& workingDirectory,
+		const std::string& script,
+		char** envp,
+		int stdinFd,
+		int stdoutFd
+	) {
+		Option<CGIWorker> result = NONE;
+		while (!idle.empty()) {
+			CGIWorker worker = idle.back();
+			idle.pop_back();
+			if (sendRequest(worker, workingDirectory, script, envp, stdinFd, stdoutFd)) {
+				busy++;
+				result = worker;
+				break;
+			}
+			retire(worker);
+		}
+		// The dispatcher is not at hand here, so a pool that is out of spawn tokens is refilled as the workers
+		// come back.
+		refill(NULL);
+		return result;
+	}
+
+	Option<int> CGIWorkerPool::checkIn(CGIWorker worker, FDTaskDispatcher& dispatcher) {
+		busy--;
+		// The worker reports the status before it lets go of the output of the script, so it is already there.
+		char status[16];
+		ssize_t length = recv(worker.controlFd, status, sizeof(status), MSG_DONTWAIT);
+		Option<int> exitCode = NONE;
+		if (length > 1 && status[length - 1] == '\n') {
+			exitCode = strToInt(std::string(status, length - 1));
+		}
+
+		worker.requestsServed++;
+		if (exitCode.isNone() || worker.requestsServed >= maxRequests) {
+			retire(worker);
+		}
+		else {
+			idle.push_back(worker);
+		}
+		refill(&dispatcher);
+		return exitCode;
+	}
+
+	void CGIWorkerPool::discard(const CGIWorker& worker) {
+		busy--;
+		kill(worker.pid, SIGKILL);
+		retire(worker);
+	}
+}
@@ -4,6 +4,7 @@
 #include "dispatcher.hpp"
 #include "url.hpp"
 #include "ystl.hpp"
+#include "zeroCopy.hpp"
 #include <cstring>
 #include <unistd.h>
 #include "tasks.hpp"
@@ -44,11 +45,14 @@ Result<ClientListener*, Error> ClientListener::tryMake(Config& config, Config::S
 		sData.locations.insertLocation(url.get(), &it->second);
 	}
 
+	sData.port = port;
 	sData.maxRequestSize = serverConfig.maxRequestSize.getOr(config.maxRequestSize);
 	sData.serverNames = serverConfig.serverNames;
 	sData.cgiInterpreters = config.cgiBinds;
+	sData.fastcgiApplications = config.fastcgiBinds;
 	sData.envp = envp;
 	sData.messageBufferSize = config.messageBufferSize;
+	sData.zeroCopyThreshold = serverConfig.zeroCopyThreshold;
 
 	// So, lets start with making a socket object
 	sData.socketFd = socket(AF_INET, SOCK_STREAM, 0);
@@ -82,6 +86,7 @@ Result<bool, Webserv::Error> ClientListener::runTask(FDTaskDispatcher& dispatche
 		close(socketFd);
 		return Error(Error::SOCKET_ACCEPT_FAILURE);
 	}
+	setupZeroCopy(clientSocket, sData.zeroCopyThreshold);
 
 	Result<RequestHandler*, Error> reqHandler = RequestHandler::tryMake(clientSocket, sData);
 	if (reqHandler.isError()) {
@@ -0,0 +1,410 @@
+#include "cgi.hpp"
+#include "compression.hpp"
+#include "dispatcher.hpp"
+#include "error.hpp"
+#include "fastCGI.hpp"
+#include "http.hpp"
+#include "tasks.hpp"
+#include "url.hpp"
+#include "webserv.hpp"
+#include "ystl.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace Webserv {
+	std::map<std::string, std::vector<SharedPtr<FastCGIConnection> > > FastCGIConnection::connections;
+
+	// `FastCGIOutputProducer` is the producer of the body of a FastCGI response. Only the body holds it, so it is
+	// gone along with the response, which is when the request is aborted, unless it has ended by then.
+	class FastCGIOutputProducer: public IBodyProducer {
+	public:
+		FastCGIOutputProducer(
+			FDTaskDispatcher& dispatcher,
+			const SharedPtr<FastCGIConnection>& connection,
+			ushort requestId,
+			const SharedPtr<CGIOutput>& output
+		): dispatcher(dispatcher), connection(connection), requestId(requestId), output(output) {}
+
+		~FastCGIOutputProducer() {
+			output->abandon();
+			FastCGIConnection::abort(connection, requestId, output.operator->(), dispatcher);
+		}
+
+		Result<bool, Error> produce(std::string& out) {
+			return output->take(out);
+		}
+	private:
+		FDTaskDispatcher& dispatcher;
+		SharedPtr<FastCGIConnection> connection;
+		ushort requestId;
+		SharedPtr<CGIOutput> output;
+	};
+
+	FastCGIConnection::FastCGIConnection(const std::string& address, int fd):
+		address(address),
+		fd(fd),
+		outBuffer(),
+		outOffset(0),
+		parser(),
+		exchanges(),
+		multiplexed(false),
+		maxRequests(1),
+		closed(false),
+		writers(0) {}
+
+	Result<SharedPtr<FastCGIWriter>, Error> FastCGIConnection::submit(
+		ConnectionInfo conn,
+		const std::string& address,
+		const std::map<std::string, std::string>& params,
+		const std::string& body,
+		const Config::Server::Location& location,
+		const Option<std::string>& acceptEncoding
+	) {
+		Option<FastCGIAddress> parsedAddress = parseFastCGIAddress(address);
+		if (parsedAddress.isNone()) {
+			return Error(HTTP_BAD_GATEWAY, "Invalid address of the FastCGI application: " + address);
+		}
+
+		std::vector<SharedPtr<FastCGIConnection> >& pool = connections[address];
+		Option<SharedPtr<FastCGIConnection> > idle;
+		for (uint i = 0; i < pool.size() && idle.isNone(); i++) {
+			if (pool[i]->hasRoom()) idle = pool[i];
+		}
+
+		SharedPtr<FastCGIConnection> connection;
+		bool opened = idle.isNone();
+		if (opened) {
+			if (pool.size() >= FASTCGI_MAX_CONNECTIONS) {
+				return Error(HTTP_SERVICE_UNAVAILABLE, "Too many concurrent requests to the FastCGI application");
+			}
+			Result<int, Error> fd = connectFastCGI(parsedAddress.get());
+			if (fd.isError()) return fd.getError();
+			connection = new FastCGIConnection(address, fd.getValue());
+
+			std::string query;
+			appendFastCGIPair(query, "FCGI_MPXS_CONNS", "");
+			appendFastCGIPair(query, "FCGI_MAX_REQS", "");
+			appendFastCGIRecord(connection->outBuffer, FCGI_GET_VALUES, 0, query);
+		}
+		else connection = idle.get();
+
+		// The writer gets a descriptor of its own, as the descriptor of a task is closed once the task is done.
+		int writerFd = dup(connection->fd);
+		if (writerFd < 0) {
+			if (opened) close(connection->fd);
+			return Error(HTTP_SERVICE_UNAVAILABLE, "Failed to duplicate the FastCGI connection descriptor");
+		}
+		if (opened) pool.push_back(connection);
+
+		ushort requestId = connection->unusedRequestId();
+		std::string encodedParams;
+		for (std::map<std::string, std::string>::const_iterator it = params.begin(); it != params.end(); it++) {
+			appendFastCGIPair(encodedParams, it->first, it->second);
+		}
+		appendFastCGIBeginRequest(connection->outBuffer, requestId, true);
+		appendFastCGIStream(connection->outBuffer, FCGI_PARAMS, requestId, encodedParams);
+
+		// The body follows a record at a time, as the writers drain the queue.
+		SharedPtr<ResponseHandler> responseHandler(new ResponseHandler(conn));
+		Exchange exchange;
+		exchange.stream = CGIResponseStream(responseHandler);
+		exchange.stream.setCompression(location, acceptEncoding);
+		exchange.bodyOffset = 0;
+		exchange.bodyQueued = false;
+		exchange.aborted = false;
+		Exchange& queued = connection->exchanges.insert(std::make_pair(requestId, exchange)).first->second;
+		queued.body = body;
+
+		SharedPtr<FastCGIWriter> writer = new FastCGIWriter(writerFd, connection, responseHandler);
+		if (opened) writer->reader = SharedPtr<FastCGIReader>(new FastCGIReader(connection));
+		return writer;
+	}
+
+	bool FastCGIConnection::hasRoom() const {
+		if (closed) return false;
+		if (exchanges.empty()) return true;
+		return multiplexed && exchanges.size() < maxRequests;
+	}
+
+	// Request ids are only unique among the requests that are active on the connection, so the lowest free one is
+	// taken. The id 0 is reserved for the management records.
+	ushort FastCGIConnection::unusedRequestId() const {
+		ushort requestId = 1;
+		while (exchanges.find(requestId) != exchanges.end()) requestId++;
+		return requestId;
+	}
+
+	Result<bool, Error> FastCGIConnection::send(int writerFd) {
+		if (outOffset == outBuffer.size() && !queueBody()) return false;
+		ssize_t written = write(writerFd, outBuffer.data() + outOffset, outBuffer.size() - outOffset);
+		if (written < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+			return Error(HTTP_BAD_GATEWAY, std::string("Failed to send a request to the FastCGI application: ") + strerror(errno));
+		}
+		outOffset += written;
+		if (outOffset < outBuffer.size()) return true;
+		return queueBody();
+	}
+
+	bool FastCGIConnection::queueBody() {
+		outBuffer.clear();
+		outOffset = 0;
+		for (std::map<ushort, Exchange>::iterator it = exchanges.begin(); it != exchanges.end(); it++) {
+			Exchange& exchange = it->second;
+			if (exchange.bodyQueued) continue;
+			size_t length = std::min(exchange.body.size() - exchange.bodyOffset, static_cast<size_t>(FASTCGI_RECORD_SIZE));
+			if (length > 0) {
+				appendFastCGIRecord(outBuffer, FCGI_STDIN, it->first, exchange.body.substr(exchange.bodyOffset, length));
+				exchange.bodyOffset += length;
+			}
+			// The empty record that ends the stream goes right after the last part of the body.
+			if (exchange.bodyOffset == exchange.body.size()) {
+				appendFastCGIRecord(outBuffer, FCGI_STDIN, it->first, "");
+				exchange.bodyQueued = true;
+				std::string().swap(exchange.body);
+			}
+			return true;
+		}
+		return false;
+	}
+
+	Result<bool, Error> FastCGIConnection::receive(FDTaskDispatcher& dispatcher) {
+		char buffer[FASTCGI_RECEIVE_SIZE];
+		ssize_t received = read(fd, buffer, sizeof(buffer));
+		if (received < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+			return Error(HTTP_BAD_GATEWAY, std::string("Failed to receive from the FastCGI application: ") + strerror(errno));
+		}
+		if (received == 0) {
+			return Error(HTTP_BAD_GATEWAY, "FastCGI application has closed the connection");
+		}
+		parser.append(buffer, received);
+
+		FastCGIRecord record;
+		while (true) {
+			Result<bool, Error> parsed = parser.next(record);
+			if (parsed.isError()) return parsed.getError();
+			if (!parsed.getValue()) break;
+			handleRecord(dispatcher, record);
+		}
+		return !closed;
+	}
+
+	void FastCGIConnection::handleRecord(FDTaskDispatcher& dispatcher, const FastCGIRecord& record) {
+		if (record.type == FCGI_GET_VALUES_RESULT) {
+			Option<std::map<std::string, std::string> > values = parseFastCGIPairs(record.content);
+			if (values.isNone()) return;
+			std::map<std::string, std::string>& pairs = values.get();
+			multiplexed = pairs.count("FCGI_MPXS_CONNS") && pairs["FCGI_MPXS_CONNS"] == "1";
+			Option<int> limit = pairs.count("FCGI_MAX_REQS") ? strToInt(pairs["FCGI_MAX_REQS"]) : NONE;
+			maxRequests = limit.isSome() && limit.get() > 0 ? limit.get() : 1;
+			return;
+		}
+
+		std::map<ushort, Exchange>::iterator exchange = exchanges.find(record.requestId);
+		if (exchange == exchanges.end()) return;
+		switch (record.type) {
+		case FCGI_STDOUT:
+			handleOutput(dispatcher, record.requestId, exchange->second, record.content);
+			break;
+		case FCGI_STDERR:
+			std::cerr << "FastCGI application " << address << ": " << record.content;
+			break;
+		case FCGI_END_REQUEST:
+			endExchange(record.requestId, record.content);
+			break;
+		default:
+			break;
+		}
+	}
+
+	void FastCGIConnection::handleOutput(
+		FDTaskDispatcher& dispatcher,
+		ushort requestId,
+		Exchange& exchange,
+		const std::string& content
+	) {
+		// The output of a request that has an error response, or no body, is dropped.
+		if (exchange.aborted) return;
+		if (exchange.stream.hasStarted()) {
+			exchange.stream.pass(content);
+			return;
+		}
+
+		HTTPResponse resp((Url()), HTTP_OK);
+		Result<bool, Error> parsed = exchange.stream.takeHeaders(content, resp);
+		if (parsed.isError()) {
+			exchange.stream.respondWithError(Error(HTTP_BAD_GATEWAY, parsed.getError().message));
+		}
+		else if (parsed.getValue()) {
+			startResponse(dispatcher, requestId, exchange, resp);
+		}
+	}
+
+	void FastCGIConnection::startResponse(
+		FDTaskDispatcher& dispatcher,
+		ushort requestId,
+		Exchange& exchange,
+		HTTPResponse& resp
+	) {
+		Option<SharedPtr<CGIOutput> > output = exchange.stream.openOutput(dispatcher, resp, multiplexed ? -1 : fd);
+		Option<SharedPtr<IBodyProducer> > producer = NONE;
+		if (output.isSome()) {
+			// The body holds on to the connection, so that it can abort the request. An open connection is always
+			// among the ones of its application.
+			SharedPtr<FastCGIConnection> self;
+			std::vector<SharedPtr<FastCGIConnection> >& pool = connections[address];
+			for (uint i = 0; i < pool.size(); i++) {
+				if (pool[i].operator->() == this) self = pool[i];
+			}
+			producer = SharedPtr<IBodyProducer>(new FastCGIOutputProducer(dispatcher, self, requestId, output.get()));
+		}
+		// The output comes framed in records, so it can not be spliced.
+		exchange.stream.start(resp, producer, false);
+	}
+
+	void FastCGIConnection::endExchange(ushort requestId, const std::string& content) {
+		Exchange& exchange = exchanges[requestId];
+		bool responded = exchange.stream.hasStarted();
+		Option<Error> error = NONE;
+		if (exchange.aborted) {
+			// Nobody is waiting for the response anymore.
+		}
+		else if (content.size() < 8) {
+			error = Error(HTTP_BAD_GATEWAY, "Malformed FastCGI end of request");
+		}
+		else {
+			unsigned char protocolStatus = content[4];
+			const unsigned char* status = reinterpret_cast<const unsigned char*>(content.data());
+			uint appStatus = (status[0] << 24) | (status[1] << 16) | (status[2] << 8) | status[3];
+			if (protocolStatus == FCGI_CANT_MPX_CONN) multiplexed = false;
+			if (protocolStatus == FCGI_CANT_MPX_CONN || protocolStatus == FCGI_OVERLOADED) {
+				error = Error(HTTP_SERVICE_UNAVAILABLE, "FastCGI application is overloaded");
+			}
+			else if (protocolStatus != FCGI_REQUEST_COMPLETE) {
+				error = Error(HTTP_BAD_GATEWAY, "FastCGI application has rejected the request");
+			}
+			else if (appStatus != 0 && !responded) {
+				error = Error(Error::CGI_RUNTIME_FAULT, exchange.stream.getHeaderBuffer());
+			}
+			else if (!responded) {
+				error = Error(HTTP_BAD_GATEWAY, "FastCGI application has ended the request before its header block");
+			}
+		}
+
+		// The application status can not change a response that is under way, but a failure on the side of the
+		// protocol cuts it short.
+		exchange.stream.end(error);
+		exchanges.erase(requestId);
+	}
+
+	void FastCGIConnection::abort(
+		SharedPtr<FastCGIConnection> connection,
+		ushort requestId,
+		const CGIOutput* output,
+		FDTaskDispatcher& dispatcher
+	) {
+		if (connection->closed) return;
+		// Request ids are reused, so the request is only aborted if it is still the one with this output.
+		std::map<ushort, Exchange>::iterator it = connection->exchanges.find(requestId);
+		if (it == connection->exchanges.end()) return;
+		Exchange& exchange = it->second;
+		Option<SharedPtr<CGIOutput> > current = exchange.stream.getOutput();
+		if (current.isNone() || current.get().operator->() != output) return;
+		exchange.stream.detachOutput();
+		exchange.aborted = true;
+		// The rest of the body is not sent, as the application stops reading it.
+		if (!exchange.bodyQueued) {
+			exchange.bodyQueued = true;
+			std::string().swap(exchange.body);
+		}
+
+		std::string record;
+		appendFastCGIRecord(record, FCGI_ABORT_REQUEST, requestId, "");
+		connection->outBuffer.append(record);
+		if (connection->writers > 0) return;
+		int writerFd = dup(connection->fd);
+		if (writerFd < 0) {
+			connection->fail(Error(HTTP_BAD_GATEWAY, "Failed to duplicate the FastCGI connection descriptor"));
+			return;
+		}
+		dispatcher.registerTask(SharedPtr<IFDTask>(new FastCGIWriter(writerFd, connection, SharedPtr<ResponseHandler>())));
+	}
+
+	void FastCGIConnection::fail(const Error& error) {
+		if (closed) return;
+		closed = true;
+		std::vector<SharedPtr<FastCGIConnection> >& pool = connections[address];
+		for (std::vector<SharedPtr<FastCGIConnection> >::iterator it = pool.begin(); it != pool.end(); it++) {
+			if (it->operator->() == this) {
+				pool.erase(it);
+				break;
+			}
+		}
+		for (std::map<ushort, Exchange>::iterator it = exchanges.begin(); it != exchanges.end(); it++) {
+			it->second.stream.end(error);
+		}
+		exchanges.clear();
+		// Wakes the reader up, in case the connection has failed on the side of a writer.
+		shutdown(fd, SHUT_RDWR);
+#ifdef DEBUG
+		std::cout << "FastCGI connection to " << address << " has failed: " << error.message << std::endl;
+#endif
+	}
+
+	FastCGIReader::FastCGIReader(const SharedPtr<FastCGIConnection>& connection):
+		IFDTask(connection->fd, READ_MODE),
+		connection(connection) {}
+
+	Result<bool, Error> FastCGIReader::runTask(FDTaskDispatcher& dispatcher) {
+		Result<bool, Error> received = connection->receive(dispatcher);
+		if (received.isError()) {
+			connection->fail(received.getError());
+			return false;
+		}
+		return received.getValue();
+	}
+
+	FastCGIWriter::FastCGIWriter(
+		int fd,
+		const SharedPtr<FastCGIConnection>& connection,
+		const SharedPtr<ResponseHandler>& responseHandler
+	):
+		IFDTask(fd, WRITE_MODE),
+		connection(connection),
+		responseHandler(responseHandler),
+		reader(NONE) {
+		this->connection->writers++;
+	}
+
+	FastCGIWriter::~FastCGIWriter() {
+		connection->writers--;
+	}
+
+	Result<bool, Error> FastCGIWriter::runTask(FDTaskDispatcher& dispatcher) {
+		(void)dispatcher;
+		if (connection->closed) return false;
+		Result<bool, Error> sent = connection->send(fileDescriptor);
+		if (sent.isError()) {
+			connection->fail(sent.getError());
+			return false;
+		}
+		return sent.getValue();
+	}
+
+	SharedPtr<ResponseHandler> FastCGIWriter::getResponseHandler() {
+		return responseHandler;
+	}
+
+	Option<SharedPtr<FastCGIReader> > FastCGIWriter::getReader() {
+		return reader;
+	}
+}
@@ -0,0 +1,175 @@
+#include "dispatcher.hpp"
+#include "error.hpp"
+#include "http.hpp"
+#include "tasks.hpp"
+#include "url.hpp"
+#include "ystl.hpp"
+#include <cerrno>
+#include <fcntl.h>
+#include <iostream>
+#include <map>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef LINUX
+#include <sys/timerfd.h>
+#endif
+
+typedef Webserv::Error Error;
+typedef Webserv::GroupCommitter GroupCommitter;
+typedef Webserv::ResponseHandler ResponseHandler;
+
+GroupCommitter* GroupCommitter::current = NULL;
+
+GroupCommitter::GroupCommitter(int fd, const Option<pid_t>& syncer):
+	IFDTask(fd, READ_MODE),
+	pending(),
+	syncer(syncer),
+	report() {}
+
+GroupCommitter::~GroupCommitter() {
+	if (current == this) current = NULL;
+	for (uint i = 0; i < pending.size(); i++) {
+		close(pending[i].syncFd);
+	}
+}
+
+void GroupCommitter::enqueue(FDTaskDispatcher& dispatcher, int syncFd, const SharedPtr<IFDTask>& response, uint delayMs) {
+	PendingCommit commit;
+	commit.syncFd = syncFd;
+	commit.response = response;
+
+	// The connection has to stay open while its response is held back, as no task is registered for it.
+	dispatcher.retainDescriptor(response->fileDescriptor);
+	if (current) {
+		current->pending.push_back(commit);
+		return;
+	}
+
+#ifdef LINUX
+	int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timerFd >= 0) {
+		struct itimerspec window;
+		window.it_interval.tv_sec = 0;
+		window.it_interval.tv_nsec = 0;
+		window.it_value.tv_sec = delayMs / 1000;
+		window.it_value.tv_nsec = (delayMs % 1000) * 1000000L;
+		if (timerfd_settime(timerFd, 0, &window, NULL) == 0) {
+			GroupCommitter* committer = new GroupCommitter(timerFd, NONE);
+			committer->pending.push_back(commit);
+			current = committer;
+			dispatcher.registerTask(SharedPtr<IFDTask>(committer));
+			return;
+		}
+		close(timerFd);
+	}
+#else
+	(void)delayMs;
+#endif
+	// With no timer to wait for, the upload is committed right away.
+	std::vector<PendingCommit> single(1, commit);
+	GroupCommitter::commit(dispatcher, single);
+}
+
+Result<bool, Error> GroupCommitter::runTask(FDTaskDispatcher& dispatcher) {
+	if (syncer.isSome()) {
+		char buffer[512];
+		long readResult = read(fileDescriptor, buffer, sizeof(buffer));
+		if (readResult > 0) {
+			report.append(buffer, readResult);
+			return true;
+		}
+		if (readResult < 0 && (errno == EAGAIN || errno == EINTR)) return true;
+		// The report ends along with the process, whether it has synced all of the uploads or not.
+		waitpid(syncer.get(), NULL, 0);
+		release(dispatcher, pending, report);
+		return false;
+	}
+
+	uint64_t expirations;
+	if (read(fileDescriptor, &expirations, sizeof(expirations)) < 0) {
+		return true;
+	}
+	// Uploads that complete from now on wait for the next window.
+	if (current == this) current = NULL;
+	GroupCommitter::commit(dispatcher, pending);
+	return false;
+}
+
+void GroupCommitter::commit(FDTaskDispatcher& dispatcher, std::vector<PendingCommit>& commits) {
+	int reportPipe[2];
+	if (pipe(reportPipe) == 0) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(reportPipe[0]);
+			std::string synced = sync(commits);
+			size_t offset = 0;
+			while (offset < synced.size()) {
+				long writeResult = write(reportPipe[1], synced.data() + offset, synced.size() - offset);
+				if (writeResult <= 0) break;
+				offset += writeResult;
+			}
+			_exit(0);
+		}
+		close(reportPipe[1]);
+		if (pid > 0) {
+			fcntl(reportPipe[0], F_SETFL, O_NONBLOCK);
+			fcntl(reportPipe[0], F_SETFD, FD_CLOEXEC);
+			GroupCommitter* committer = new GroupCommitter(reportPipe[0], pid);
+			committer->pending.swap(commits);
+			dispatcher.registerTask(SharedPtr<IFDTask>(committer));
+			return;
+		}
+		close(reportPipe[0]);
+	}
+	// With no process to sync them, the uploads are synced right away, which holds up the server meanwhile.
+	release(dispatcher, commits, sync(commits));
+}
+
+std::string GroupCommitter::sync(const std::vector<PendingCommit>& commits) {
+	std::string synced(commits.size(), '0');
+#ifdef LINUX
+	// Each of the file systems is synced once, however many of the uploads it has received.
+	std::map<dev_t, bool> syncedDevices;
+	for (uint i = 0; i < commits.size(); i++) {
+		struct stat st;
+		if (fstat(commits[i].syncFd, &st) != 0) continue;
+		std::map<dev_t, bool>::iterator device = syncedDevices.find(st.st_dev);
+		if (device == syncedDevices.end()) {
+			device = syncedDevices.insert(std::make_pair(st.st_dev, syncfs(commits[i].syncFd) == 0)).first;
+		}
+		if (device->second) synced[i] = '1';
+	}
+#else
+	for (uint i = 0; i < commits.size(); i++) {
+		if (fsync(commits[i].syncFd) == 0) synced[i] = '1';
+	}
+#endif
+	return synced;
+}
+
+void GroupCommitter::release(FDTaskDispatcher& dispatcher, std::vector<PendingCommit>& commits, const std::string& synced) {
+	for (uint i = 0; i < commits.size(); i++) {
+		PendingCommit& commit = commits[i];
+		close(commit.syncFd);
+
+		// Uploads that could not be made durable are not acknowledged as stored. The file is already in place by
+		// then, though, so its new version may be visible (and even stay on the disk) all the same.
+		if (i >= synced.size() || synced[i] != '1') {
+			Option<SharedPtr<ResponseHandler> > handler = commit.response.tryAs<ResponseHandler>();
+			if (handler.isSome()) {
+				HTTPResponse response(Url(), HTTP_INTERNAL_SERVER_ERROR);
+				response.setContentType(contentTypeString(HTML));
+				response.setData(makeErrorPage(Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to store the upload durably")));
+				handler.get()->setResponse(response);
+			}
+		}
+		dispatcher.registerTask(commit.response);
+		dispatcher.releaseDescriptor(commit.response->fileDescriptor);
+	}
+#ifdef DEBUG
+	std::cout << "Committed " << commits.size() << " uploads" << std::endl;
+#endif
+	commits.clear();
+}
@@ -5,6 +5,7 @@
 #include "http.hpp"
 #include "webserv.hpp"
 #include "ystl.hpp"
+#include <algorithm>
 #include <unistd.h>
 #include "tasks.hpp"
 #include <string>
@@ -27,7 +28,9 @@ RequestHandler::RequestHandler(const ServerData& sd, int cfd):
 	reqBuilder(),
 	location(),
 	dataSizeLimit(),
-	chunked(false) {};
+	chunked(false),
+	upload(),
+	uploadRemaining(0) {};
 
 Result<RequestHandler*, Error> RequestHandler::tryMake(int cfd, ServerData &data) {
 	RequestHandler* rHandler = new RequestHandler(data, cfd);
@@ -38,6 +41,11 @@ Result<RequestHandler*, Error> RequestHandler::tryMake(int cfd, ServerData &data
 }
 
 Result<bool, Error> RequestHandler::runTask(FDTaskDispatcher& dispatcher) {
+	// Once an upload has started, the rest of the body goes straight into it.
+	if (upload.isSome()) {
+		return receiveUpload(dispatcher);
+	}
+
 	// char buffer[MSG_BUF_SIZE + 1] = {0};
 	char* buffer = new char[sData.messageBufferSize + 1]();
 	long readResult = read(clientSocketFd, (void*)buffer, sData.messageBufferSize);
@@ -107,6 +115,8 @@ Result<bool, Error> RequestHandler::runTask(FDTaskDispatcher& dispatcher) {
 				&& !reqBuilder.isChunked()
 				&& method.get() != DELETE
 				&& method.get() != HEAD
+				&& method.get() != COPY
+				&& method.get() != MOVE
 			) {
 				Option<uint> maybeContLength = reqBuilder.getContentLength();
 				if (maybeContLength.isNone()) {
@@ -119,6 +129,26 @@ Result<bool, Error> RequestHandler::runTask(FDTaskDispatcher& dispatcher) {
 						"HTTP message content length is too large!"));
 				}
 				dataSizeLimit = contLength;
+
+				// Uploads are written out as they arrive, starting with the part of the body that came along with
+				// the header.
+				Result<Option<SharedPtr<IUploadSink> >, Error> maybeUpload = startUpload(
+					reqBuilder,
+					location.get(),
+					sData
+				);
+				if (maybeUpload.isError()) {
+					SEND_ERROR(dispatcher, maybeUpload.getError());
+				}
+				upload = maybeUpload.getValue();
+				if (upload.isSome()) {
+					std::string initialData = reqBuilder.detachData();
+					Option<Error> uploadError = upload.get()->feed(initialData.data(), initialData.size());
+					if (uploadError.isSome()) {
+						SEND_ERROR(dispatcher, uploadError.get());
+					}
+					uploadRemaining = contLength - std::min(static_cast<size_t>(contLength), initialData.size());
+				}
 			}
 			else {
 				dataSizeLimit = 0;
@@ -161,6 +191,30 @@ Result<bool, Error> RequestHandler::runTask(FDTaskDispatcher& dispatcher) {
 	return false;
 }
 
+Result<bool, Error> RequestHandler::receiveUpload(FDTaskDispatcher& dispatcher) {
+	Result<size_t, Error> received = upload.get()->receive(clientSocketFd, uploadRemaining);
+	if (received.isError()) {
+		SEND_ERROR(dispatcher, received.getError());
+	}
+	if (received.getValue() == 0) {
+		// The client is gone before sending the whole body, so the upload is abandoned.
+		return false;
+	}
+	uploadRemaining -= received.getValue();
+	if (uploadRemaining > 0) {
+		return true;
+	}
+
+	Option<Error> maybeError = finalize(dispatcher);
+	if (maybeError.isSome()) {
+		if (maybeError.get().tag == Error::SHUTDOWN_SIGNAL) {
+			return maybeError.get();
+		}
+		SEND_ERROR(dispatcher, maybeError.get());
+	}
+	return false;
+}
+
 Option<Error> RequestHandler::sendError(FDTaskDispatcher& dispatcher, Error error) {
 	ConnectionInfo conn;
 	conn.connectionFd = clientSocketFd;
@@ -176,19 +230,38 @@ Option<Error> RequestHandler::finalize(Webserv::FDTaskDispatcher& dispatcher) {
 
 	UniquePtr<HTTPRequest> request = maybeRequest.getValue();
 
+	if (upload.isSome()) {
+		Option<Error> uploadError = upload.get()->finish();
+		if (uploadError.isSome()) {
+			return uploadError;
+		}
+	}
+
 	if (request->getData() == "close") {
 		return Error(Error::SHUTDOWN_SIGNAL);
 	}
 	else {
+		// A body spooled into a file is read by the script from there.
+		Option<int> spooledBody = NONE;
+		if (upload.isSome()) spooledBody = upload.get()->bodyDescriptor();
 		Result<SharedPtr<IFDTask>, Error> nextTask = handleRequest(
 			request.ref(),
 			location.get(),
 			sData,
-			clientSocketFd
+			clientSocketFd,
+			upload.isSome(),
+			spooledBody
 		);
 		if (nextTask.isError()) {
 			return nextTask.getError();
 		}
+		// Uploads committed in groups are only acknowledged once their group reaches the disk.
+		Option<int> syncFd = upload.isSome() ? upload.get()->takeSyncDescriptor() : NONE;
+		if (syncFd.isSome()) {
+			uint delay = location.get().location->groupCommitDelay;
+			GroupCommitter::enqueue(dispatcher, syncFd.get(), nextTask.getValue(), delay);
+			return NONE;
+		}
 		dispatcher.registerTask(nextTask.getValue());
 		Option<SharedPtr<CGIReader> > maybeReader = nextTask.getValue().tryAs<CGIReader>();
 		if (maybeReader.isSome()) {
@@ -196,6 +269,12 @@ Option<Error> RequestHandler::finalize(Webserv::FDTaskDispatcher& dispatcher) {
 			if (maybeReader.get()->getWriter().isSome())
 				dispatcher.registerTask(maybeReader.get()->getWriter().get().tryAs<IFDTask>().get());
 		}
+		Option<SharedPtr<FastCGIWriter> > maybeFastCGI = nextTask.getValue().tryAs<FastCGIWriter>();
+		if (maybeFastCGI.isSome()) {
+			dispatcher.registerTask(maybeFastCGI.get()->getResponseHandler().tryAs<IFDTask>().get());
+			if (maybeFastCGI.get()->getReader().isSome())
+				dispatcher.registerTask(maybeFastCGI.get()->getReader().get().tryAs<IFDTask>().get());
+		}
 	}
 	return NONE;
 }
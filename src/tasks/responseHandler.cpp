@@ -4,6 +4,7 @@
 #include "dispatcher.hpp"
 #include "http.hpp"
 #include "ystl.hpp"
+#include "zeroCopy.hpp"
 #include <unistd.h>
 #include "tasks.hpp"
 #include <string>
@@ -17,21 +18,28 @@ ResponseHandler::ResponseHandler(const ConnectionInfo& ci):
 	IFDTask(ci.connectionFd, WRITE_MODE),
 	conn(ci),
 	response(NONE),
-	writeStr(NONE)
+	writeStr(NONE),
+	writeOffset(0),
+	awaitingZeroCopy(false)
 {}
 
 ResponseHandler::ResponseHandler(ConnectionInfo& ci, const HTTPResponse& resp):
 	IFDTask(ci.connectionFd, WRITE_MODE),
 	conn(ci),
 	response(resp),
-	writeStr(NONE)
+	writeStr(NONE),
+	writeOffset(0),
+	awaitingZeroCopy(false)
 {}
 
 Result<ResponseHandler*, Error> ResponseHandler::tryMake(ConnectionInfo& ci, const HTTPResponse& resp) {
 	return new ResponseHandler(ci, resp);
 }
 
-Result<bool, Error> ResponseHandler::runTask(FDTaskDispatcher&) {
+Result<bool, Error> ResponseHandler::runTask(FDTaskDispatcher& dispatcher) {
+	// Zero-copy completions are collected as they come, so that the error queue does not pile up.
+	bool zeroCopyPending = pollZeroCopy(conn.connectionFd);
+	if (awaitingZeroCopy) return zeroCopyPending;
 	if (response.isNone()) return true;
 
 	if (writeStr.isNone()) {
@@ -39,21 +47,50 @@ Result<bool, Error> ResponseHandler::runTask(FDTaskDispatcher&) {
 	}
 
 	// Write response to client socket with error checking
-	long writeResult = write(conn.connectionFd, writeStr.get().c_str(), writeStr.get().length());
+	if (writeOffset < writeStr.get().length()) {
+		long writeResult = sendBuffer(
+			conn.connectionFd,
+			writeStr.get().c_str() + writeOffset,
+			writeStr.get().length() - writeOffset
+		);
 
-	if (writeResult <= 0) {
+		if (writeResult <= 0) {
 #ifdef DEBUG
-		std::cerr << "write error :(" << std::endl;
+			std::cerr << "write error :(" << std::endl;
 #endif
-		return false;
+			return false;
+		}
+
+		writeOffset += writeResult;
+		if (writeOffset < writeStr.get().length()) {
+			return true;
+		}
 	}
 
-	if (writeStr.get().length() - writeResult > 0) {
-		writeStr = writeStr.get().substr(0, writeResult);
-		return true;
+	// Once the header is out, the body (if there is one) is sent piece by piece, one piece per turn.
+	Option<SharedPtr<IResponseBody> > body = response.get().getBody();
+	if (body.isNone()) {
+		return finish(dispatcher);
 	}
 
-	return false;
+	Result<bool, Error> transmitted = body.get()->transmit(conn.connectionFd);
+	if (transmitted.isError()) {
+#ifdef DEBUG
+		std::cerr << "body transmission error: " << transmitted.getError().message << std::endl;
+#endif
+		return false;
+	}
+	if (!transmitted.getValue()) {
+		return finish(dispatcher);
+	}
+	return true;
+}
+
+bool ResponseHandler::finish(FDTaskDispatcher& dispatcher) {
+	if (!pollZeroCopy(conn.connectionFd)) return false;
+	awaitingZeroCopy = true;
+	dispatcher.suspendIO(conn.connectionFd);
+	return true;
 }
 
 void ResponseHandler::setResponse(const HTTPResponse& resp) {
@@ -64,5 +101,6 @@ ResponseHandler::~ResponseHandler() {
 #ifdef DEBUG
 	std::cout << "Destroying response handler" << std::endl;
 #endif
+	releaseZeroCopy(conn.connectionFd);
 	close(conn.connectionFd);
 }
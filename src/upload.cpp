@@ -0,0 +1,782 @@
+#include "upload.hpp"
+#include "error.hpp"
+#include "http.hpp"
+#include "rootDirectory.hpp"
+#include "webserv.hpp"
+#include "ystl.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <sstream>
+#include <string>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+#ifdef LINUX
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+namespace Webserv {
+	IUploadSink::~IUploadSink() {}
+
+	Option<int> IUploadSink::takeSyncDescriptor() {
+		return NONE;
+	}
+
+	Option<int> IUploadSink::bodyDescriptor() {
+		return NONE;
+	}
+
+	Result<size_t, Error> IUploadSink::receive(int socketFd, size_t length) {
+		static char buffer[UPLOAD_RECEIVE_SIZE];
+		long readResult = read(socketFd, buffer, std::min(length, sizeof(buffer)));
+		if (readResult < 0) {
+			return Error(Error::GENERIC_ERROR, "Socket read failed");
+		}
+		Option<Error> maybeError = feed(buffer, readResult);
+		if (maybeError.isSome()) {
+			return maybeError.get();
+		}
+		return static_cast<size_t>(readResult);
+	}
+
+	// Returns a name for a temporary file next to the file with the given name, which is hidden from listings
+	// and unlikely to be taken.
+	static std::string temporaryNameFor(const std::string& name) {
+		static unsigned long counter = 0;
+		std::stringstream tempName;
+		tempName << "." << name << "." << std::hex << getpid() << "." << counter++ << ".tmp";
+		return tempName.str();
+	}
+
+	DecodingUpload::DecodingUpload(
+		const SharedPtr<IUploadSink>& target,
+		ContentCoding coding,
+		size_t maxSize,
+		uint maxRatio
+	):
+		target(target),
+		decompressor(coding, maxSize, maxRatio),
+		decoded() {}
+
+	// The body is decoded a slice at a time, so that a well compressed piece of it is never held in memory all at
+	// once.
+	Option<Error> DecodingUpload::feed(const char* data, size_t length) {
+		for (size_t offset = 0; offset < length;) {
+			size_t slice = std::min(length - offset, static_cast<size_t>(DECODE_SLICE_SIZE));
+			decoded.clear();
+			Option<Error> maybeError = decompressor.decompress(data + offset, slice, decoded);
+			if (maybeError.isNone()) {
+				maybeError = target->feed(decoded.data(), decoded.size());
+			}
+			if (maybeError.isSome()) return maybeError;
+			offset += slice;
+		}
+		return NONE;
+	}
+
+	Option<Error> DecodingUpload::finish() {
+		Option<Error> maybeError = decompressor.finish();
+		if (maybeError.isSome()) return maybeError;
+		return target->finish();
+	}
+
+	Option<int> DecodingUpload::takeSyncDescriptor() {
+		return target->takeSyncDescriptor();
+	}
+
+	Option<int> DecodingUpload::bodyDescriptor() {
+		return target->bodyDescriptor();
+	}
+
+	// Returns the name of the partial file that the ranges of a file are collected in, which is hidden next to the
+	// file itself. All of the uploads of the file share it, so that any of them may be resumed by another request.
+	static std::string partialNameFor(const std::string& name) {
+		return "." + name + ".part";
+	}
+
+	// Name of the extended attribute of a partial file that holds the total size declared by its first range.
+	static const char* const PARTIAL_TOTAL_ATTRIBUTE = "user.webserv.total";
+
+	// Records the total size of the file that the partial file is collecting.
+	static void storePartialTotal(int fd, size_t total) {
+		std::ostringstream value;
+		value << total;
+		std::string str = value.str();
+#ifdef LINUX
+		fsetxattr(fd, PARTIAL_TOTAL_ATTRIBUTE, str.data(), str.size(), 0);
+#else
+		fsetxattr(fd, PARTIAL_TOTAL_ATTRIBUTE, str.data(), str.size(), 0, 0);
+#endif
+	}
+
+	// Returns the total size recorded for the partial file, which is none on file systems without extended
+	// attributes.
+	static Option<size_t> loadPartialTotal(int fd) {
+		char value[32];
+#ifdef LINUX
+		long length = fgetxattr(fd, PARTIAL_TOTAL_ATTRIBUTE, value, sizeof(value));
+#else
+		long length = fgetxattr(fd, PARTIAL_TOTAL_ATTRIBUTE, value, sizeof(value), 0, 0);
+#endif
+		if (length <= 0) return NONE;
+		return strToSize(std::string(value, length));
+	}
+
+	// Splits a path into its directory and the name of the file.
+	static void splitPath(const std::string& relativePath, std::string& parent, std::string& name) {
+		size_t slash = relativePath.rfind('/');
+		parent = slash == std::string::npos ? "" : relativePath.substr(0, slash);
+		name = slash == std::string::npos ? relativePath : relativePath.substr(slash + 1);
+	}
+
+	Option<ContentRange> parseContentRange(const std::string& header) {
+		std::string value = trimString(header, ' ');
+		if (strToLower(value).compare(0, 6, "bytes ") != 0) return NONE;
+		size_t dash = value.find('-', 6);
+		size_t slash = value.find('/', 6);
+		if (dash == std::string::npos || slash == std::string::npos || slash < dash) return NONE;
+
+		Option<size_t> first = strToSize(trimString(value.substr(6, dash - 6), ' '));
+		Option<size_t> last = strToSize(value.substr(dash + 1, slash - dash - 1));
+		// The total size has to be known, as the upload is only complete once all of it was received.
+		Option<size_t> total = strToSize(value.substr(slash + 1));
+		if (first.isNone() || last.isNone() || total.isNone()) return NONE;
+		if (first.get() > last.get() || last.get() >= total.get()) return NONE;
+
+		ContentRange range;
+		range.first = first.get();
+		range.last = last.get();
+		range.total = total.get();
+		return range;
+	}
+
+	Option<size_t> receivedUploadSize(const RootDirectory& root, const std::string& relativePath) {
+		std::string parent, name;
+		splitPath(relativePath, parent, name);
+		if (name.empty()) return NONE;
+		struct stat st;
+		std::string partialPath = parent.empty() ? partialNameFor(name) : parent + "/" + partialNameFor(name);
+		if (statBeneath(root, partialPath, st) != 0 || !S_ISREG(st.st_mode)) return NONE;
+		return static_cast<size_t>(st.st_size);
+	}
+
+	static Error uploadError(int error) {
+		if (error == ENOSPC || error == EDQUOT) {
+			return Error(HTTP_INSUFFICIENT_STORAGE, "Not enough space for the upload");
+		}
+		if (error == ENOENT || error == ENOTDIR) {
+			return Error(HTTP_CONFLICT, "The directory of the upload file does not exist");
+		}
+		return Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to create/open an upload file");
+	}
+
+	static Error writeError(int error) {
+		if (error == ENOSPC || error == EDQUOT) return uploadError(error);
+		return Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to write an upload file");
+	}
+
+	// Writes out all of the data into a file descriptor.
+	static bool writeAll(int fd, const char* data, size_t length) {
+		size_t written = 0;
+		while (written < length) {
+			long writeResult = write(fd, data + written, length - written);
+			if (writeResult <= 0) return false;
+			written += writeResult;
+		}
+		return true;
+	}
+
+	// Maps the failure to open the source of a copy or a move onto a response status.
+	static Error sourceError(int error) {
+		if (error == ENOENT || error == ENOTDIR) return Error(HTTP_NOT_FOUND, "File was not found");
+		if (error == EACCES || error == EPERM || error == ELOOP) return Error(HTTP_FORBIDDEN, "File is not accessible");
+		return Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to open the file");
+	}
+
+	// Renames a file without replacing an existing destination, where the rename itself can not check for it. Files
+	// are linked under the new name (which fails if the name is taken) before the old one is removed. Directories can
+	// not be linked, so they are only checked for beforehand: a destination that is created in between those two
+	// steps is replaced.
+	static int renameNoReplace(
+		int fromDirFd,
+		const std::string& fromName,
+		int toDirFd,
+		const std::string& toName,
+		bool existed
+	) {
+		struct stat st;
+		if (fstatat(fromDirFd, fromName.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) return -1;
+		if (S_ISDIR(st.st_mode)) {
+			errno = EEXIST;
+			if (existed) return -1;
+			return renameat(fromDirFd, fromName.c_str(), toDirFd, toName.c_str());
+		}
+		if (linkat(fromDirFd, fromName.c_str(), toDirFd, toName.c_str(), 0) != 0) return -1;
+		if (unlinkat(fromDirFd, fromName.c_str(), 0) != 0) {
+			int unlinkErrno = errno;
+			unlinkat(toDirFd, toName.c_str(), 0);
+			errno = unlinkErrno;
+			return -1;
+		}
+		return 0;
+	}
+
+	Result<bool, Error> moveFile(
+		const RootDirectory& root,
+		const std::string& from,
+		const std::string& to,
+		bool replace,
+		Durability durability
+	) {
+		std::string fromParent, fromName, toParent, toName;
+		splitPath(from, fromParent, fromName);
+		splitPath(to, toParent, toName);
+		if (fromName.empty() || fromName == "." || fromName == ".." || toName.empty() || toName == "." || toName == "..") {
+			return Error(HTTP_BAD_REQUEST, "Invalid file name");
+		}
+
+		int fromDirFd = openBeneath(root, fromParent, O_RDONLY | O_DIRECTORY);
+		if (fromDirFd < 0) return sourceError(errno);
+		int toDirFd = openBeneath(root, toParent, O_RDONLY | O_DIRECTORY);
+		if (toDirFd < 0) {
+			int openErrno = errno;
+			close(fromDirFd);
+			return uploadError(openErrno);
+		}
+
+		struct stat st;
+		bool existed = fstatat(toDirFd, toName.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+		int renameResult = -1;
+#ifdef LINUX
+		// The kernel checks that the destination does not exist as a part of the rename, so that a file created
+		// meanwhile is never replaced. Some file systems do not support that, though.
+		renameResult = renameat2(fromDirFd, fromName.c_str(), toDirFd, toName.c_str(), replace ? 0 : RENAME_NOREPLACE);
+		if (renameResult != 0 && errno == EINVAL && !replace) {
+			renameResult = renameNoReplace(fromDirFd, fromName, toDirFd, toName, existed);
+		}
+#else
+		if (replace) renameResult = renameat(fromDirFd, fromName.c_str(), toDirFd, toName.c_str());
+		else renameResult = renameNoReplace(fromDirFd, fromName, toDirFd, toName, existed);
+#endif
+		int renameErrno = errno;
+		Option<Error> maybeError = NONE;
+		if (renameResult != 0) {
+			if (renameErrno == EEXIST) maybeError = Error(HTTP_PRECONDITION_FAILED, "Destination already exists");
+			else if (renameErrno == ENOENT) maybeError = Error(HTTP_NOT_FOUND, "File was not found");
+			else if (renameErrno == EXDEV) maybeError = Error(HTTP_BAD_GATEWAY, "Destination is on another file system");
+			else if (renameErrno == ENOTEMPTY || renameErrno == EISDIR || renameErrno == ENOTDIR || renameErrno == EINVAL) {
+				maybeError = Error(HTTP_CONFLICT, "Destination conflicts with the file");
+			}
+			else maybeError = uploadError(renameErrno);
+		}
+		// Both of the directories have changed, so both of them are synced.
+		else if (durability != Config::Server::Location::DURABILITY_NONE) {
+			if (fsync(toDirFd) != 0 || (fromParent != toParent && fsync(fromDirFd) != 0)) {
+				maybeError = writeError(errno);
+			}
+		}
+		close(fromDirFd);
+		close(toDirFd);
+		forgetCachedStat(root, from);
+		forgetCachedStat(root, to);
+		if (maybeError.isSome()) return maybeError.get();
+		return existed;
+	}
+
+	Result<bool, Error> copyFile(
+		const RootDirectory& root,
+		const std::string& from,
+		const std::string& to,
+		bool replace,
+		Durability durability
+	) {
+		int sourceFd = openBeneath(root, from, O_RDONLY);
+		if (sourceFd < 0) return sourceError(errno);
+		struct stat sourceStat;
+		if (fstat(sourceFd, &sourceStat) != 0 || !S_ISREG(sourceStat.st_mode)) {
+			close(sourceFd);
+			return Error(HTTP_FORBIDDEN, "Only files can be copied");
+		}
+
+		struct stat st;
+		bool existed = statBeneath(root, to, st) == 0;
+		if (existed && !replace) {
+			close(sourceFd);
+			return Error(HTTP_PRECONDITION_FAILED, "Destination already exists");
+		}
+		if (existed && !S_ISREG(st.st_mode)) {
+			close(sourceFd);
+			return Error(HTTP_CONFLICT, "Destination conflicts with the file");
+		}
+
+		Result<FileUpload*, Error> maybeCopy = FileUpload::start(root, to, NONE, durability);
+		if (maybeCopy.isError()) {
+			close(sourceFd);
+			return maybeCopy.getError();
+		}
+		UniquePtr<FileUpload> copy(maybeCopy.getValue());
+		Option<Error> maybeError = copy->copyFrom(sourceFd, sourceStat.st_size);
+		close(sourceFd);
+		if (maybeError.isNone()) {
+			maybeError = copy->finish();
+		}
+		if (maybeError.isSome()) return maybeError.get();
+		return existed;
+	}
+
+	FileUpload::FileUpload(const RootDirectory& root, const std::string& relativePath, int dirFd, Durability durability):
+		root(root),
+		relativePath(relativePath),
+		name(),
+		dirFd(dirFd),
+		fd(-1),
+		durability(durability),
+		temporaryName(),
+		written(0),
+		allocated(0),
+		finished(false) {}
+
+	// Opens the directory of the file, without opening the file itself yet.
+	Result<FileUpload*, Error> FileUpload::open(
+		const RootDirectory& root,
+		const std::string& relativePath,
+		Durability durability
+	) {
+		std::string parent, name;
+		splitPath(relativePath, parent, name);
+		if (name.empty() || name == "." || name == "..") {
+			return Error(HTTP_BAD_REQUEST, "Invalid upload file name");
+		}
+
+		int dirFd = openBeneath(root, parent, O_RDONLY | O_DIRECTORY);
+		if (dirFd < 0) {
+			return uploadError(errno);
+		}
+#ifndef LINUX
+		// Group commits rely on `syncfs`, so the files are synced one by one where it is missing.
+		if (durability == Config::Server::Location::DURABILITY_GROUP) {
+			durability = Config::Server::Location::DURABILITY_FILE;
+		}
+#endif
+		FileUpload* upload = new FileUpload(root, relativePath, dirFd, durability);
+		upload->name = name;
+		return upload;
+	}
+
+	Result<FileUpload*, Error> FileUpload::start(
+		const RootDirectory& root,
+		const std::string& relativePath,
+		Option<size_t> size,
+		Durability durability
+	) {
+		Result<FileUpload*, Error> opened = FileUpload::open(root, relativePath, durability);
+		if (opened.isError()) return opened;
+		FileUpload* upload = opened.getValue();
+		Option<Error> maybeError = upload->openTemporaryFile();
+		if (maybeError.isSome()) {
+			delete upload;
+			return maybeError.get();
+		}
+
+#ifdef LINUX
+		// File systems that can not allocate the space up front are simply left to allocate it as the file grows.
+		if (size.isSome() && size.get() > 0) {
+			if (fallocate(upload->fd, 0, 0, size.get()) == 0) {
+				upload->allocated = size.get();
+			}
+			else if (errno == ENOSPC || errno == EDQUOT) {
+				Error error = uploadError(errno);
+				delete upload;
+				return error;
+			}
+		}
+#else
+		(void)size;
+#endif
+		return upload;
+	}
+
+	Result<FileUpload*, Error> FileUpload::resume(
+		const RootDirectory& root,
+		const std::string& relativePath,
+		const ContentRange& range,
+		Durability durability
+	) {
+		Result<FileUpload*, Error> opened = FileUpload::open(root, relativePath, durability);
+		if (opened.isError()) return opened;
+		FileUpload* upload = opened.getValue();
+		Option<Error> maybeError = upload->openPartialFile(range);
+		if (maybeError.isSome()) {
+			delete upload;
+			return maybeError.get();
+		}
+		return upload;
+	}
+
+	FileUpload::~FileUpload() {
+		if (!finished) discard();
+		if (dirFd >= 0) close(dirFd);
+	}
+
+	// The file is created without a name where the file system supports that, so that it disappears along with
+	// its descriptor if the upload is abandoned (or the server crashes).
+	Option<Error> FileUpload::openTemporaryFile() {
+#ifdef O_TMPFILE
+		fd = openat(dirFd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+		if (fd >= 0) return NONE;
+		if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+			return uploadError(errno);
+		}
+#endif
+		for (int attempt = 0; attempt < 16; attempt++) {
+			std::string tempName = temporaryNameFor(name);
+			fd = openat(dirFd, tempName.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+			if (fd >= 0) {
+				temporaryName = tempName;
+				return NONE;
+			}
+			if (errno != EEXIST) break;
+		}
+		return uploadError(errno);
+	}
+
+	// The range is written in place, so a range that overlaps the part received before simply overwrites it. The
+	// space for the whole file is allocated along with the first range, without changing the size of the partial
+	// file, as the size is what tells how much of the file was received. The total size of the first range is kept
+	// with the partial file, and the later ranges have to declare the same one.
+	Option<Error> FileUpload::openPartialFile(const ContentRange& contentRange) {
+		std::string partialName = partialNameFor(name);
+		fd = openat(dirFd, partialName.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0) return uploadError(errno);
+		range = contentRange;
+		temporaryName = partialName;
+
+		struct stat st;
+		if (fstat(fd, &st) != 0) return uploadError(errno);
+		if (contentRange.first > static_cast<size_t>(st.st_size)) {
+			if (st.st_size == 0) unlinkat(dirFd, partialName.c_str(), 0);
+			return Error(HTTP_RANGE_NOT_SATISFIABLE, "The range starts past the end of the received part");
+		}
+		if (st.st_size == 0) {
+			storePartialTotal(fd, contentRange.total);
+		}
+		else {
+			Option<size_t> total = loadPartialTotal(fd);
+			if (total.isSome() && total.get() != contentRange.total) {
+				return Error(HTTP_RANGE_NOT_SATISFIABLE, "The total size does not match the one of the earlier ranges");
+			}
+		}
+#ifdef LINUX
+		if (st.st_size == 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, contentRange.total) != 0
+			&& (errno == ENOSPC || errno == EDQUOT)) {
+			return uploadError(errno);
+		}
+#endif
+		if (lseek(fd, contentRange.first, SEEK_SET) < 0) return uploadError(errno);
+		return NONE;
+	}
+
+	Option<Error> FileUpload::feed(const char* data, size_t length) {
+		if (!writeAll(fd, data, length)) {
+			int writeErrno = errno;
+			discard();
+			return writeError(writeErrno);
+		}
+		written += length;
+		return NONE;
+	}
+
+	// Where the file system supports it, the file is made to share the blocks of the source (a reflink), which takes
+	// no time and no space, however large the file is. Otherwise the kernel copies the contents with
+	// `copy_file_range`, which some file systems (and network ones) also do without moving the data.
+	Option<Error> FileUpload::copyFrom(int sourceFd, size_t length) {
+		size_t copied = 0;
+#ifdef LINUX
+#ifdef FICLONE
+		if (length > 0 && ioctl(fd, FICLONE, sourceFd) == 0) {
+			written = length;
+			return NONE;
+		}
+#endif
+		loff_t sourceOffset = 0;
+		while (copied < length) {
+			long copyResult = copy_file_range(sourceFd, &sourceOffset, fd, NULL, length - copied, 0);
+			if (copyResult <= 0) {
+				if (copyResult == 0 || errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) break;
+				int copyErrno = errno;
+				discard();
+				return writeError(copyErrno);
+			}
+			copied += copyResult;
+		}
+#endif
+		// The rest is copied through the memory of the server.
+		static char buffer[UPLOAD_RECEIVE_SIZE];
+		while (copied < length) {
+			long readResult = pread(sourceFd, buffer, std::min(length - copied, sizeof(buffer)), copied);
+			if (readResult == 0) break;
+			if (readResult < 0 || !writeAll(fd, buffer, readResult)) {
+				int copyErrno = errno;
+				discard();
+				return writeError(copyErrno);
+			}
+			copied += readResult;
+		}
+		written = copied;
+		return NONE;
+	}
+
+	Result<size_t, Error> FileUpload::receive(int socketFd, size_t length) {
+#ifdef LINUX
+		Result<Option<size_t>, Error> moved = splicePipe.receive(socketFd, fd, length);
+		if (moved.isError()) {
+			discard();
+			return moved.getError();
+		}
+		if (moved.getValue().isSome()) {
+			written += moved.getValue().get();
+			return moved.getValue().get();
+		}
+#endif
+		return IUploadSink::receive(socketFd, length);
+	}
+
+	Option<Error> FileUpload::finish() {
+		if (fd < 0) return Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to write an upload file");
+		if (range.isSome()) {
+			struct stat st;
+			if (fstat(fd, &st) != 0) {
+				discard();
+				return Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to write an upload file");
+			}
+			// The partial file is kept as it is until the rest of the file arrives.
+			if (static_cast<size_t>(st.st_size) < range.get().total) {
+				discard();
+				finished = true;
+				return NONE;
+			}
+			written = range.get().total;
+			allocated = st.st_size;
+			// The file keeps the attributes of its partial file.
+#ifdef LINUX
+			fremovexattr(fd, PARTIAL_TOTAL_ATTRIBUTE);
+#else
+			fremovexattr(fd, PARTIAL_TOTAL_ATTRIBUTE, 0);
+#endif
+		}
+		if (allocated > written && ftruncate(fd, written) != 0) {
+			discard();
+			return Error(HTTP_INTERNAL_SERVER_ERROR, "Failed to write an upload file");
+		}
+		bool syncFile = durability == Config::Server::Location::DURABILITY_FILE;
+		if (syncFile && fdatasync(fd) != 0) {
+			int syncErrno = errno;
+			discard();
+			return writeError(syncErrno);
+		}
+		Option<Error> maybeError = publish();
+		if (maybeError.isSome()) {
+			discard();
+			return maybeError;
+		}
+		// The new name of the file is only durable once the directory is synced too.
+		if (syncFile && fsync(dirFd) != 0) {
+			int syncErrno = errno;
+			discard();
+			return writeError(syncErrno);
+		}
+		close(fd);
+		fd = -1;
+#ifdef LINUX
+		splicePipe.close();
+#endif
+		finished = true;
+		forgetCachedStat(root, relativePath);
+		return NONE;
+	}
+
+	bool FileUpload::isComplete() const {
+		return finished && temporaryName.isNone();
+	}
+
+	Option<int> FileUpload::takeSyncDescriptor() {
+		if (!isComplete() || durability != Config::Server::Location::DURABILITY_GROUP || dirFd < 0) return NONE;
+		int syncFd = dirFd;
+		dirFd = -1;
+		return syncFd;
+	}
+
+	// Gives the anonymous file a name. Linking by the descriptor itself takes a capability that the server
+	// usually lacks, so the file is linked through its entry in `/proc` instead.
+	static int linkAnonymousFile(int fd, int dirFd, const std::string& name) {
+#ifdef AT_EMPTY_PATH
+		if (linkat(fd, "", dirFd, name.c_str(), AT_EMPTY_PATH) == 0) return 0;
+		if (errno != ENOENT && errno != EPERM) return -1;
+#endif
+		std::stringstream procPath;
+		procPath << "/proc/self/fd/" << fd;
+		return linkat(AT_FDCWD, procPath.str().c_str(), dirFd, name.c_str(), AT_SYMLINK_FOLLOW);
+	}
+
+	// Makes the file visible under its name, replacing the previous version in a single step.
+	Option<Error> FileUpload::publish() {
+		if (temporaryName.isNone()) {
+			if (linkAnonymousFile(fd, dirFd, name) == 0) return NONE;
+			if (errno != EEXIST) return uploadError(errno);
+			// The file already exists, so the new version is linked next to it first, and then moved over it.
+			for (int attempt = 0; attempt < 16 && temporaryName.isNone(); attempt++) {
+				std::string tempName = temporaryNameFor(name);
+				if (linkAnonymousFile(fd, dirFd, tempName) == 0) {
+					temporaryName = tempName;
+				}
+				else if (errno != EEXIST) {
+					return uploadError(errno);
+				}
+			}
+			if (temporaryName.isNone()) return uploadError(EEXIST);
+		}
+		if (renameat(dirFd, temporaryName.get().c_str(), dirFd, name.c_str()) != 0) {
+			return uploadError(errno);
+		}
+		temporaryName = NONE;
+		return NONE;
+	}
+
+	void FileUpload::discard() {
+#ifdef LINUX
+		splicePipe.close();
+#endif
+		if (fd >= 0) {
+			close(fd);
+			fd = -1;
+		}
+		// The partial file of a range upload is kept, so that the upload may be resumed.
+		if (temporaryName.isSome() && range.isNone()) {
+			unlinkat(dirFd, temporaryName.get().c_str(), 0);
+			temporaryName = NONE;
+		}
+	}
+
+	SpooledBody::SpooledBody(int fd): fd(fd), finished(false) {}
+
+	// The file has no name where the file system supports that, and loses it right away elsewhere, so that it
+	// disappears along with its descriptor.
+	Result<SpooledBody*, Error> SpooledBody::start() {
+		int fd = -1;
+#ifdef O_TMPFILE
+		fd = ::open(SPOOL_DIRECTORY, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+		if (fd < 0 && errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+			return writeError(errno);
+		}
+#endif
+		if (fd < 0) {
+			std::string path = SPOOL_DIRECTORY "/.webserv-spool-XXXXXX";
+			fd = mkstemp(&path[0]);
+			if (fd < 0) return writeError(errno);
+			unlink(path.c_str());
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+		}
+		return new SpooledBody(fd);
+	}
+
+	SpooledBody::~SpooledBody() {
+		close(fd);
+	}
+
+	Option<Error> SpooledBody::feed(const char* data, size_t length) {
+		if (!writeAll(fd, data, length)) return writeError(errno);
+		return NONE;
+	}
+
+	Result<size_t, Error> SpooledBody::receive(int socketFd, size_t length) {
+#ifdef LINUX
+		Result<Option<size_t>, Error> moved = splicePipe.receive(socketFd, fd, length);
+		if (moved.isError()) return moved.getError();
+		if (moved.getValue().isSome()) return moved.getValue().get();
+#endif
+		return IUploadSink::receive(socketFd, length);
+	}
+
+	Option<Error> SpooledBody::finish() {
+#ifdef LINUX
+		splicePipe.close();
+#endif
+		if (lseek(fd, 0, SEEK_SET) != 0) return writeError(errno);
+		finished = true;
+		return NONE;
+	}
+
+	Option<int> SpooledBody::bodyDescriptor() {
+		if (!finished) return NONE;
+		return fd;
+	}
+
+#ifdef LINUX
+	UploadPipe::UploadPipe(): size(0), unsupported(false) {
+		fds[0] = -1;
+		fds[1] = -1;
+	}
+
+	UploadPipe::~UploadPipe() {
+		close();
+	}
+
+	Result<Option<size_t>, Error> UploadPipe::receive(int socketFd, int fileFd, size_t length) {
+		Option<size_t> unspliced = NONE;
+		if (unsupported || (fds[0] < 0 && !open())) return unspliced;
+		long moved = splice(socketFd, NULL, fds[1], NULL, std::min(length, size), SPLICE_F_MOVE);
+		if (moved < 0) {
+			if (errno != EINVAL) return Error(Error::GENERIC_ERROR, "Socket read failed");
+			unsupported = true;
+			return unspliced;
+		}
+		Option<Error> maybeError = drain(fileFd, moved);
+		if (maybeError.isSome()) return maybeError.get();
+		return Option<size_t>(moved);
+	}
+
+	bool UploadPipe::open() {
+		if (pipe2(fds, O_CLOEXEC) != 0) {
+			fds[0] = -1;
+			fds[1] = -1;
+			return false;
+		}
+		// The pipe only grows as far as the system allows, and keeps its default capacity otherwise.
+		fcntl(fds[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+		int capacity = fcntl(fds[1], F_GETPIPE_SZ);
+		size = capacity > 0 ? capacity : UPLOAD_RECEIVE_SIZE;
+		return true;
+	}
+
+	// Moves everything that was spliced into the pipe on into the file.
+	Option<Error> UploadPipe::drain(int fileFd, size_t length) {
+		while (length > 0) {
+			long moved = -1;
+			if (!unsupported) {
+				moved = splice(fds[0], NULL, fileFd, NULL, length, SPLICE_F_MOVE);
+				if (moved < 0 && errno == EINVAL) unsupported = true;
+			}
+			// The file system of the file can not be spliced into, so the pipe is drained the usual way.
+			if (unsupported) {
+				static char buffer[UPLOAD_RECEIVE_SIZE];
+				moved = read(fds[0], buffer, std::min(length, sizeof(buffer)));
+				if (moved > 0 && !writeAll(fileFd, buffer, moved)) moved = -1;
+			}
+			if (moved <= 0) return writeError(errno);
+			length -= moved;
+		}
+		return NONE;
+	}
+
+	void UploadPipe::close() {
+		if (fds[0] < 0) return;
+		::close(fds[0]);
+		::close(fds[1]);
+		fds[0] = -1;
+		fds[1] = -1;
+	}
+#endif
+}
@@ -6,6 +6,7 @@
 #include "html.hpp"
 #include "http.hpp"
 #include <cctype>
+#include <ctime>
 #include <unistd.h>
 #include "webserv.hpp"
 #include "ystl.hpp"
@@ -126,6 +127,44 @@ namespace Webserv {
 		return result * (negative ? -1 : 1);
 	}
 
+	Option<size_t> strToSize(const std::string& str) {
+		if (str.empty()) return NONE;
+		size_t result = 0;
+		for (uint i = 0; i < str.size(); i++) {
+			if (!std::isdigit(str[i])) return NONE;
+			size_t next = result * 10 + (str[i] - '0');
+			if (next / 10 != result) return NONE; // Overflow
+			result = next;
+		}
+		return result;
+	}
+
+	std::string formatHTTPDate(time_t time) {
+		std::tm tm;
+		gmtime_r(&time, &tm);
+		char buffer[40];
+		size_t len = std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+		return std::string(buffer, len);
+	}
+
+	Option<time_t> parseHTTPDate(const std::string& str) {
+		// IMF-fixdate, followed by the obsolete RFC 850 and asctime formats.
+		const char* formats[] = {
+			"%a, %d %b %Y %H:%M:%S GMT",
+			"%A, %d-%b-%y %H:%M:%S GMT",
+			"%a %b %e %H:%M:%S %Y",
+		};
+		for (uint i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+			std::tm tm;
+			std::memset(&tm, 0, sizeof(tm));
+			const char* end = strptime(str.c_str(), formats[i], &tm);
+			if (end && *end == '\0') {
+				return timegm(&tm);
+			}
+		}
+		return NONE;
+	}
+
 	static bool readErrorPageFromFile(const std::string& filePath, std::string& content) {
 		std::ifstream file(filePath.c_str());
 		if (!file.is_open()) {
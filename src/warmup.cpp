@@ -0,0 +1,283 @@
+#include "warmup.hpp"
+#include "bundle.hpp"
+#include "compression.hpp"
+#include "config.hpp"
+#include "error.hpp"
+#include "http.hpp"
+#include "locationTree.hpp"
+#include "rootDirectory.hpp"
+#include "url.hpp"
+#include "webserv.hpp"
+#include "ystl.hpp"
+#include <algorithm>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+
+typedef Webserv::Config::Server::Location Location;
+
+namespace Webserv {
+	// Extracts the path of a GET request from an access log record, such as
+	// `127.0.0.1 - - [10/Oct/2000:13:55:36 -0700] "GET /index.html HTTP/1.1" 200 2326`.
+	static Option<std::string> requestPathOfRecord(const std::string& record) {
+		size_t requestStart = record.find("\"GET ");
+		if (requestStart == std::string::npos) return NONE;
+		size_t pathStart = requestStart + 5;
+		size_t pathEnd = record.find_first_of(" ?\"", pathStart);
+		if (pathEnd == std::string::npos || pathEnd == pathStart || record[pathStart] != '/') return NONE;
+		return record.substr(pathStart, pathEnd - pathStart);
+	}
+
+	struct RankedPath {
+		std::string path;
+		uint hits;
+	};
+
+	static bool hasMoreHits(const RankedPath& a, const RankedPath& b) {
+		return a.hits > b.hits;
+	}
+
+	std::vector<std::string> readWarmupList(const std::string& path, uint top) {
+		std::vector<std::string> paths;
+		std::vector<RankedPath> ranked;
+		std::map<std::string, size_t> rankIndices;
+
+		std::ifstream list(path.c_str());
+		std::string line;
+		while (std::getline(list, line)) {
+			line = trimString(trimString(line, '\r'), ' ');
+			if (line.empty() || line[0] == '#') continue;
+			if (line[0] == '/') {
+				paths.push_back(line);
+				continue;
+			}
+			Option<std::string> requestPath = requestPathOfRecord(line);
+			if (requestPath.isNone()) continue;
+			std::map<std::string, size_t>::iterator it = rankIndices.find(requestPath.get());
+			if (it != rankIndices.end()) {
+				ranked[it->second].hits++;
+				continue;
+			}
+			RankedPath rankedPath;
+			rankedPath.path = requestPath.get();
+			rankedPath.hits = 1;
+			rankIndices[rankedPath.path] = ranked.size();
+			ranked.push_back(rankedPath);
+		}
+
+		// The paths with the same number of hits keep the order of their first appearance.
+		std::stable_sort(ranked.begin(), ranked.end(), hasMoreHits);
+		for (std::vector<RankedPath>::const_iterator it = ranked.begin(); it != ranked.end(); it++) {
+			paths.push_back(it->path);
+		}
+		if (paths.size() > top) paths.resize(top);
+		return paths;
+	}
+
+	// Progress of the warmup of a single server.
+	struct WarmupState {
+		size_t budget;
+		size_t loaded;
+		uint warmedPaths;
+		uint skippedPaths;
+	};
+
+	static bool fitsBudget(WarmupState& state, size_t size) {
+		if (state.loaded + size > state.budget) return false;
+		state.loaded += size;
+		return true;
+	}
+
+	static void warmUpBundleFile(WarmupState& state, const Location& location, const std::string& filePath) {
+		Result<SharedPtr<Bundle>, Error> bundle = loadBundle(location.bundle.get());
+		if (bundle.isError()) return;
+		const BundleEntry* entry = filePath.empty() ? NULL : bundle.getValue()->find(filePath);
+		if (!entry) {
+			std::string index = location.index.getOr("index.html");
+			entry = bundle.getValue()->find(filePath.empty() ? index : filePath + "/" + index);
+		}
+		if (!entry) {
+			state.skippedPaths++;
+			return;
+		}
+		bool warmed = false;
+		for (int variant = 0; variant < BUNDLE_VARIANT_COUNT; variant++) {
+			if (!(entry->variants & (1 << variant))) continue;
+			if (!fitsBudget(state, entry->contents[variant].length)) continue;
+			bundle.getValue()->prefetch(entry->contents[variant]);
+			warmed = true;
+		}
+		if (warmed) state.warmedPaths++;
+		else state.skippedPaths++;
+	}
+
+	// Reads the whole file beneath the root directory, which leaves it in the page cache.
+	static Option<std::string> readBeneath(const RootDirectory& root, const std::string& relativePath, size_t size) {
+		int fd = openBeneath(root, relativePath, O_RDONLY);
+		if (fd < 0) return NONE;
+		std::string contents(size, '\0');
+		size_t offset = 0;
+		while (offset < size) {
+			long readResult = pread(fd, &contents[offset], size - offset, offset);
+			if (readResult <= 0) break;
+			offset += readResult;
+		}
+		close(fd);
+		if (offset < size) return NONE;
+		return contents;
+	}
+
+	// Loads the file into the page cache without reading it into memory, where the system allows that.
+	static bool loadBeneath(const RootDirectory& root, const std::string& relativePath, size_t size) {
+#ifdef LINUX
+		int fd = openBeneath(root, relativePath, O_RDONLY);
+		if (fd < 0) return false;
+		bool loaded = readahead(fd, 0, size) == 0;
+		close(fd);
+		return loaded;
+#else
+		return readBeneath(root, relativePath, size).isSome();
+#endif
+	}
+
+	// Loads the precompressed sibling of a static file, if there is one.
+	static void warmUpSibling(WarmupState& state, const RootDirectory& root, const std::string& relativePath) {
+		struct stat st;
+		if (statBeneath(root, relativePath, st) < 0 || !S_ISREG(st.st_mode)) return;
+		if (!fitsBudget(state, st.st_size)) return;
+		loadBeneath(root, relativePath, st.st_size);
+	}
+
+	static void warmUpStaticFile(
+		WarmupState& state,
+		const Location& location,
+		const RootDirectory& root,
+		std::string filePath,
+		const std::string& urlPath
+	) {
+		struct stat st;
+		if (statBeneath(root, filePath, st) < 0) {
+			state.skippedPaths++;
+			return;
+		}
+		// The media type comes from the name of the file that is served, as in `serveStaticFile`.
+		Url contentUrl = Url::fromString(urlPath).getOr(Url());
+		if (S_ISDIR(st.st_mode) && !location.dirListing) {
+			std::string index = location.index.getOr("index.html");
+			filePath = filePath.empty() ? index : filePath + "/" + index;
+			contentUrl = contentUrl + Url::fromString(index).getOr(Url());
+			if (statBeneath(root, filePath, st) < 0) {
+				state.skippedPaths++;
+				return;
+			}
+		}
+		if (!S_ISREG(st.st_mode) || !fitsBudget(state, st.st_size)) {
+			state.skippedPaths++;
+			return;
+		}
+
+		// Files that get compressed on the fly are read into memory anyway, to have their compressed form cached.
+		std::string contentType = contentTypeString(getContentType(contentUrl));
+		bool compress = isCompressible(location, contentType) && static_cast<size_t>(st.st_size) >= location.gzipMinLength;
+		bool loaded;
+		if (compress) {
+			Option<std::string> contents = readBeneath(root, filePath, st.st_size);
+			loaded = contents.isSome();
+			if (loaded) {
+				Result<std::string, Error> compressed = compressString(contents.get(), CODING_GZIP, location.gzipLevel);
+				if (compressed.isOk() && fitsBudget(state, compressed.getValue().size())) {
+					std::string identity = staticFileIdentity(root, filePath, st);
+					storeCompressed(CODING_GZIP, location.gzipLevel, identity, compressed.getValue());
+				}
+			}
+		}
+		else {
+			loaded = loadBeneath(root, filePath, st.st_size);
+		}
+		if (!loaded) {
+			state.skippedPaths++;
+			return;
+		}
+		state.warmedPaths++;
+
+		if (location.gzipStatic) warmUpSibling(state, root, filePath + ".gz");
+		if (location.brotliStatic) warmUpSibling(state, root, filePath + ".br");
+	}
+
+	static void warmUpPath(
+		WarmupState& state,
+		const Config::Server& server,
+		const LocationTreeNode& locations,
+		const std::string& path
+	) {
+		Option<Url> url = Url::fromString(path);
+		if (url.isNone()) {
+			state.skippedPaths++;
+			return;
+		}
+		Option<LocationTreeNode::LocationSearchResult> query = locations.tryFindLocation(url.get());
+		if (query.isNone() || query.get().location->redirection.isSome() || query.get().location->allowCGI
+		|| query.get().location->fastcgiPass.isSome()) {
+			state.skippedPaths++;
+			return;
+		}
+		const Location& location = *query.get().location;
+		const std::vector<std::string>& segments = query.get().tail.getSegments();
+		std::string filePath;
+		for (std::vector<std::string>::const_iterator it = segments.begin(); it != segments.end(); it++) {
+			if (!filePath.empty()) filePath += "/";
+			filePath += *it;
+		}
+
+		if (location.bundle.isSome()) {
+			warmUpBundleFile(state, location, filePath);
+			return;
+		}
+		Option<std::string> root = location.root.isSome() ? location.root : server.defaultRoot;
+		if (root.isNone()) {
+			state.skippedPaths++;
+			return;
+		}
+		Result<RootDirectory, Error> rootDir = openRootDirectory(root.get());
+		if (rootDir.isError()) {
+			state.skippedPaths++;
+			return;
+		}
+		warmUpStaticFile(state, location, rootDir.getValue(), filePath, path);
+	}
+
+	void warmUpServer(const Config::Server& server) {
+		if (server.warmupList.isNone()) return;
+		struct timeval startTime;
+		gettimeofday(&startTime, NULL);
+
+		LocationTreeNode locations;
+		for (std::map<std::string, Location>::const_iterator it = server.locations.begin(); it != server.locations.end(); it++) {
+			Option<Url> url = Url::fromString(it->first);
+			if (url.isSome()) locations.insertLocation(url.get(), &it->second);
+		}
+
+		WarmupState state;
+		state.budget = server.warmupBudget;
+		state.loaded = 0;
+		state.warmedPaths = 0;
+		state.skippedPaths = 0;
+		std::vector<std::string> paths = readWarmupList(server.warmupList.get(), server.warmupTop);
+		for (std::vector<std::string>::const_iterator it = paths.begin(); it != paths.end(); it++) {
+			warmUpPath(state, server, locations, *it);
+		}
+
+		struct timeval endTime;
+		gettimeofday(&endTime, NULL);
+		long elapsedMs = (endTime.tv_sec - startTime.tv_sec) * 1000 + (endTime.tv_usec - startTime.tv_usec) / 1000;
+		std::cout << "Warmed up " << state.warmedPaths << " of " << paths.size() << " paths from "
+			<< server.warmupList.get() << " (" << state.loaded << " bytes, " << state.skippedPaths << " skipped) in "
+			<< elapsedMs << " ms" << std::endl;
+	}
+}
@@ -0,0 +1,138 @@
+#include "zeroCopy.hpp"
+#include "ystl.hpp"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef LINUX
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#endif
+
+#if defined(LINUX) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define ZEROCOPY_SUPPORTED
+#endif
+
+namespace Webserv {
+	static ZeroCopyStats stats;
+
+#ifdef ZEROCOPY_SUPPORTED
+	// The kernel numbers zero-copy sends on each socket sequentially, starting from zero, and acknowledges them
+	// by ranges of these numbers. The numbers wrap around, just like the counters here do.
+	struct ZeroCopySocket {
+		size_t threshold;
+		uint32_t sent;
+		uint32_t completed;
+	};
+
+	static std::map<int, ZeroCopySocket> zeroCopySockets;
+
+	static void reportZeroCopyStats(unsigned long newlyCompleted) {
+		unsigned long previouslyCompleted = stats.completedSends - newlyCompleted;
+		if (stats.completedSends / ZEROCOPY_REPORT_INTERVAL == previouslyCompleted / ZEROCOPY_REPORT_INTERVAL) return;
+		unsigned long zeroCopied = stats.completedSends - stats.copiedSends;
+		std::cout << "Zero-copy sends: " << stats.completedSends << " acknowledged, "
+			<< zeroCopied * 100 / stats.completedSends << "% of them without copying, "
+			<< stats.regularSends << " regular sends" << std::endl;
+	}
+
+	// Accounts for a single completion notification of the error queue.
+	static void handleNotification(ZeroCopySocket& state, const struct sock_extended_err& err) {
+		if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY) return;
+		uint32_t count = err.ee_data - err.ee_info + 1;
+		state.completed += count;
+		stats.completedSends += count;
+		if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) stats.copiedSends += count;
+		reportZeroCopyStats(count);
+	}
+#endif
+
+	void setupZeroCopy(int socketFd, const Option<uint>& threshold) {
+#ifdef ZEROCOPY_SUPPORTED
+		zeroCopySockets.erase(socketFd);
+		if (threshold.isNone()) return;
+		int enable = 1;
+		if (setsockopt(socketFd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) < 0) return;
+		ZeroCopySocket state;
+		state.threshold = threshold.get();
+		state.sent = 0;
+		state.completed = 0;
+		zeroCopySockets[socketFd] = state;
+#else
+		(void)socketFd;
+		(void)threshold;
+#endif
+	}
+
+	long sendBuffer(int socketFd, const char* data, size_t length) {
+#ifdef ZEROCOPY_SUPPORTED
+		std::map<int, ZeroCopySocket>::iterator it = zeroCopySockets.find(socketFd);
+		if (it != zeroCopySockets.end()) {
+			if (length >= it->second.threshold) {
+				long sent = send(socketFd, data, length, MSG_ZEROCOPY);
+				if (sent >= 0) {
+					it->second.sent++;
+					stats.zeroCopySends++;
+					return sent;
+				}
+				// The kernel refuses to pin more pages once the socket runs out of its option memory, in which
+				// case the data goes the regular way.
+				if (errno != ENOBUFS) return sent;
+			}
+			stats.regularSends++;
+		}
+#endif
+		return write(socketFd, data, length);
+	}
+
+	bool pollZeroCopy(int socketFd) {
+#ifdef ZEROCOPY_SUPPORTED
+		std::map<int, ZeroCopySocket>::iterator it = zeroCopySockets.find(socketFd);
+		if (it == zeroCopySockets.end()) return false;
+		ZeroCopySocket& state = it->second;
+
+		while (state.completed != state.sent) {
+			char control[128];
+			struct msghdr msg;
+			std::memset(&msg, 0, sizeof(msg));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			if (recvmsg(socketFd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+
+			for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+				|| (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+					struct sock_extended_err err;
+					std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+					handleNotification(state, err);
+				}
+			}
+		}
+		if (state.completed == state.sent) return false;
+
+		// The kernel lets go of the pages once the connection fails, and no data is transmitted after that.
+		int error = 0;
+		socklen_t errorLen = sizeof(error);
+		if (getsockopt(socketFd, SOL_SOCKET, SO_ERROR, &error, &errorLen) == 0 && error != 0) return false;
+		return true;
+#else
+		(void)socketFd;
+		return false;
+#endif
+	}
+
+	void releaseZeroCopy(int socketFd) {
+#ifdef ZEROCOPY_SUPPORTED
+		zeroCopySockets.erase(socketFd);
+#else
+		(void)socketFd;
+#endif
+	}
+
+	const ZeroCopyStats& getZeroCopyStats() {
+		return stats;
+	}
+}
@@ -1,9 +1,13 @@
 #ifndef TASKS
 #define TASKS
 #include "ystl.hpp"
+#include "cgi.hpp"
 #include "dispatcher.hpp"
+#include "fastCGI.hpp"
 #include "http.hpp"
 #include "webserv.hpp"
+#include <map>
+#include <string>
 #include <vector>
 
 namespace Webserv {
@@ -37,6 +41,7 @@ namespace Webserv {
 		RequestHandler(const ServerData&, int);
 		Option<Error> sendError(FDTaskDispatcher&, Error);
 		Option<Error> finalize(FDTaskDispatcher&);
+		Result<bool, Error> receiveUpload(FDTaskDispatcher&);
 
 		//declarations for custom error pages
 		bool readErrorPageFromFile(const std::string& filePath, std::string& content);
@@ -48,6 +53,11 @@ namespace Webserv {
 		Option<LocationTreeNode::LocationSearchResult> location;
 		Option<uint> dataSizeLimit;
 		bool chunked;
+
+		// The upload that the body is streamed into, instead of being collected in memory, and the number of bytes
+		// of the body that are yet to arrive.
+		Option<SharedPtr<IUploadSink> > upload;
+		size_t uploadRemaining;
 	};
 
 	// `ResponseHandler` is a task that is responsible for building a HTTP response and sending it back to the client.
@@ -63,9 +73,62 @@ namespace Webserv {
 	private:
 		ResponseHandler(ConnectionInfo&, const HTTPResponse&);
 
+		// Finishes the task once the response is sent. The buffers of the response must stay intact until the
+		// kernel acknowledges the zero-copy sends made out of them, so the task may have to wait for that first.
+		bool finish(FDTaskDispatcher&);
+
 		ConnectionInfo conn;
 		Option<HTTPResponse> response;
 		Option<std::string> writeStr;
+		size_t writeOffset;
+		bool awaitingZeroCopy;
+	};
+
+	// `GroupCommitter` is a task that holds the responses to uploads back until the uploaded files reach the disk.
+	// The uploads that complete within a short window are synced together, with a single `syncfs` per file system,
+	// which costs about as much as syncing a single one of them would. A committer lives for a single window, and
+	// the next upload starts a new one.
+	//
+	// Syncing a file system may take seconds, so it happens in a process of its own, which reports whether each of
+	// the uploads was synced through a pipe. The committer waits for that report in place of the window once the
+	// window has ended.
+	class GroupCommitter: public IFDTask {
+	public:
+		// Holds the response back until the file system of `syncFd` is synced, which happens at most `delayMs`
+		// milliseconds later. Takes the ownership of the descriptor.
+		static void enqueue(FDTaskDispatcher&, int syncFd, const SharedPtr<IFDTask>& response, uint delayMs);
+
+		Result<bool, Error> runTask(FDTaskDispatcher&);
+		~GroupCommitter();
+	private:
+		struct PendingCommit {
+			int syncFd;
+			SharedPtr<IFDTask> response;
+		};
+
+		// Makes a committer that waits for the timer of its window, or for the report of the process that syncs its
+		// uploads.
+		GroupCommitter(int fd, const Option<pid_t>& syncer);
+		GroupCommitter(const GroupCommitter&); // No implementation
+		GroupCommitter& operator=(const GroupCommitter&); // No implementation
+
+		// Starts syncing the file systems of the pending uploads, and takes them over.
+		static void commit(FDTaskDispatcher&, std::vector<PendingCommit>&);
+
+		// Syncs the file systems of the uploads, and returns a '1' for each of the uploads that was synced (or a '0').
+		static std::string sync(const std::vector<PendingCommit>&);
+
+		// Releases the responses of the uploads, with the report of `sync` on them.
+		static void release(FDTaskDispatcher&, std::vector<PendingCommit>&, const std::string& synced);
+
+		std::vector<PendingCommit> pending;
+		// The process that syncs the pending uploads, once the window has ended.
+		Option<pid_t> syncer;
+		// The report of the process received so far.
+		std::string report;
+
+		// The committer that is waiting for its window to end, if any.
+		static GroupCommitter* current;
 	};
 
 	class CGIWriter: public IFDTask, public IFDConsumer {
@@ -83,9 +146,144 @@ namespace Webserv {
 		int fd;
 		bool continuous;
 		bool closed;
-		std::vector<std::string> writeBuffer;
+		std::string writeBuffer;
+		// Part of the buffer that was already written.
+		size_t writeOffset;
 	};
 
+	// `CGIOutput` is the body of a CGI response on its way from the script to the client. The reader of the script
+	// fills it as the output arrives, and the response handler drains it. The reader is paused while too much of the
+	// body waits to be sent, and the response handler is paused while none of it does.
+	//
+	// On Linux, output that goes to the client as it is (neither compressed nor dechunked) is spliced from the pipe
+	// of the script into the socket instead, so that it never enters the server. The reader then leaves the output
+	// in the pipe, and only wakes the response handler up once there is more of it, or once it has ended.
+	class CGIOutput {
+	public:
+		// `length` is the length that the script has announced, if any. The output past it is dropped. A reader
+		// descriptor of -1 makes a reader that is never paused.
+		CGIOutput(FDTaskDispatcher&, int readerFd, int socketFd, const Option<size_t>& length);
+		~CGIOutput();
+
+		// Adds the next piece of the output (once the header block is taken off it).
+		void append(const std::string&);
+
+		// Ends the body. A body that has failed breaks the connection once the rest of it is sent.
+		void finish(bool failed);
+
+		// Takes the output that waits to be sent. Returns false once there is no more of it.
+		Result<bool, Error> take(std::string& out);
+
+		// Tells the output that nobody is going to take it anymore, as the response is gone.
+		void abandon();
+		bool isAbandoned() const;
+
+		// Tells the output that its reader is gone.
+		void detachReader();
+
+		bool isSpliced() const;
+
+		// Tells the spliced output that there is more of it in the pipe.
+		void pipeReadable();
+#ifdef LINUX
+
+		// Sends the next part of the output into the socket, spliced from the pipe and framed as the body of the
+		// response. The output is spliced from the first call on. Returns false once all of it is sent.
+		Result<bool, Error> transmit();
+#endif
+	private:
+		bool clientGone() const;
+#ifdef LINUX
+		Result<bool, Error> flush();
+#endif
+
+		FDTaskDispatcher& dispatcher;
+		int readerFd;
+		int socketFd;
+		Option<size_t> remaining;
+		std::string buffer;
+		bool finished;
+		bool failed;
+		bool abandoned;
+		bool readerPaused;
+		bool socketPaused;
+		bool spliced;
+		// The pipe of the script, which the output is spliced from.
+		int pipeFd;
+		// Part of the buffer that was already sent, and the part of the current chunk that is yet to be spliced, when
+		// the output is spliced.
+		size_t sentOffset;
+		size_t chunkRemaining;
+		bool lastChunkSent;
+	};
+
+	// `CGIResponseStream` makes the response to a request out of the output of its script, for CGI scripts and
+	// FastCGI applications alike. It collects the header block, starts the response once the block is complete, and
+	// passes the rest of the output on to the body, with the chunked encoding that the script may have applied taken
+	// off it. The backend only says how the body gets the output.
+	class CGIResponseStream {
+	public:
+		CGIResponseStream();
+		CGIResponseStream(const SharedPtr<ResponseHandler>&);
+
+		// Makes the body compressed according to the location and the client's preferences.
+		void setCompression(const Config::Server::Location&, const Option<std::string>& acceptEncoding);
+
+		// Adds the next piece of the output to the header block. Returns true once the block is complete, with
+		// `response` set up with it, and an error if it is malformed or too large.
+		Result<bool, Error> takeHeaders(const std::string& data, HTTPResponse& response);
+
+		// Takes the framing off the parsed response, and makes the output that its body is streamed from, unless the
+		// response has no body. The reader of `readerFd` is paused while the client falls behind (-1 for none).
+		Option<SharedPtr<CGIOutput> > openOutput(FDTaskDispatcher&, HTTPResponse& response, int readerFd);
+
+		// Starts the response, with a body that takes the output through `producer` if it has one. The output may be
+		// spliced into the socket if `splice` is set. Some of the body may have come along with the header block, so
+		// that part is passed on right away.
+		void start(HTTPResponse& response, const Option<SharedPtr<IBodyProducer> >& producer, bool splice);
+
+		// Hands the response over to the response handler. The stream lets go of the handler from then on, so that
+		// the handler (and the body with it) is left to the dispatcher, and the output is abandoned once the client
+		// is gone.
+		void respond(const HTTPResponse&);
+		void respondWithError(const Error&);
+
+		// Passes the next piece of the output on to the body. The output is dropped once the body has ended.
+		void pass(const std::string& data);
+
+		// Ends the body, if it is under way.
+		void endOutput(bool failed);
+
+		// Ends the response once the script is done. A body that is under way is cut short if there is an error, or
+		// if the script has chunked it and not finished it; a response that has not started gets the error.
+		void end(const Option<Error>& error);
+
+		// Lets go of the output without ending it, as nobody is going to take it anymore.
+		void detachOutput();
+
+		bool hasStarted() const;
+		Option<SharedPtr<CGIOutput> > getOutput() const;
+		SharedPtr<ResponseHandler> getResponseHandler() const;
+
+		// The output that is yet to make up a complete header block.
+		const std::string& getHeaderBuffer() const;
+	private:
+		// The response handler is held until the response starts.
+		SharedPtr<ResponseHandler> responseHandler;
+		bool started;
+		std::string headerBuffer;
+		Option<SharedPtr<CGIOutput> > output;
+		Option<size_t> length;
+		// Chunked transfer encoding that the script has applied to its output itself, which is taken off it.
+		bool dechunk;
+		std::string chunkBuffer;
+		const Config::Server::Location* compressionLocation;
+		Option<std::string> acceptEncoding;
+	};
+
+	// `CGIReader` is a task that reads the output of a script. The header block of the output makes up the response,
+	// which is handed to the response handler as soon as it is complete, and the rest of the output is streamed to
+	// the client as it arrives.
 	class CGIReader: public IFDTask {
 	public:
 		CGIReader(
@@ -95,34 +293,180 @@ namespace Webserv {
 			int fd,
 			uint rSize
 		);
+		~CGIReader();
 
 		Result<bool, Error> runTask(FDTaskDispatcher&);
 		int getDescriptor() const;
 		IOMode getIOMode() const;
 		std::string readAll();
 		void setWriter(const SharedPtr<CGIWriter> wPtr);
+
+		// Makes the script run by a pooled worker, which is checked back into the pool once the script is done.
+		void setWorker(CGIWorkerPool*, const CGIWorker&);
+
+		// Makes the output of the script compressed according to the location and the client's preferences.
+		void setCompression(const Config::Server::Location&, const Option<std::string>& acceptEncoding);
 		Option<SharedPtr<CGIWriter> > getWriter();
 		SharedPtr<ResponseHandler> getResponseHandler();
 	private:
+		// Starts the response once its header block is complete, with the rest of the output as its body.
+		void startResponse(FDTaskDispatcher&, HTTPResponse&);
+		void passOutput(const std::string&);
+
+		// Reads the next piece of the output.
+		Result<bool, Error> readOutput(FDTaskDispatcher&);
+
+		// Reaps the script once its output has ended, and ends the response.
+		Result<bool, Error> endScript(FDTaskDispatcher&);
+
 		int fd;
 		int pid;
 		uint readSize;
-		std::vector<std::string> readBuffer;
+		CGIResponseStream stream;
 		Option<SharedPtr<CGIWriter> > writer;
-		SharedPtr<ResponseHandler> responseHandler;
 		ConnectionInfo connectionInfo;
+		CGIWorkerPool* pool;
+		Option<CGIWorker> worker;
 	};
 
-	typedef std::pair<SharedPtr<CGIWriter>, SharedPtr<CGIReader> > CGIPipeline;
-	Result<CGIPipeline, Error> makeCGIPipeline(
+	// Starts the script, and returns the reader of its output. The body of the request is read by the script out of
+	// `bodyFile` if it was spooled into one, and out of the request otherwise.
+	Result<SharedPtr<CGIReader>, Error> makeCGIPipeline(
 		ConnectionInfo conn,
 		const Url& binaryLocation,
 		const Url& scriptLocation,
 		const Url& extraPath,
 		const HTTPRequest& request,
-		char** envp,
+		const Option<int>& bodyFile,
+		const CGIEnvironment& environment,
+		CGIWorkerPool* pool,
 		uint readBufferSize
 	);
+
+	class FastCGIReader;
+	class FastCGIWriter;
+	class FastCGIOutputProducer;
+
+	// `FastCGIConnection` is a connection to a FastCGI application, which is kept open for the requests that follow
+	// once its request has ended. An application that can multiplex is sent multiple requests over a connection at
+	// once; other applications get a connection per concurrent request. Whether the application can multiplex is
+	// asked with `FCGI_GET_VALUES` as soon as a connection is opened.
+	//
+	// The body of a request is sent a record at a time, as the records queued before it go out. The response starts
+	// as soon as the application has sent its header block, and the rest of its output is streamed to the client as
+	// it arrives, the same way the output of a CGI script is. The connection of an application that does not
+	// multiplex is paused while the client falls behind; the others are not, so as not to hold up the other requests
+	// on the connection. A request whose client is gone is aborted with `FCGI_ABORT_REQUEST`.
+	class FastCGIConnection {
+	public:
+		// Sends a request to the application at `address`, over a connection that has room for it, or over a new
+		// one. Returns the task that writes the request out, which the response handler and (for a new connection)
+		// the reader of the connection come along with.
+		static Result<SharedPtr<FastCGIWriter>, Error> submit(
+			ConnectionInfo conn,
+			const std::string& address,
+			const std::map<std::string, std::string>& params,
+			const std::string& body,
+			const Config::Server::Location& location,
+			const Option<std::string>& acceptEncoding
+		);
+	private:
+		// A request that was sent over the connection, and whose response is being received.
+		struct Exchange {
+			CGIResponseStream stream;
+			// The body of the request, and the part of it that was already queued.
+			std::string body;
+			size_t bodyOffset;
+			bool bodyQueued;
+			bool aborted;
+		};
+
+		FastCGIConnection(const std::string& address, int fd);
+		FastCGIConnection(const FastCGIConnection&); // No implementation
+		FastCGIConnection& operator=(const FastCGIConnection&); // No implementation
+
+		bool hasRoom() const;
+		ushort unusedRequestId() const;
+
+		// Writes out as much of the queued records as the socket takes. Returns true if some are left.
+		Result<bool, Error> send(int fd);
+
+		// Queues the next record of a request body that is yet to be sent. Returns false if there are none.
+		bool queueBody();
+
+		// Reads whatever the application has sent, and handles the records that it completes. Returns false once
+		// the connection is closed.
+		Result<bool, Error> receive(FDTaskDispatcher&);
+		void handleRecord(FDTaskDispatcher&, const FastCGIRecord&);
+		void handleOutput(FDTaskDispatcher&, ushort requestId, Exchange&, const std::string& content);
+
+		// Starts the response once its header block is complete, with the rest of the output as its body.
+		void startResponse(FDTaskDispatcher&, ushort requestId, Exchange&, HTTPResponse&);
+		void endExchange(ushort requestId, const std::string& content);
+
+		// Aborts the request whose response body is `output`, as its client is gone. The rest of its output is
+		// dropped until the application ends it.
+		static void abort(
+			SharedPtr<FastCGIConnection>,
+			ushort requestId,
+			const CGIOutput* output,
+			FDTaskDispatcher&
+		);
+
+		// Closes the connection for new requests, and fails the requests that are still waiting for a response.
+		void fail(const Error&);
+
+		std::string address;
+		int fd;
+		std::string outBuffer;
+		size_t outOffset;
+		FastCGIRecordParser parser;
+		std::map<ushort, Exchange> exchanges;
+		bool multiplexed;
+		uint maxRequests;
+		bool closed;
+		// Writers that are sending the queue of the connection.
+		uint writers;
+
+		// Open connections, by the address of their application.
+		static std::map<std::string, std::vector<SharedPtr<FastCGIConnection> > > connections;
+
+		friend class FastCGIReader;
+		friend class FastCGIWriter;
+		friend class FastCGIOutputProducer;
+	};
+
+	// `FastCGIReader` is a task that receives the records sent over a connection to a FastCGI application, and
+	// passes the responses they carry on to the response handlers of their requests. It lives as long as the
+	// connection does.
+	class FastCGIReader: public IFDTask {
+	public:
+		FastCGIReader(const SharedPtr<FastCGIConnection>&);
+		Result<bool, Error> runTask(FDTaskDispatcher&);
+	private:
+		SharedPtr<FastCGIConnection> connection;
+	};
+
+	// `FastCGIWriter` is a task that sends the records queued on a connection to a FastCGI application. Every request
+	// comes with a writer of its own, on a duplicate of the descriptor of the connection, which ends once the queue
+	// is empty (an aborted request gets one too, if none is left). The writers of a connection all send out of the
+	// same queue, so the records go out in order however many writers there are.
+	class FastCGIWriter: public IFDTask {
+	public:
+		FastCGIWriter(int fd, const SharedPtr<FastCGIConnection>&, const SharedPtr<ResponseHandler>&);
+		~FastCGIWriter();
+		Result<bool, Error> runTask(FDTaskDispatcher&);
+		SharedPtr<ResponseHandler> getResponseHandler();
+
+		// Returns the reader of the connection, if the connection was opened for this request.
+		Option<SharedPtr<FastCGIReader> > getReader();
+	private:
+		SharedPtr<FastCGIConnection> connection;
+		SharedPtr<ResponseHandler> responseHandler;
+		Option<SharedPtr<FastCGIReader> > reader;
+
+		friend class FastCGIConnection;
+	};
 }
 
 #endif
\ No newline at end of file
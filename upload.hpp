@@ -0,0 +1,252 @@
+#ifndef UPLOAD_HPP
+#define UPLOAD_HPP
+
+#include "compression.hpp"
+#include "config.hpp"
+#include "rootDirectory.hpp"
+#include "ystl.hpp"
+#include <cstddef>
+#include <string>
+
+// Largest piece of an upload body that is read from the socket at once.
+#ifndef UPLOAD_RECEIVE_SIZE
+#define UPLOAD_RECEIVE_SIZE 65536
+#endif
+
+// Largest piece of a compressed upload body that is decoded at once.
+#ifndef DECODE_SLICE_SIZE
+#define DECODE_SLICE_SIZE 4096
+#endif
+
+// Capacity requested for the pipes that upload bodies are spliced through.
+#ifndef UPLOAD_PIPE_SIZE
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+#endif
+
+// Smallest request body that is spooled into a file for a CGI script, instead of being read into memory.
+#ifndef SPOOL_MIN_SIZE
+#define SPOOL_MIN_SIZE 65536
+#endif
+
+// Directory that the request bodies passed on to CGI scripts are spooled into.
+#ifndef SPOOL_DIRECTORY
+#define SPOOL_DIRECTORY "/tmp"
+#endif
+
+namespace Webserv {
+	struct Error;
+
+	typedef Config::Server::Location::Durability Durability;
+
+	// The part of a file that the body of a request carries, as stated by its `Content-Range` header.
+	struct ContentRange {
+		size_t first;
+		size_t last;
+		size_t total;
+	};
+
+	// Parses a `Content-Range` header of the form `bytes <first>-<last>/<total>`.
+	Option<ContentRange> parseContentRange(const std::string& header);
+
+	// Returns the number of bytes received so far by a resumable upload of the file, or nothing if there is no
+	// such upload in progress.
+	Option<size_t> receivedUploadSize(const RootDirectory& root, const std::string& relativePath);
+
+	// Moves the file (or directory) to another path beneath the root directory, in a single step. Unless `replace`
+	// is set, an existing destination is left alone and the move fails with `412 Precondition Failed`. Returns
+	// true if the destination existed before.
+	Result<bool, Error> moveFile(
+		const RootDirectory& root,
+		const std::string& from,
+		const std::string& to,
+		bool replace,
+		Durability durability
+	);
+
+	// Copies the file to another path beneath the root directory. The copy is stored just like an upload, so it
+	// replaces the destination in a single step. Returns true if the destination existed before.
+	Result<bool, Error> copyFile(
+		const RootDirectory& root,
+		const std::string& from,
+		const std::string& to,
+		bool replace,
+		Durability durability
+	);
+
+	// `IUploadSink` is a destination that the body of an upload request is written into as it arrives, so that
+	// the body never has to be held in memory as a whole.
+	class IUploadSink {
+	public:
+		virtual ~IUploadSink();
+
+		// Writes out the next piece of the body.
+		virtual Option<Error> feed(const char* data, size_t length) = 0;
+
+		// Receives the next piece of the body (at most `length` bytes) from the socket. Returns the number of
+		// bytes received, which is zero once the client has closed the connection. By default, the body is read
+		// into a buffer and fed to the upload.
+		virtual Result<size_t, Error> receive(int socketFd, size_t length);
+
+		// Completes the upload, once all of the body was fed. An upload that is destroyed without being finished
+		// leaves no trace of itself.
+		virtual Option<Error> finish() = 0;
+
+		// Returns a descriptor on the file system that the finished upload was stored on, if the file system is
+		// yet to be synced before the upload may be acknowledged. The caller takes the ownership of it.
+		virtual Option<int> takeSyncDescriptor();
+
+		// Returns a descriptor of the file that the finished body was spooled into (positioned at its start), if
+		// the body is kept for whoever handles the request. The upload keeps the ownership of it.
+		virtual Option<int> bodyDescriptor();
+	};
+
+#ifdef LINUX
+	// `UploadPipe` moves the body of an upload from the socket into a file through a pipe with `splice`, so that
+	// the body is never copied into the memory of the server.
+	class UploadPipe {
+	public:
+		UploadPipe();
+		~UploadPipe();
+
+		// Moves up to `length` bytes of the body from the socket into the file. Returns the number of bytes moved
+		// (zero once the client has closed the connection), or nothing if the socket can not be spliced from, in
+		// which case the body has to be received the usual way.
+		Result<Option<size_t>, Error> receive(int socketFd, int fileFd, size_t length);
+		void close();
+	private:
+		UploadPipe(const UploadPipe&); // No implementation
+		UploadPipe& operator=(const UploadPipe&); // No implementation
+
+		bool open();
+		Option<Error> drain(int fileFd, size_t length);
+
+		int fds[2];
+		// Capacity of the pipe.
+		size_t size;
+		bool unsupported;
+	};
+#endif
+
+	// `DecodingUpload` decodes a compressed body as it arrives, and passes the decoded body on to another upload.
+	class DecodingUpload: public IUploadSink {
+	public:
+		DecodingUpload(const SharedPtr<IUploadSink>& target, ContentCoding, size_t maxSize, uint maxRatio);
+
+		Option<Error> feed(const char* data, size_t length);
+		Option<Error> finish();
+		Option<int> takeSyncDescriptor();
+		Option<int> bodyDescriptor();
+	private:
+		DecodingUpload(const DecodingUpload&); // No implementation
+		DecodingUpload& operator=(const DecodingUpload&); // No implementation
+
+		SharedPtr<IUploadSink> target;
+		Decompressor decompressor;
+		std::string decoded;
+	};
+
+	// `FileUpload` stores the body of a request as a file beneath the root directory. The body is written into an
+	// anonymous temporary file in the target directory (or a hidden one, where the file system has no support for
+	// those), which only replaces the target once the body is complete. So readers see either the previous
+	// version of the file or the new one in its entirety, and never a part of it. The space for the file is
+	// allocated up front when the size of the body is known, which keeps large files from getting fragmented.
+	//
+	// The body is taken as is, so on Linux it is moved from the socket into the file through a pipe with
+	// `splice`, without ever being copied into the memory of the server.
+	//
+	// With file durability, the contents are synced before the file is published, and the directory right after.
+	// With group durability, syncing is left to the caller, which syncs the whole file system once for all the
+	// uploads completed within a short window (on Linux; elsewhere it works just like file durability).
+	//
+	// A large file may also be uploaded in ranges, with a PUT request per range. The ranges are collected in a
+	// partial file, which stays around when a request breaks off, so that the client may resume the upload from
+	// the end of it instead of starting over. The partial file replaces the file once the last range is in.
+	class FileUpload: public IUploadSink {
+	public:
+		static Result<FileUpload*, Error> start(
+			const RootDirectory& root,
+			const std::string& relativePath,
+			Option<size_t> size,
+			Durability durability = Config::Server::Location::DURABILITY_NONE
+		);
+
+		// Starts storing a range of the file into its partial file. The range has to start within the part of the
+		// file that was already received, so that the partial file never has gaps.
+		static Result<FileUpload*, Error> resume(
+			const RootDirectory& root,
+			const std::string& relativePath,
+			const ContentRange& range,
+			Durability durability = Config::Server::Location::DURABILITY_NONE
+		);
+		~FileUpload();
+
+		Option<Error> feed(const char* data, size_t length);
+		Result<size_t, Error> receive(int socketFd, size_t length);
+		Option<Error> finish();
+		Option<int> takeSyncDescriptor();
+
+		// Fills the file with the contents of another file, which are never read into the memory of the server.
+		Option<Error> copyFrom(int sourceFd, size_t length);
+
+		// Returns true once the whole file is stored under its name. A range upload is only complete once its last
+		// range is in.
+		bool isComplete() const;
+	private:
+		FileUpload(const RootDirectory& root, const std::string& relativePath, int dirFd, Durability);
+		FileUpload(const FileUpload&); // No implementation
+		FileUpload& operator=(const FileUpload&); // No implementation
+
+		static Result<FileUpload*, Error> open(
+			const RootDirectory& root,
+			const std::string& relativePath,
+			Durability durability
+		);
+		Option<Error> openTemporaryFile();
+		Option<Error> openPartialFile(const ContentRange& range);
+		Option<Error> publish();
+		void discard();
+
+		RootDirectory root;
+		std::string relativePath;
+		std::string name;
+		int dirFd;
+		int fd;
+		Durability durability;
+		// The range of the file that is being stored, if the file is uploaded in ranges.
+		Option<ContentRange> range;
+		// Name of the temporary file within the directory, if the file has one yet.
+		Option<std::string> temporaryName;
+		size_t written;
+		size_t allocated;
+		bool finished;
+#ifdef LINUX
+		UploadPipe splicePipe;
+#endif
+	};
+
+	// `SpooledBody` keeps the body of a request in an anonymous temporary file, so that a CGI script can read the
+	// file as its standard input once the body has arrived, and the body is never held in memory. On Linux, the
+	// body is spliced into the file just like the body of a `FileUpload`.
+	class SpooledBody: public IUploadSink {
+	public:
+		static Result<SpooledBody*, Error> start();
+		~SpooledBody();
+
+		Option<Error> feed(const char* data, size_t length);
+		Result<size_t, Error> receive(int socketFd, size_t length);
+		Option<Error> finish();
+		Option<int> bodyDescriptor();
+	private:
+		SpooledBody(int fd);
+		SpooledBody(const SpooledBody&); // No implementation
+		SpooledBody& operator=(const SpooledBody&); // No implementation
+
+		int fd;
+		bool finished;
+#ifdef LINUX
+		UploadPipe splicePipe;
+#endif
+	};
+}
+
+#endif
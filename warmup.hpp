@@ -0,0 +1,21 @@
+#ifndef WARMUP_HPP
+#define WARMUP_HPP
+
+#include "config.hpp"
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+namespace Webserv {
+	// Reads the hot paths out of a warmup list. Lines that start with a slash are taken as paths as they are, in
+	// their order. Other lines are parsed as access log records (such as the ones of the common log format), whose
+	// requested paths are ranked by the number of hits, and follow the listed ones. At most `top` paths are returned.
+	std::vector<std::string> readWarmupList(const std::string& path, uint top);
+
+	// Loads the files behind the hot paths of the server into the page cache, and their compressed
+	// representations into the compression cache, until the warmup budget of the server runs out. Files of bundled
+	// locations are brought into memory out of their bundles. Reports how long the warmup took.
+	void warmUpServer(const Config::Server&);
+}
+
+#endif
@@ -2,11 +2,14 @@
 #define WEBSERV_HPP
 
 #include <fstream>
+#include "bundle.hpp"
 #include "config.hpp"
 #include "dispatcher.hpp"
 #include "error.hpp"
 #include "http.hpp"
 #include "locationTree.hpp"
+#include "upload.hpp"
+#include "rootDirectory.hpp"
 #include "url.hpp"
 #include "ystl.hpp"
 #include <netinet/in.h>
@@ -36,8 +39,10 @@ namespace Webserv {
 		LocationTreeNode locations;
 		std::set<std::string> serverNames;
 		std::map<std::string, std::string> cgiInterpreters;
+		std::map<std::string, std::string> fastcgiApplications;
 		char** envp;
 		uint messageBufferSize;
+		Option<uint> zeroCopyThreshold;
 	};
 
 	// This struct will contain all the necessary details about current connection to the client.
@@ -49,25 +54,92 @@ namespace Webserv {
 	// A simple function that returns the layout of error page in HTML format as a string.
 	std::string makeErrorPage(Error);
 
+	// Options that select which part of a directory listing gets generated, and in what order its entries go.
+	struct DirListingOptions {
+		enum SortKey {
+			SORT_NONE,
+			SORT_NAME,
+			SORT_MTIME,
+			SORT_SIZE,
+		};
+
+		// Constructs the options for a complete, unsorted listing.
+		DirListingOptions();
+
+		// Reads the options from `sort`, `order`, `page` and `limit` query parameters of the url.
+		static DirListingOptions fromUrl(const Url&);
+
+		// Returns a string that uniquely identifies these options.
+		std::string toString() const;
+
+		SortKey sortKey;
+		bool descending;
+		uint page;
+		Option<uint> limit;
+	};
+
 	// A function that constructs a directory listing for the provided path.
 	// If `topLevel` is set to true, the generated listing must not contain a
 	// listing for the parent directory; in other words - no `..` allowed if
 	// `topLevel` is true.
-	std::string makeDirectoryListing(
-		const std::string& diskPath,
+	// Listings that were already rendered are returned from the cache, while the rest are generated
+	// incrementally, as a stream of bounded batches of directory entries.
+	Result<SharedPtr<IResponseBody>, Error> makeDirectoryListing(
+		const RootDirectory& root,
+		const std::string& relativePath,
 		const std::string& urlPath,
 		bool topLevel = true,
-		bool fileUploads = false
+		bool fileUploads = false,
+		const DirListingOptions& options = DirListingOptions()
+	);
+
+	// Responds with the contents of the file at `relativePath` beneath the root directory, which are sent straight
+	// from the file with `sendfile`.
+	// Handles `Range` and `If-Range` headers, responding with partial content when the client asks for it.
+	// Conditional requests (`If-None-Match`, `If-Modified-Since`) are answered from the file metadata alone,
+	// without opening the file.
+	Result<SharedPtr<IFDTask>, Error> serveStaticFile(
+		ConnectionInfo conn,
+		const HTTPRequest& request,
+		const Config::Server::Location& location,
+		const RootDirectory& root,
+		const std::string& relativePath,
+		HTTPContentType contentType
+	);
+
+	// Returns the identity of the contents of a static file, under which its compressed representations are cached.
+	std::string staticFileIdentity(const RootDirectory& root, const std::string& relativePath, const struct stat& st);
+
+	// Responds with a file from the bundle of the location, which is sent straight out of the mapping of the
+	// bundle. The precompressed variants and entity tags of the file are taken from the bundle as well.
+	Result<SharedPtr<IFDTask>, Error> serveBundleFile(
+		ConnectionInfo conn,
+		const HTTPRequest& request,
+		const Config::Server::Location& location,
+		const SharedPtr<Bundle>& bundle,
+		const BundleEntry& entry,
+		HTTPContentType contentType
 	);
 
 	// Reads everything from the input stream.
 	std::string readAll(std::ifstream&);
 
+	// Handles the request. If `uploadStored` is set, the uploaded files have already been stored while the body
+	// was being read. `spooledBody` is the file that the body was spooled into instead of memory, if any.
 	Result<SharedPtr<IFDTask>, Error> handleRequest(
 		HTTPRequest& request,
 		LocationTreeNode::LocationSearchResult& query,
 		ServerData& sData,
-		int clientSocketFd);
+		int clientSocketFd,
+		bool uploadStored = false,
+		const Option<int>& spooledBody = NONE);
+
+	// Starts storing the request body as it arrives, if the request is a file upload (a PUT of a file, or a
+	// multipart upload into the location). Returns nothing if the body has to be read in full first.
+	Result<Option<SharedPtr<IUploadSink> >, Error> startUpload(
+		const HTTPRequest::Builder& builder,
+		const LocationTreeNode::LocationSearchResult& query,
+		const ServerData& sData);
 
 	Option<uint> hexStrToUInt(const std::string&);
 
@@ -75,6 +147,15 @@ namespace Webserv {
 
 	Option<int> strToInt(const std::string& str);
 
+	// Parses a non-negative decimal number that may be too large for an `int` (such as a file size).
+	Option<size_t> strToSize(const std::string& str);
+
+	// Formats the time as an HTTP date (e.g. `Sun, 06 Nov 1994 08:49:37 GMT`).
+	std::string formatHTTPDate(time_t time);
+
+	// Parses an HTTP date in any of the formats allowed by RFC 9110.
+	Option<time_t> parseHTTPDate(const std::string& str);
+
 	Option<Error> sendErrorPage(
 		ConnectionInfo conn,
 		ServerData sData,
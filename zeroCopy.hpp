@@ -0,0 +1,55 @@
+#ifndef ZERO_COPY_HPP
+#define ZERO_COPY_HPP
+
+#include "ystl.hpp"
+#include <cstddef>
+#include <sys/types.h>
+
+// The statistics of zero-copy sends are reported after every this many acknowledged sends.
+#ifndef ZEROCOPY_REPORT_INTERVAL
+#define ZEROCOPY_REPORT_INTERVAL 1000
+#endif
+
+namespace Webserv {
+	// Sending with `MSG_ZEROCOPY` makes the kernel transmit the data straight out of the pages of the sender instead
+	// of copying it into the socket buffer. The send returns before the data is transmitted, so the buffer has to
+	// stay intact until the kernel acknowledges the send with a notification on the error queue of the socket.
+	// Pinning the pages has its own cost, so only large buffers are worth it.
+
+	// Counters of the sends made on the sockets with zero-copy enabled.
+	struct ZeroCopyStats {
+		// Sends that were made with `MSG_ZEROCOPY`.
+		unsigned long zeroCopySends;
+
+		// Sends that were made the regular way, because they were below the threshold (or the kernel refused to
+		// pin the pages).
+		unsigned long regularSends;
+
+		// Zero-copy sends that the kernel has acknowledged.
+		unsigned long completedSends;
+
+		// Acknowledged sends for which the kernel ended up copying the data after all (such as the ones over the
+		// loopback interface).
+		unsigned long copiedSends;
+	};
+
+	// Enables zero-copy sends of the buffers of at least `threshold` bytes on a freshly accepted socket, or
+	// disables them if no threshold is given. Zero-copy sends are only available on Linux.
+	void setupZeroCopy(int socketFd, const Option<uint>& threshold);
+
+	// Sends the buffer into the socket, with `MSG_ZEROCOPY` if the socket has it enabled and the buffer is large
+	// enough. The buffer must stay intact until `pollZeroCopy` reports no pending sends. Returns the result of
+	// the send, just like `write` does.
+	long sendBuffer(int socketFd, const char* data, size_t length);
+
+	// Collects the completion notifications of the socket. Returns true while some zero-copy sends on the socket
+	// are yet to be acknowledged, unless the connection has failed and will not transmit anything anymore.
+	bool pollZeroCopy(int socketFd);
+
+	// Forgets the zero-copy state of the socket, before it is closed.
+	void releaseZeroCopy(int socketFd);
+
+	const ZeroCopyStats& getZeroCopyStats();
+}
+
+#endif